@@ -63,52 +63,195 @@ debugger(void)
  return return_value;
 }
 
-/*! Wrapper for the system call that allocates a memory block
- *  @param length integer holding the number of bytes to allocate
+/*! Wrapper for the system call that moves the break of a heap.
+ *  @param increment signed number of bytes to move the break by.
+ *  @param flags SBRK_HUGE_PAGES or zero.
+ *  Returns the old break or an error code.
  */
 static inline void *
-alloc(unsigned long length)
+sbrk(const long increment, const unsigned long flags)
 {
  void * return_value;
  __asm volatile("syscall" :
                  "=a" (return_value) :
-                 "a" (SYSCALL_ALLOCATE), "D" (length) :
-                 "cc", "%r11", "%rcx");
+                 "a" (SYSCALL_SBRK), "D" (increment), "S" (flags) :
+                 "cc", "%r11", "%rcx", "memory");
  return return_value;
 }
 
-/*! Wrapper for the system call that frees a memory block.
+/*! Precedes each block handed out by alloc. */
+struct alloc_header
+{
+ /*! Number of bytes in the block including the header. */
+ unsigned long         size;
+ /*! Next free block while the block is free. */
+ struct alloc_header * next;
+};
+
+/*! The blocks of one heap. Free blocks are kept in a list ordered by
+ *  address and merged with their free neighbours. */
+struct alloc_heap
+{
+ /*! Passed to sbrk. */
+ unsigned long         flags;
+ /*! The first block, zero until the heap is first used. */
+ char *                start;
+ /*! The break as last moved. */
+ char *                end;
+ /*! The free blocks. */
+ struct alloc_header * free_blocks;
+};
+
+/*! Returns the heaps of the process, the regular heap first and the heap
+ *  backed by 2 MB pages second. */
+static inline struct alloc_heap *
+alloc_heaps(void)
+{
+ static struct alloc_heap heaps[2] =
+  {{0, 0, 0, 0}, {SBRK_HUGE_PAGES, 0, 0, 0}};
+
+ return heaps;
+}
+
+/*! Allocates a block from a heap. Takes the first free block which is
+ *  large enough, or moves the break if there is none.
+ *  @param heap the heap.
+ *  @param length integer holding the number of bytes to allocate
+ *  Returns the address of the block or an error code.
+ */
+static inline void *
+alloc_from_heap(struct alloc_heap * heap, const unsigned long length)
+{
+ const unsigned long    size = ((length + 15) & ~15UL) +
+                               sizeof(struct alloc_header);
+ struct alloc_header ** link;
+ struct alloc_header *  block;
+
+ if (length > (1UL << 40))
+  return (void *) ERROR;
+
+ for (link = &heap->free_blocks; *link; link = &(*link)->next)
+ {
+  block = *link;
+
+  /* Hand out the end of a larger block, the rest stays in the list. */
+  if (block->size >= size + 2 * sizeof(struct alloc_header))
+  {
+   block->size -= size;
+   block = (struct alloc_header *) ((char *) block + block->size);
+   block->size = size;
+   return block + 1;
+  }
+  if (block->size >= size)
+  {
+   *link = block->next;
+   return block + 1;
+  }
+ }
+
+ block = sbrk(size, heap->flags);
+ if ((void *) ERROR == block)
+  return (void *) ERROR;
+ if (0 == heap->start)
+  heap->start = (char *) block;
+ heap->end = (char *) block + size;
+ block->size = size;
+ return block + 1;
+}
+
+/*! Allocates a memory block from the heap of the process.
+ *  @param length integer holding the number of bytes to allocate
+ */
+static inline void *
+alloc(unsigned long length)
+{
+ return alloc_from_heap(&alloc_heaps()[0], length);
+}
+
+/*! Allocates a memory block from the heap backed by 2 MB pages. The block
+ *  is freed with free.
+ *  @param length integer holding the number of bytes to allocate
+ */
+static inline void *
+alloc_huge(unsigned long length)
+{
+ return alloc_from_heap(&alloc_heaps()[1], length);
+}
+
+/*! Frees a memory block allocated with alloc or alloc_huge. A free block
+ *  at the end of its heap is given back by moving the break down.
  *  @param address address to the memory block to free.
+ *  Returns ALL_OK or an error code if the address is not that of a block.
  */
 static inline long
 free(void * address)
 {
- long return_value;
- __asm volatile("syscall" :
-                 "=a" (return_value) :
-                 "a" (SYSCALL_FREE), "D" (address) :
-                 "cc", "%r11", "%rcx");
- return return_value;
+ struct alloc_heap *    heap = alloc_heaps();
+ struct alloc_header *  block = (struct alloc_header *) address - 1;
+ struct alloc_header ** link;
+ struct alloc_header ** previous_link = 0;
+
+ if (!(heap->start && (char *) block >= heap->start &&
+       (char *) address <= heap->end))
+ {
+  heap++;
+  if (!(heap->start && (char *) block >= heap->start &&
+        (char *) address <= heap->end))
+   return ERROR;
+ }
+
+ for (link = &heap->free_blocks; *link && *link < block;
+      link = &(*link)->next)
+  previous_link = link;
+ if (*link == block)
+  return ERROR;
+
+ block->next = *link;
+ *link = block;
+ if (block->next && (char *) block + block->size == (char *) block->next)
+ {
+  block->size += block->next->size;
+  block->next = block->next->next;
+ }
+ if (previous_link &&
+     (char *) *previous_link + (*previous_link)->size == (char *) block)
+ {
+  (*previous_link)->size += block->size;
+  (*previous_link)->next = block->next;
+  link = previous_link;
+  block = *link;
+ }
+
+ if (0 == block->next && (char *) block + block->size == heap->end)
+ {
+  *link = 0;
+  sbrk(-(long) block->size, heap->flags);
+  heap->end = (char *) block;
+ }
+ return ALL_OK;
 }
 
-/*! Wrapper for the system call that terminates threads and processes. */
+/*! Wrapper for the system call that terminates threads and processes.
+ *  @param status the exit status handed to the parent process.
+ */
 static inline void
-terminate(void)
+terminate(const long status)
 {
  __asm volatile("syscall" :
                  :
-                 "a" (SYSCALL_TERMINATE) :
+                 "a" (SYSCALL_TERMINATE), "D" (status) :
                  "cc", "%rcx", "%r11");
 }
 
-/*! Wrapper for the system call that creates processes.
+/*! Wrapper for the system call that creates processes. Returns the
+ * process id of the new process or an error code.
  * @param executable integer identifying the program which should be loaded 
  *  and run as a process.
  */
-static inline unsigned long
+static inline long
 createprocess(const int executable)
 {
- unsigned long return_value;
+ long return_value;
  __asm volatile("syscall" :
                  "=a" (return_value) :
                  "a" (SYSCALL_CREATEPROCESS), "D" (executable) :
@@ -196,4 +339,469 @@ semaphoreup(long semaphore_handle)
  return return_value;
 }
 
+/*! Wrapper for the system call that waits for a child process to
+ *  terminate.
+ * @param pid the process id of the child.
+ * @param status variable receiving the exit status of the child.
+ */
+static inline long
+wait(const long pid, long * status)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_WAIT), "D" (pid), "S" (status) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that creates several processes from one
+ *  executable.
+ * @param executable integer identifying the program which should be loaded
+ *  and run as processes.
+ * @param count the number of processes to create.
+ * @param pids array receiving the process ids of the processes.
+ * @param flags CREATEPROCESSES_SPREAD or zero.
+ */
+static inline long
+createprocesses(const int executable, const long count, long * pids,
+                const long flags)
+{
+ long return_value;
+ register long r10 __asm("r10") = flags;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_CREATEPROCESSES), "D" (executable),
+                 "S" (count), "d" (pids), "r" (r10) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that creates a copy of the calling
+    process. Returns the process id of the copy in the caller and zero in
+    the copy. */
+static inline long
+fork(void)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_FORK) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that replaces the program of the calling
+    process. Returns only if unsuccessful.
+ * @param executable integer identifying the program which should be loaded
+ *  in place of the caller.
+ */
+static inline long
+exec(const int executable)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_EXEC), "D" (executable) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that creates or opens a shared memory
+ *  object. Returns a handle to the object.
+ * @param key name of the object, zero for an object shared through fork
+ *  only.
+ * @param size size of the object in bytes.
+ */
+static inline long
+createsharedmemory(const unsigned long key, const unsigned long size)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_CREATESHAREDMEMORY), "D" (key), "S" (size) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that maps a shared memory object. Returns
+ *  the address of the mapping.
+ * @param handle handle of the object.
+ */
+static inline void *
+mapsharedmemory(const long handle)
+{
+ void * return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_MAPSHAREDMEMORY), "D" (handle) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that unmaps memory.
+ * @param address address returned when the memory was mapped.
+ */
+static inline long
+unmap(void * address)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_UNMAP), "D" (address) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that creates or opens a message channel.
+ *  Returns a handle to the channel.
+ * @param key name of the channel, zero for a channel shared through fork
+ *  only.
+ */
+static inline long
+createchannel(const unsigned long key)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_CREATECHANNEL), "D" (key) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that sends a message through a channel.
+ * @param handle handle of the channel.
+ * @param message describes the bytes and the pages of the message.
+ */
+static inline long
+send(const long handle, const struct channel_message * message)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_SEND), "D" (handle), "S" (message) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that receives a message from a channel.
+ * @param handle handle of the channel.
+ * @param message describes where to put the message. The lengths are
+ *  updated.
+ */
+static inline long
+receive(const long handle, struct channel_message * message)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_RECEIVE), "D" (handle), "S" (message) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that closes a handle.
+ * @param handle the handle to close.
+ */
+static inline long
+close(const long handle)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_CLOSE), "D" (handle) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that creates a pipe.
+ * @param handles receives the handle of the read end in the first and the
+ *  handle of the write end in the second element.
+ */
+static inline long
+createpipe(long handles[2])
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_CREATEPIPE), "D" (handles) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that reads from a pipe. Returns the number
+ *  of bytes read, zero at the end of the stream.
+ * @param handle handle of the read end of the pipe.
+ * @param buffer where to put the bytes.
+ * @param length size of the buffer.
+ */
+static inline long
+read(const long handle, void * buffer, const unsigned long length)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_READ), "D" (handle), "S" (buffer),
+                 "d" (length) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that writes to a pipe. Returns the number
+ *  of bytes written, which may be less than length.
+ * @param handle handle of the write end of the pipe.
+ * @param buffer the bytes to write.
+ * @param length number of bytes to write.
+ */
+static inline long
+write(const long handle, const void * buffer, const unsigned long length)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_WRITE), "D" (handle), "S" (buffer),
+                 "d" (length) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that creates a timer. Returns a handle to
+ *  the timer.
+ * @param milliseconds time until the timer expires.
+ * @param periodic non-zero if the timer expires every interval.
+ */
+static inline long
+createtimer(const unsigned long milliseconds, const long periodic)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_CREATETIMER), "D" (milliseconds),
+                 "S" (periodic) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that waits for a timer to expire. Returns
+ *  the number of expirations since the timer was last read.
+ * @param handle handle of the timer.
+ */
+static inline long
+readtimer(const long handle)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_READTIMER), "D" (handle) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that creates a poll set. Returns a handle
+ *  to the set. */
+static inline long
+createpollset(void)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_CREATEPOLLSET) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that adds a handle to a poll set, changes
+ *  its events or removes it.
+ * @param set handle of the poll set.
+ * @param handle handle to watch.
+ * @param events POLL_READABLE and POLL_WRITABLE, zero to remove the
+ *  handle.
+ * @param cookie returned with the events of the handle.
+ */
+static inline long
+pollcontrol(const long set, const long handle, const unsigned long events,
+            const unsigned long cookie)
+{
+ long return_value;
+ register unsigned long r10 __asm("r10") = cookie;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_POLLCONTROL), "D" (set), "S" (handle),
+                 "d" (events), "r" (r10) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that waits for handles of a poll set to
+ *  become ready. Returns the number of events stored.
+ * @param set handle of the poll set.
+ * @param events array receiving the events of the ready handles.
+ * @param number_of_events number of elements in events.
+ */
+static inline long
+pollwait(const long set, struct poll_event * events,
+         const unsigned long number_of_events)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_POLLWAIT), "D" (set), "S" (events),
+                 "d" (number_of_events) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that creates or opens a single-producer
+ *  single-consumer ring. Returns a handle to the shared memory holding the
+ *  ring. Map it with mapsharedmemory.
+ * @param key name of the ring, zero for a ring shared through fork only.
+ * @param capacity number of slots, a power of two.
+ */
+static inline long
+createring(const unsigned long key, const unsigned long capacity)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_CREATERING), "D" (key), "S" (capacity) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that waits for a word of shared memory to
+ *  be woken up.
+ * @param address address of the word.
+ * @param value returns at once if the word differs from this value.
+ */
+static inline long
+sharedwait(volatile unsigned long * address, const unsigned long value)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_SHAREDWAIT), "D" (address), "S" (value) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that wakes up the waiters for a word of
+ *  shared memory.
+ * @param address address of the word.
+ */
+static inline long
+sharedwake(volatile unsigned long * address)
+{
+ long return_value;
+ __asm volatile("syscall" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_SHAREDWAKE), "D" (address) :
+                 "cc", "%rcx", "%r11", "memory");
+ return return_value;
+}
+
+/* The ring helpers below make system calls only when the caller has to
+   wait or the other side waits. A side which is about to wait announces
+   it in its waiting flag and checks the ring again. The other side checks
+   the flag after updating its index. A full barrier between the store and
+   the load on each side makes sure that one of them sees the other. */
+
+/*! Adds a value to a ring unless it is full. Only one process may push.
+ * @param ring the mapped ring.
+ * @param value the value to add.
+ * Returns non-zero if the value was added.
+ */
+static inline int
+ring_trypush(struct spsc_ring * ring, const unsigned long value)
+{
+ const unsigned long tail = ring->tail;
+
+ /* Read the line of the consumer only when the ring looks full. */
+ if (tail - ring->cached_head == ring->capacity)
+ {
+  ring->cached_head = ring->head;
+  if (tail - ring->cached_head == ring->capacity)
+   return 0;
+ }
+
+ ring->slots[tail & (ring->capacity - 1)] = value;
+ /* The slot is written before the tail is. */
+ __asm volatile("" : : : "memory");
+ ring->tail = tail + 1;
+ return 1;
+}
+
+/*! Takes a value from a ring unless it is empty. Only one process may pop.
+ * @param ring the mapped ring.
+ * @param value receives the value.
+ * Returns non-zero if a value was taken.
+ */
+static inline int
+ring_trypop(struct spsc_ring * ring, unsigned long * value)
+{
+ const unsigned long head = ring->head;
+
+ /* Read the line of the producer only when the ring looks empty. */
+ if (head == ring->cached_tail)
+ {
+  ring->cached_tail = ring->tail;
+  if (head == ring->cached_tail)
+   return 0;
+ }
+
+ *value = ring->slots[head & (ring->capacity - 1)];
+ /* The slot is read before the head is written. */
+ __asm volatile("" : : : "memory");
+ ring->head = head + 1;
+ return 1;
+}
+
+/*! Adds a value to a ring. Blocks while the ring is full.
+ * @param ring the mapped ring.
+ * @param value the value to add.
+ */
+static inline void
+ring_push(struct spsc_ring * ring, const unsigned long value)
+{
+ while (!ring_trypush(ring, value))
+ {
+  const unsigned long head = ring->head;
+
+  ring->producer_waiting = 1;
+  __asm volatile("mfence" : : : "memory");
+  if (ring->tail - ring->head == ring->capacity)
+   sharedwait(&ring->head, head);
+  ring->producer_waiting = 0;
+ }
+
+ __asm volatile("mfence" : : : "memory");
+ if (ring->consumer_waiting)
+  sharedwake(&ring->tail);
+}
+
+/*! Takes a value from a ring. Blocks while the ring is empty.
+ * @param ring the mapped ring.
+ * Returns the value.
+ */
+static inline unsigned long
+ring_pop(struct spsc_ring * ring)
+{
+ unsigned long value;
+
+ while (!ring_trypop(ring, &value))
+ {
+  const unsigned long tail = ring->tail;
+
+  ring->consumer_waiting = 1;
+  __asm volatile("mfence" : : : "memory");
+  if (ring->head == ring->tail)
+   sharedwait(&ring->tail, tail);
+  ring->consumer_waiting = 0;
+ }
+
+ __asm volatile("mfence" : : : "memory");
+ if (ring->producer_waiting)
+  sharedwake(&ring->head);
+ return value;
+}
+
 #endif
@@ -28,26 +28,20 @@
 /*! System call that pauses execution by invoking the bochs debugger. */
 #define SYSCALL_DEBUGGER        (3)
 
-/*! System call that allocates a memory block. The length of the requested
-    memory block is passed in rdi. The system call returns the address or an
-    error code. */
-#define SYSCALL_ALLOCATE        (4)
-
-/*! System call that frees a memory block allocated through the allocate
-    system call. The address of the memory block is passed in rdi. The
-    system call returns  ALL_OK if successful or an error code if
-    unsuccessful. */
-#define SYSCALL_FREE            (5)
+/*! Retired system call numbers. The system calls return an error code. */
+#define SYSCALL_RETIRED_4       (4)
+#define SYSCALL_RETIRED_5       (5)
 
 /*! System call that terminates the currently running
- *  thread. It takes no parameters. Terminates the process
- *  when there are no threads left. */
+ *  thread. The exit status of the process is passed in rdi. Terminates
+ *  the process when there are no threads left. */
 #define SYSCALL_TERMINATE       (6)
 
 /*! System call that creates a new process with one single
  *  thread. It takes an index into the executable table in
  *  rdi. The program used is the executable whose index is
- *  passed in rdi. */
+ *  passed in rdi. The system call returns the process id of the new
+ *  process in rax or an error code if unsuccessful. */
 #define SYSCALL_CREATEPROCESS   (7)
 
 /*! System call that blocks the calling thread a number of clocks ticks. The
@@ -92,4 +86,281 @@
     unsuccessful.
    */
 #define SYSCALL_SEMAPHOREUP     (13)
+
+/*! Creates a copy of the calling process. The address space of the copy
+    shares all pages with the caller. Pages are copied when either process
+    first writes them.
+
+    The system call returns in rax the process id of the copy to the caller
+    and zero to the copy. If unsuccessful the system call returns an error
+    code in rax. */
+#define SYSCALL_FORK            (14)
+
+/*! Replaces the program of the calling process with the executable whose
+    index is passed in rdi. The process keeps its process id. The system
+    call does not return if successful. If the index is invalid or the
+    program cannot be loaded it returns an error code in rax and the caller
+    runs on. */
+#define SYSCALL_EXEC            (15)
+
+/*! Creates several processes from the executable whose index is passed in
+    rdi. The number of processes, at most 64, is passed in rsi. The process
+    ids are stored in the array whose address is passed in rdx. Flags are
+    passed in r10.
+
+    The system call returns in rax the number of processes created if
+    successful. If unsuccessful no process is created and the system call
+    returns an error code in rax. */
+#define SYSCALL_CREATEPROCESSES (16)
+
+/*! Flag for SYSCALL_CREATEPROCESSES. Places the processes on different
+    processors. Without it all of them are placed on the least loaded
+    processor. */
+#define CREATEPROCESSES_SPREAD  (1)
+
+/*! Waits for a child process to terminate. The process id of the child is
+    passed in rdi and the address of a variable receiving its exit status
+    in rsi. The calling process is blocked until the child terminates.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    the process is not a child of the caller or has already been waited
+    for. */
+#define SYSCALL_WAIT            (17)
+
+/*! Creates a shared memory object and returns a handle to it in rax. A
+    key is passed in rdi and the size in bytes, at most 1 GB, in rsi. If the
+    key is not zero and an object with the key exists, that object is
+    opened instead. It must be at least the size asked for. Objects with key
+    zero can be shared with the processes created by fork.
+
+    If unsuccessful the system call returns an error code in rax. */
+#define SYSCALL_CREATESHAREDMEMORY (18)
+
+/*! Maps the shared memory object whose handle is passed in rdi in the
+    address space of the calling process. The pages are readable and
+    writable by all processes mapping the object.
+
+    The system call returns in rax the address of the mapping if successful
+    or an error code if unsuccessful. */
+#define SYSCALL_MAPSHAREDMEMORY (19)
+
+/*! Unmaps the memory mapped at the address passed in rdi.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    nothing is mapped at the address. */
+#define SYSCALL_UNMAP           (20)
+
+/*! Closes the handle passed in rdi. The object is destroyed when no
+    process holds a handle to it or maps it.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    the handle is invalid. */
+#define SYSCALL_CLOSE           (21)
+
+/*! Creates a message channel and returns a handle to it in rax. A key is
+    passed in rdi. If the key is not zero and a channel with the key
+    exists, that channel is opened instead.
+
+    If unsuccessful the system call returns an error code in rax. */
+#define SYSCALL_CREATECHANNEL   (22)
+
+/*! Sends a message through the channel whose handle is passed in rdi. The
+    address of a struct channel_message describing the message is passed in
+    rsi. The bytes of the message are copied. The pages of the message are
+    moved, they are unmapped from the caller and read as zeros afterwards.
+    They must be populated pages of the heap or of the bss. The calling
+    process is blocked while the channel is full.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    unsuccessful. */
+#define SYSCALL_SEND            (23)
+
+/*! Receives the oldest message of the channel whose handle is passed in
+    rdi. The address of a struct channel_message describing where to put
+    the message is passed in rsi. The pages of the message replace the
+    pages at the address given, which must be in the heap or the bss. The
+    calling process is blocked while the channel is empty.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    unsuccessful. The message is not received if it does not fit. */
+#define SYSCALL_RECEIVE         (24)
+
+/*! Creates a shared memory object holding a single-producer
+    single-consumer ring of unsigned longs and returns a handle to it in
+    rax. A key is passed in rdi and the number of slots, a power of two, in
+    rsi. If the key is not zero and an object with the key exists, that
+    object is opened instead. The object is mapped with
+    SYSCALL_MAPSHAREDMEMORY and starts with a struct spsc_ring.
+
+    If unsuccessful the system call returns an error code in rax. */
+#define SYSCALL_CREATERING      (25)
+
+/*! Blocks the calling process until the word of shared memory whose
+    address is passed in rdi is woken up through SYSCALL_SHAREDWAKE. The
+    system call returns at once if the word differs from the value passed
+    in rsi.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    the address is not in shared memory. */
+#define SYSCALL_SHAREDWAIT      (26)
+
+/*! Wakes up the processes waiting for the word of shared memory whose
+    address is passed in rdi. Waiters for other words of the same object
+    may be woken up too and must check their words.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    the address is not in shared memory. */
+#define SYSCALL_SHAREDWAKE      (27)
+
+/*! Creates a pipe. The address of an array of two longs is passed in rdi.
+    The handle of the read end of the pipe is stored in the first and the
+    handle of the write end in the second.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    unsuccessful. */
+#define SYSCALL_CREATEPIPE      (28)
+
+/*! Reads from the read end of a pipe whose handle is passed in rdi. The
+    address of a buffer is passed in rsi and its size in rdx. The calling
+    process is blocked while the pipe is empty.
+
+    The system call returns in rax the number of bytes read, zero if the
+    pipe is empty and its write end is closed, or an error code. */
+#define SYSCALL_READ            (29)
+
+/*! Writes to the write end of a pipe whose handle is passed in rdi. The
+    address of the bytes is passed in rsi and their number in rdx. As many
+    bytes as there is room for are written. The calling process is blocked
+    while the pipe is full.
+
+    The system call returns in rax the number of bytes written or an error
+    code. Writing fails if the read end of the pipe is closed. */
+#define SYSCALL_WRITE           (30)
+
+/*! Creates a timer and returns if successful its handle in rax. The
+    interval in milliseconds is passed in rdi. The timer expires once after
+    the interval if rsi is zero and every interval otherwise.
+
+    If unsuccessful the system call returns an error code in rax. */
+#define SYSCALL_CREATETIMER     (31)
+
+/*! Waits for a timer whose handle is passed in rdi to expire. The calling
+    process is blocked until the timer has expired at least once since it
+    was last read.
+
+    The system call returns in rax the number of expirations since the
+    timer was last read or an error code. */
+#define SYSCALL_READTIMER       (32)
+
+/*! Creates a poll set and returns if successful its handle in rax. A poll
+    set holds handles of other objects and tells which of them are ready.
+
+    If unsuccessful the system call returns an error code in rax. */
+#define SYSCALL_CREATEPOLLSET   (33)
+
+/*! Changes the registration of a handle in a poll set. The handle of the
+    poll set is passed in rdi and the handle to register in rsi. rdx holds
+    the POLL_ events to watch for. Zero removes the handle from the set. A
+    value passed in r10 is returned with the events of the handle. The
+    registration is dropped when the last handle to the object is closed.
+
+    The system call returns in rax ALL_OK if successful or an error code if
+    unsuccessful. */
+#define SYSCALL_POLLCONTROL     (34)
+
+/*! Waits for handles of a poll set, whose handle is passed in rdi, to
+    become ready. The address of an array of struct poll_event is passed in
+    rsi and its number of elements in rdx. The calling process is blocked
+    until at least one handle is ready. The events of as many ready handles
+    as fit in the array are returned at once.
+
+    The system call returns in rax the number of elements filled in or an
+    error code. */
+#define SYSCALL_POLLWAIT        (35)
+
+/*! System call that moves the break, the end, of the heap of the calling
+    process. The signed number of bytes to move it by is passed in rdi and
+    flags in rsi. The pages between the start of the heap and the break are
+    zero-filled on first touch, pages above a lowered break are released.
+    Each process has a heap of its own which is released when the process
+    terminates. The blocks in the heap are managed in user space.
+
+    The system call returns in rax the old break or an error code if the
+    break would leave the heap. */
+#define SYSCALL_SBRK            (36)
+
+/*! Flag for SYSCALL_SBRK. Moves the break of a second heap of the process
+    which is backed by 2 MB pages. Meant for large blocks, each 2 MB page
+    touched takes 2 MB of memory. */
+#define SBRK_HUGE_PAGES         (1)
+
+/*! Poll event. Reading the handle does not block. It is also set for a
+    pipe whose write end is closed. */
+#define POLL_READABLE           (1)
+
+/*! Poll event. Writing the handle does not block. It is also set for a
+    pipe whose read end is closed. */
+#define POLL_WRITABLE           (2)
+
+/*! Maximum number of bytes copied with a message. */
+#define CHANNEL_MAX_DATA        (256)
+
+/*! Maximum number of pages moved with a message. */
+#define CHANNEL_MAX_PAGES       (512)
+
+/*! Size of a cache line. The indices of a ring are on lines of their
+    own so that the producer and the consumer do not write the same line. */
+#define RING_CACHE_LINE_SIZE    (64)
+
+/* Data type declarations. */
+
+/*! The header of a single-producer single-consumer ring. The slots follow
+    it. The producer writes the tail line and the consumer the head line.
+    Use the ring helpers in scwrapper.h to access it. */
+struct spsc_ring
+{
+ /*! Number of slots, a power of two. Set by the kernel. */
+ unsigned long          capacity;
+ /*! Number of slots taken by the consumer. */
+ volatile unsigned long head
+  __attribute__((aligned (RING_CACHE_LINE_SIZE)));
+ /*! Set while the consumer waits for the ring to become non-empty. */
+ volatile unsigned long consumer_waiting;
+ /*! The consumer's copy of tail. */
+ unsigned long          cached_tail;
+ /*! Number of slots filled by the producer. */
+ volatile unsigned long tail
+  __attribute__((aligned (RING_CACHE_LINE_SIZE)));
+ /*! Set while the producer waits for the ring to become non-full. */
+ volatile unsigned long producer_waiting;
+ /*! The producer's copy of head. */
+ unsigned long          cached_head;
+ /*! The slots. */
+ unsigned long          slots[]
+  __attribute__((aligned (RING_CACHE_LINE_SIZE)));
+};
+
+/*! The events of a ready handle returned by SYSCALL_POLLWAIT. */
+struct poll_event
+{
+ /*! The value passed when the handle was registered. */
+ unsigned long cookie;
+ /*! The POLL_ events the handle is ready for. */
+ unsigned long events;
+};
+
+/*! Describes a message sent or received through a channel. */
+struct channel_message
+{
+ /*! The bytes copied with the message. */
+ void *        data;
+ /*! Number of bytes in data. When receiving, the size of the buffer. It
+     is set to the number of bytes received. */
+ unsigned long length;
+ /*! Page aligned address of the pages moved with the message. */
+ void *        pages;
+ /*! Number of pages at pages. When receiving, the number of pages which
+     may be replaced. It is set to the number of pages received. */
+ unsigned long number_of_pages;
+};
 #endif
@@ -0,0 +1,79 @@
+/*! \file testing.h
+ *  This file contains helpers shared by the test programs. A test program
+ *  defines TEST_NAME, the prefix of the lines it prints, before it
+ *  includes this file. Each check that fails prints a line and is counted
+ *  in failures.
+ */
+
+#ifndef _TESTING_H_
+#define _TESTING_H_
+
+#include "scwrapper.h"
+
+#ifndef TEST_NAME
+#error "TEST_NAME must be defined before testing.h is included"
+#endif
+
+/*! Number of milliseconds delay blocks for. */
+#define DELAY_MILLISECONDS 20
+
+/*! Number of failed checks. */
+static long failures;
+
+/*! Counts a failed check and tells which one it was. */
+static inline void
+check(const int passed, const char * const what)
+{
+ if (passed)
+  return;
+
+ prints(TEST_NAME ": FAILED: ");
+ prints(what);
+ prints("\n");
+ failures++;
+}
+
+/*! Blocks for a while, so that the other processes of a test get to run
+    and to wait. */
+static inline void
+delay(void)
+{
+ const long timer = createtimer(DELAY_MILLISECONDS, 0);
+
+ if (timer >= 0)
+ {
+  readtimer(timer);
+  close(timer);
+ }
+}
+
+/*! Forks the other process of a test. The copy counts its own failed
+    checks and passes their number to terminate.
+    \returns The process id of the copy in the caller and zero in the
+             copy. */
+static inline long
+start_child(void)
+{
+ const long pid = fork();
+
+ if (0 == pid)
+  failures = 0;
+ return pid;
+}
+
+/*! Waits for a process started by the test and adds its failed checks to
+    those of the caller. */
+static inline void
+join_child(const long pid)
+{
+ long status;
+
+ if (ERROR == wait(pid, &status))
+ {
+  check(0, "wait for a process of the test");
+  return;
+ }
+ failures += status;
+}
+
+#endif
@@ -147,6 +147,15 @@ typedef struct
  uint32_t            flags;
 } processor_local_APIC_structure;
 
+typedef struct
+{
+ APIC_structure      header;
+ uint16_t            reserved;
+ uint32_t            x2APIC_id;
+ uint32_t            flags;
+ uint32_t            ACPI_processor_UID;
+} processor_local_x2APIC_structure;
+
 typedef struct
 {
  APIC_structure      header;
@@ -165,6 +174,8 @@ typedef struct
  uint16_t            flags;
 } ISO_structure;
 
+/*! Mirrors struct AMD64KernelGSData in the 64-bit kernel. Each entry fills a
+    cache line. */
 struct CPU_private
 {
  uint64_t                       activeContext;    // offset 0
@@ -178,7 +189,10 @@ struct CPU_private
 
  /*! The APIC id of the APIC connected to this processor. */
  uint64_t                       APICId;           // offset 32
-};
+
+ /*! Set up by the 64-bit kernel. */
+ uint64_t                       percpuOffset;     // offset 40
+} __attribute__((aligned (64)));
 
 
 
@@ -342,6 +356,39 @@ search_for_RSD(register const char* area, register unsigned int length)
  return (RSD*) 0;
 }
 
+/*! Adds an enabled processor found in the MADT to the CPU private table. */
+static void
+add_processor(register const struct kernel_data_structures* const kernel_data,
+              register const uint32_t APIC_id)
+{
+ register struct CPU_private * const CPU_private_table =
+  (struct CPU_private *)
+   convert_64_bit_pointer(kernel_data->cpu_private_data);
+
+ const uint64_t number_of_available_CPUs =
+  *convert_64_bit_pointer(kernel_data->number_of_cpus);
+ register uint64_t index;
+
+ /* Check if the kernel cannot support more CPUs. */
+ if (MAX_NUMBER_OF_CPUS <= number_of_available_CPUs)
+  return;
+
+ /* Firmware may describe a processor with both a local APIC and a local
+    x2APIC structure. */
+ for (index = 0; index < number_of_available_CPUs; index++)
+  if (APIC_id == CPU_private_table[index].APICId)
+   return;
+
+ /* Extract the APIC information and initialize private data. */
+ CPU_private_table[number_of_available_CPUs].syscallStack =
+  0x200000 - 2*4096*number_of_available_CPUs;
+ CPU_private_table[number_of_available_CPUs].processorIndex =
+  number_of_available_CPUs;
+ CPU_private_table[number_of_available_CPUs].APICId = APIC_id;
+
+ (*convert_64_bit_pointer(kernel_data->number_of_cpus))++;
+}
+
 static int
 parse_description_header(
  const DESCRIPTION_HEADER* const table,
@@ -399,13 +446,6 @@ parse_description_header(
     register const processor_local_APIC_structure* const local_APIC_structure =
      (processor_local_APIC_structure*) structure;
 
-    register struct CPU_private * const CPU_private_table =
-     (struct CPU_private *)
-      convert_64_bit_pointer(kernel_data->cpu_private_data);
-
-    const uint64_t number_of_available_CPUs =
-     *convert_64_bit_pointer(kernel_data->number_of_cpus);
-
     /* Sanity check the size of the structure. */
     if (8 != structure->length)
     {
@@ -417,19 +457,37 @@ parse_description_header(
     if (((local_APIC_structure->flags)&1) == 0)
      break;
 
-    /* Check if the kernel cannot support more CPUs. */
-    if (MAX_NUMBER_OF_CPUS <= number_of_available_CPUs)
+    add_processor(kernel_data, local_APIC_structure->APIC_id);
+    break;
+   }
+
+   case 9: /* Processor local x2APIC */
+   {
+    /* Processors with APIC ids that do not fit in eight bits are only
+       described by this structure. They can only be reached when the
+       kernel runs the APICs in x2APIC mode, which the 64-bit kernel enables
+       if the processor has an x2APIC. In xAPIC mode the id would be
+       truncated to the eight bits of the ICR destination field. */
+    register const processor_local_x2APIC_structure* const
+     local_x2APIC_structure = (processor_local_x2APIC_structure*) structure;
+    uint32_t EAX, EBX, ECX, EDX;
+
+    cpuid(1, &EAX, &EBX, &ECX, &EDX);
+    if (0 == (ECX & (1<<21)))
+     break;
+
+    /* Sanity check the size of the structure. */
+    if (16 != structure->length)
+    {
+     return_value=0;
      break;
+    }
 
-    /* Extract the APIC information and initialize private data. */
-    CPU_private_table[number_of_available_CPUs].syscallStack =
-     0x200000 - 2*4096*number_of_available_CPUs;
-    CPU_private_table[number_of_available_CPUs].processorIndex =
-     number_of_available_CPUs;
-    CPU_private_table[number_of_available_CPUs].APICId =
-     local_APIC_structure->APIC_id;
+    /* Check if processor is disabled. */
+    if (((local_x2APIC_structure->flags)&1) == 0)
+     break;
 
-    (*convert_64_bit_pointer(kernel_data->number_of_cpus))++;
+    add_processor(kernel_data, local_x2APIC_structure->x2APIC_id);
     break;
    }
 
@@ -493,6 +551,7 @@ parse_description_header(
 
    case 3: /* NMI  */
    case 4: /* Local APIC NMI Structure. */
+   case 10: /* Local x2APIC NMI Structure. */
    {
     /* We just don't care about these. */
     break;
@@ -776,7 +835,7 @@ map_page(register uint64_t * const   table_pointer,
     *(table_pointer + ((virtual_address>>(12+9*level))&0x1ff)) =
      (uint32_t)(allocate_page_table_memory(lowest_available_page_table_memory,
                                            largest_kernel_address,
-                                           top_of_physical_memory)) | 7ULL;
+                                           top_of_physical_memory)) | 3ULL;
 
     /* Remap the page. This will break it up. */
     map_address_range(page_table_root,
@@ -821,8 +880,11 @@ map_page(register uint64_t * const   table_pointer,
                                 largest_kernel_address,
                                 top_of_physical_memory);
 
+    /* Everything mapped here belongs to the kernel. The tables are
+       supervisor-only so that no entry below them is reachable from user
+       mode, whatever its own bits say. */
     *(table_pointer + ((virtual_address>>(12+9*level))&0x1ff)) =
-     (uint32_t)(page_table) | 7ULL;
+     (uint32_t)(page_table) | 3ULL;
 
     map_page(page_table,
              page_table_root,
@@ -1058,7 +1120,9 @@ parse_multiboot_information_and_setup_long_mode(
   clear_page(PML4T_ptr);
 
   /* We start mapping all of the phyical memory allocating memory for the
-     tables as we go. */
+     tables as we go. The mapping is the same in all address spaces so it
+     is made of global pages which survive cr3 reloads. Only the kernel
+     may access it. */
 
   map_address_range(PML4T_ptr,
                     &lowest_available_page_table_memory,
@@ -1067,7 +1131,7 @@ parse_multiboot_information_and_setup_long_mode(
                     0,
                     top_of_physical_memory,
                     0,
-                    7ULL,
+                    0x103ULL,
                     one_gig_pages);
 
   /* Traverse the memory map. We will pass information on to the 64-bit kernel
@@ -1088,7 +1152,8 @@ parse_multiboot_information_and_setup_long_mode(
 
    if (PT_LOAD == (PT_LOAD & program_header_ptr->p_type))
    {
-    register uint64_t protection_bits = 1;
+    /* The kernel is mapped with global pages. */
+    register uint64_t protection_bits = 0x101;
 
     if (PF_W == (PF_W & program_header_ptr->p_flags))
      protection_bits |= 2;
@@ -1120,7 +1185,7 @@ parse_multiboot_information_and_setup_long_mode(
                     0xfec00000ULL,
                     0x400000ULL,
                     0xfec00000ULL,
-                    0x8000000000000003ULL,
+                    0x8000000000000103ULL,
                     one_gig_pages);
 
   /* Check if we need to adjust the end of the 64-bit kernel memory. */
@@ -1139,9 +1204,10 @@ parse_multiboot_information_and_setup_long_mode(
                                             largest_kernel_address;
 
  /* First enable 64-bit page table entries by setting the PAE bit. We also
-    enable the 128-bit floating point instructions. */
+    enable global pages and the 128-bit floating point instructions. */
  __asm volatile("movl    %%cr4,%%eax \n \
                  bts     $5,%%eax # Enable 64-bit page table entries \n \
+                 bts     $7,%%eax # Enable global pages \n \
                  bts     $9,%%eax # Enable 128-bit floating point \n \
                                   # instructions \n \
                  movl    %%eax,%%cr4" : : : "eax");
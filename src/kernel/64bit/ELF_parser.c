@@ -1,28 +1,102 @@
 #include "globals.h"
 
+/*! A page of a loaded image. */
+struct image_page
+{
+ uint64_t virtual_address; /*!< Where the page is mapped. */
+ uint64_t frame;           /*!< The frame mapped. */
+ uint64_t flags;           /*!< Flags passed to map_user_page. */
+};
+
+/*! The layout of a loaded image. It is shared by all instances of the
+    program. The frames copied from the image are owned by the entry and
+    each instance holds a reference to them. */
+struct image_cache_entry
+{
+ /*! Number of processes the image is mapped in. */
+ volatile uint64_t   instances;
+ /*! The address to the first instruction to execute. */
+ uint64_t            entry_point;
+ /*! Number of entries in pages. */
+ uint64_t            number_of_pages;
+ /*! The pages backed by the image. */
+ struct image_page * pages;
+ /*! Number of entries used in regions. */
+ uint64_t            number_of_regions;
+ /*! The demand-zero regions of the image. */
+ struct vm_region    regions[AMD64_MAX_NUMBER_OF_REGIONS];
+};
+
+/*! Protects image_cache. Spawning a process only reads the cache, so the
+    lock is only written when an image is loaded or unloaded. */
+static DEFINE_BRLOCK(image_cache_lock);
+
+/*! The loaded images, indexed as ELF_images. */
+static struct image_cache_entry ** image_cache;
+
 void
-copy_ELF(const struct Elf64_Ehdr* const elf_image, uint64_t * entry_point, uint64_t * memory_block)
+initialize_program_images(void)
+{
+ register const long memory =
+  kalloc(amd64_number_of_images * sizeof(*image_cache));
+ register uint64_t i;
+
+ if (ERROR == memory)
+ {
+  while (1)
+   kprints("Kernel panic! Too little memory for the image cache.\n");
+ }
+
+ image_cache = (struct image_cache_entry **) memory;
+ for (i = 0; i < amd64_number_of_images; i++)
+  image_cache[i] = 0;
+}
+
+/*! Releases the frames and the memory of an image cache entry. */
+static void
+free_image(struct image_cache_entry * const image)
+{
+ uint64_t i;
+
+ for (i = 0; i < image->number_of_pages; i++)
+  release_frame(image->pages[i].frame);
+
+ if (image->pages)
+  kfree((uint64_t) image->pages);
+ kfree((uint64_t) image);
+}
+
+/*! Loads an ELF image. Does some checks to avoid that corrupt images gets
+    loaded. Pages wholly backed by the image are not copied, they are
+    mapped straight from the image embedded in the kernel.
+    \returns The image cache entry or zero if there is not enough memory. */
+static struct image_cache_entry *
+load_image(const struct Elf64_Ehdr* const elf_image)
 {
  /* Get the address of the program header table. */
  int                            program_header_index;
  const struct Elf64_Phdr* const program_header = ((const struct Elf64_Phdr*)
                                                   (((char*) (elf_image)) +
                                                   elf_image->e_phoff));
- unsigned long                  used_memory = 0;
  uint64_t                       memory_footprint_size = 0;
- long                           address_to_memory_block;
+ uint64_t                       number_of_pages = 0;
+ struct image_cache_entry *     image;
+ long                           memory;
 
- /* Figure out how much memory should be allocated. */
+ /* Check the layout of the image. */
  for (program_header_index = 0;
       program_header_index < elf_image->e_phnum;
       program_header_index++)
  {
   /* Check that all PT_LOAD segments are contiguous starting from
-     address 0. Also, calculate the memory footprint of the image. */
+     address 0 and start on a page boundary. Also, calculate the memory
+     footprint of the image and the number of pages backed by the
+     image. */
   if (program_header[program_header_index].p_type == PT_LOAD)
   {
-   if (program_header[program_header_index].p_vaddr !=
-       memory_footprint_size)
+   if ((program_header[program_header_index].p_vaddr !=
+        memory_footprint_size) ||
+       (0 != (program_header[program_header_index].p_vaddr & 0xfff)))
    {
     while (1)
     {
@@ -31,23 +105,33 @@ copy_ELF(const struct Elf64_Ehdr* const elf_image, uint64_t * entry_point, uint6
    }
 
    memory_footprint_size += program_header[program_header_index].p_memsz;
+   number_of_pages +=
+    (program_header[program_header_index].p_filesz + 0xfff) >> 12;
   }
  }
 
- /* Allocate memory. */
- address_to_memory_block = kalloc(memory_footprint_size);
- /* Save the address to the parameter */
- *memory_block=address_to_memory_block;
+ memory = kalloc(sizeof(struct image_cache_entry));
+ if (ERROR == memory)
+  return 0;
+ image = (struct image_cache_entry *) memory;
+ image->instances = 0;
+ image->number_of_pages = 0;
+ image->pages = 0;
+ image->number_of_regions = 0;
 
- /* First check that we have enough memory. */
- if (0 >= address_to_memory_block)
+ if (number_of_pages)
  {
-  /* No, we don't. */
-  return;
+  memory = kalloc(number_of_pages * sizeof(struct image_page));
+  if (ERROR == memory)
+  {
+   free_image(image);
+   return 0;
+  }
+  image->pages = (struct image_page *) memory;
  }
 
- /* Scan through the program header table and copy all PT_LOAD segments to
-    memory. Perform checks at the same time.*/
+ /* Scan through the program header table and record the pages of all
+    PT_LOAD segments. Perform checks at the same time.*/
 
  for (program_header_index = 0;
       program_header_index < elf_image->e_phnum;
@@ -55,20 +139,15 @@ copy_ELF(const struct Elf64_Ehdr* const elf_image, uint64_t * entry_point, uint6
  {
   if (PT_LOAD == program_header[program_header_index].p_type)
   {
-   /* Calculate destination adress. */
-   unsigned long* dst = (unsigned long *) (address_to_memory_block +
-                                           used_memory);
-
-   /* Check for odd things. */
-   if (
-       /* Check if the segment is contigous */
-       (used_memory != program_header[program_header_index].p_vaddr) ||
-       /* Check if the segmen fits in memory. */
-       (used_memory + program_header[program_header_index].p_memsz >
-        memory_footprint_size) ||
-       /* Check if the segment has an odd size. We require the segement
-          size to be an even multiple of 8. */
-       (0 != (program_header[program_header_index].p_filesz&7)))
+   const struct Elf64_Phdr* const segment =
+    &program_header[program_header_index];
+   uint64_t                       flags = 0;
+   uint64_t                       offset;
+   int                            zero_copy;
+
+   /* Check if the segment has an odd size. We require the segement size to
+      be an even multiple of 8. */
+   if (0 != (segment->p_filesz&7))
    {
     /* Something went wrong. Panic. */
     while(1)
@@ -78,38 +157,237 @@ copy_ELF(const struct Elf64_Ehdr* const elf_image, uint64_t * entry_point, uint6
     }
    }
 
-   /* First copy p_filesz from the image to memory. */
+   if (PF_W == (PF_W & segment->p_flags))
+    flags |= PAGE_WRITABLE;
+   if (PF_X != (PF_X & segment->p_flags))
+    flags |= PAGE_NO_EXECUTE;
+
+   /* Image pages can be mapped in place if they start on a page boundary
+      in the image. */
+   zero_copy = 0 == ((((uint64_t) elf_image) + segment->p_offset) & 0xfff);
+
+   for (offset = 0; offset < segment->p_filesz; offset += 4096)
    {
     /* Calculate the source address. */
-    unsigned long* src = (unsigned long *) (((char*) elf_image)+
-     program_header[program_header_index].p_offset);
-    unsigned long count = program_header[program_header_index].p_filesz/8;
+    unsigned long*             src = (unsigned long *) (((char*) elf_image)+
+     segment->p_offset + offset);
+    struct image_page * const page = &image->pages[image->number_of_pages];
 
-    for(; count>0; count--)
+    if (zero_copy &&
+        (offset + 4096 <= segment->p_filesz ||
+         segment->p_filesz == segment->p_memsz))
     {
-     *dst++=*src++;
+     /* Map the page of the image. The kernel is mapped at
+        AMD64_KERNEL_VIRTUAL_OFFSET above its physical address. The tail of
+        a last page which is not padded by the bss belongs to the image
+        too. */
+     page->frame = ((uint64_t) src) - AMD64_KERNEL_VIRTUAL_OFFSET;
     }
-   }
+    else
+    {
+     unsigned long* dst;
+     unsigned long  count;
 
+     page->frame = allocate_frame();
+     if (0 == page->frame)
+     {
+      free_image(image);
+      return 0;
+     }
+     dst = (unsigned long *) page->frame;
 
-   /* Then write p_memsz-p_filesz bytes of zeros. This to pad the segment. */
-   {
-    unsigned long count = (program_header[program_header_index].p_memsz-
-                           program_header[program_header_index].p_filesz);
+     /* First copy the part of the page which is in the image. */
+     count = segment->p_filesz - offset;
+     if (count > 4096)
+      count = 4096;
+     count /= 8;
 
-    char * dst2 = (char *) dst;
+     for(unsigned long i = count; i>0; i--)
+     {
+      *dst++=*src++;
+     }
 
-    for(; count>0; count--)
-    {
-     *dst2++=0;
+     /* Then write zeros to the rest of the page. This pads the segment. */
+     for(; count<512; count++)
+     {
+      *dst++=0;
+     }
     }
+
+    /* All instances share the page. Writes copy it. */
+    page->virtual_address = USER_IMAGE_BASE + segment->p_vaddr + offset;
+    page->flags = flags;
+    if (flags & PAGE_WRITABLE)
+     page->flags = (flags & ~PAGE_WRITABLE) | PAGE_COPY_ON_WRITE;
+    image->number_of_pages++;
    }
 
-   /* Finally update the amount of used memory. */
-   used_memory += program_header[program_header_index].p_memsz;
+   /* The rest of the segment is bss. Its pages are allocated on first
+      touch. */
+   if (offset < segment->p_memsz)
+   {
+    struct vm_region * const region =
+     &image->regions[image->number_of_regions];
+
+    if (AMD64_MAX_NUMBER_OF_REGIONS == image->number_of_regions)
+    {
+     free_image(image);
+     return 0;
+    }
+
+    region->start = USER_IMAGE_BASE + segment->p_vaddr + offset;
+    region->end = USER_IMAGE_BASE +
+                  ((segment->p_vaddr + segment->p_memsz + 0xfff) & ~0xfffULL);
+    region->flags = flags;
+    image->number_of_regions++;
+   }
   }
  }
 
  /* Find out the address to the first instruction to be executed. */
- *entry_point =  address_to_memory_block + elf_image->e_entry;
+ image->entry_point = USER_IMAGE_BASE + elf_image->e_entry;
+ return image;
+}
+
+/*! Maps the pages and regions of a loaded image in an address space.
+    \returns ALL_OK or ERROR if there is not enough memory. */
+static long
+map_image(const struct image_cache_entry * const image,
+          struct address_space * const           address_space)
+{
+ uint64_t i;
+
+ for (i = 0; i < image->number_of_pages; i++)
+ {
+  const struct image_page * const page = &image->pages[i];
+
+  reference_frame(page->frame);
+  if (ALL_OK != map_user_page(address_space, page->virtual_address,
+                              page->frame, page->flags))
+  {
+   release_frame(page->frame);
+   return ERROR;
+  }
+ }
+
+ for (i = 0; i < image->number_of_regions; i++)
+ {
+  if (ALL_OK != add_demand_zero_region(address_space,
+                                       image->regions[i].start,
+                                       image->regions[i].end,
+                                       image->regions[i].flags))
+   return ERROR;
+ }
+
+ return ALL_OK;
+}
+
+long
+pin_program_image(const uint64_t image_index)
+{
+ if (image_index >= amd64_number_of_images)
+  return ERROR;
+
+ while (1)
+ {
+  int failed;
+
+  grab_brlock_r(&image_cache_lock);
+  if (image_cache[image_index])
+  {
+   lock_xadd64(&image_cache[image_index]->instances, 1);
+   release_brlock_r(&image_cache_lock);
+   return ALL_OK;
+  }
+  release_brlock_r(&image_cache_lock);
+
+  /* First instance. Load the image unless another processor beat us to
+     it and try again. */
+  grab_brlock_w(&image_cache_lock);
+  if (0 == image_cache[image_index])
+   image_cache[image_index] = load_image(ELF_images[image_index]);
+  failed = 0 == image_cache[image_index];
+  release_brlock_w(&image_cache_lock);
+
+  if (failed)
+   return ERROR;
+ }
+}
+
+int
+program_image_has_tables(const uint64_t               image_index,
+                         struct address_space * const address_space)
+{
+ const struct image_cache_entry * image;
+ uint64_t                         i;
+ int                              found = 1;
+
+ grab_brlock_r(&image_cache_lock);
+ image = image_cache[image_index];
+ for (i = 0; found && i < image->number_of_pages; i++)
+ {
+  const uint64_t * const entry =
+   find_page_table_entry(address_space, image->pages[i].virtual_address, 0);
+
+  /* Emptying the address space removes 2 MB pages with their entry. */
+  found = 0 != entry && 0 == (*entry & PAGE_LARGE);
+ }
+ release_brlock_r(&image_cache_lock);
+
+ return found;
+}
+
+uint64_t
+map_pinned_program_image(const uint64_t               image_index,
+                         struct address_space * const address_space)
+{
+ const struct image_cache_entry * image;
+ uint64_t                         entry_point;
+
+ grab_brlock_r(&image_cache_lock);
+ image = image_cache[image_index];
+ entry_point = image->entry_point;
+ if (ALL_OK != map_image(image, address_space))
+  entry_point = 0;
+ release_brlock_r(&image_cache_lock);
+
+ return entry_point;
+}
+
+uint64_t
+map_program_image(const uint64_t               image_index,
+                  struct address_space * const address_space)
+{
+ uint64_t entry_point;
+
+ if (ALL_OK != pin_program_image(image_index))
+  return 0;
+
+ entry_point = map_pinned_program_image(image_index, address_space);
+ if (0 == entry_point)
+  release_program_image(image_index);
+ return entry_point;
+}
+
+void
+reference_program_image(const uint64_t image_index)
+{
+ grab_brlock_r(&image_cache_lock);
+ lock_xadd64(&image_cache[image_index]->instances, 1);
+ release_brlock_r(&image_cache_lock);
+}
+
+void
+release_program_image(const uint64_t image_index)
+{
+ struct image_cache_entry * image;
+
+ grab_brlock_w(&image_cache_lock);
+ image = image_cache[image_index];
+ if (0 == --image->instances)
+ {
+  image_cache[image_index] = 0;
+  free_image(image);
+ }
+ release_brlock_w(&image_cache_lock);
 }
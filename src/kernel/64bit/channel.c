@@ -0,0 +1,269 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file channel.c This file holds message channels. A channel is a
+    bounded queue of messages. The bytes of a message are copied through
+    the kernel while its pages are moved, the frames are unmapped from the
+    sender and mapped in the receiver without copying. Senders block while
+    the channel is full and receivers while it is empty.
+ */
+
+#include "globals.h"
+
+/*! A message waiting in a channel. */
+struct queued_message
+{
+ /*! Number of bytes in data. */
+ uint64_t   length;
+ /*! The bytes of the message. */
+ uint8_t    data[CHANNEL_MAX_DATA];
+ /*! Number of entries in frames. */
+ uint64_t   number_of_pages;
+ /*! The frames moved with the message. The message holds a reference to
+     each. */
+ uint64_t * frames;
+};
+
+/*! A channel. */
+struct channel
+{
+ /*! Handles hold references to the channel. */
+ struct kernel_object  object;
+ /*! Protects the rest of the channel. */
+ struct ticket_lock    lock;
+ /*! Index in messages of the oldest message. */
+ uint64_t              head;
+ /*! Number of messages queued. */
+ uint64_t              number_of_messages;
+ /*! Processes waiting for a message. */
+ struct wait_queue     receivers;
+ /*! Processes waiting for room. */
+ struct wait_queue     senders;
+ /*! The queued messages. */
+ struct queued_message messages[AMD64_CHANNEL_CAPACITY];
+};
+
+/*! Frees a channel when the last reference to it is dropped. Pages of
+    messages nobody received are released. */
+static void
+destroy_channel(register struct kernel_object * const object)
+{
+ register struct channel * const channel = (struct channel *) object;
+
+ while (channel->number_of_messages)
+ {
+  register struct queued_message * const message =
+   &channel->messages[channel->head];
+  register uint64_t                      i;
+
+  for (i = 0; i < message->number_of_pages; i++)
+   release_frame(message->frames[i]);
+  if (message->frames)
+   kfree((uint64_t) message->frames);
+
+  channel->head = (channel->head + 1) % AMD64_CHANNEL_CAPACITY;
+  channel->number_of_messages--;
+ }
+
+ kfree((uint64_t) channel);
+}
+
+/*! \returns The POLL_ events a channel is ready for. The count is read
+             without the lock, a change is followed by a notification. */
+static uint64_t
+poll_channel(register struct kernel_object * const object)
+{
+ register const uint64_t number_of_messages =
+  ((volatile struct channel *) object)->number_of_messages;
+
+ return (number_of_messages ? POLL_READABLE : 0) |
+        (number_of_messages < AMD64_CHANNEL_CAPACITY ? POLL_WRITABLE : 0);
+}
+
+/*! Copies a message descriptor from user space and checks it.
+    \returns ALL_OK or ERROR if the descriptor or the ranges it points to
+             are not valid. */
+static long
+read_message(register const uint64_t                address,
+             register struct channel_message * const message)
+{
+ if (ALL_OK != copy_from_user(message, address,
+                              sizeof(struct channel_message)))
+  return ERROR;
+
+ if (message->length > CHANNEL_MAX_DATA ||
+     message->number_of_pages > CHANNEL_MAX_PAGES ||
+     !is_user_range((uint64_t) message->data, message->length) ||
+     (message->number_of_pages &&
+      (0 != ((uint64_t) message->pages & 0xfff) ||
+       !is_user_range((uint64_t) message->pages,
+                      message->number_of_pages << 12))))
+  return ERROR;
+
+ return ALL_OK;
+}
+
+long
+create_channel(register const uint64_t key)
+{
+ register struct channel * channel = 0;
+ register long             handle;
+
+ if (key)
+  channel = (struct channel *) find_named_object(KERNEL_OBJECT_CHANNEL, key);
+
+ if (0 == channel)
+ {
+  channel = (struct channel *) kalloc(sizeof(struct channel));
+  if (ERROR == (long) channel)
+   return ERROR;
+
+  initialize_object(&channel->object, KERNEL_OBJECT_CHANNEL, destroy_channel,
+                    poll_channel);
+  channel->lock = (struct ticket_lock) TICKET_LOCK_INITIALIZER;
+  channel->head = 0;
+  channel->number_of_messages = 0;
+  channel->receivers.waiters = 0;
+  channel->senders.waiters = 0;
+
+  if (key)
+  {
+   register struct channel * const named = (struct channel *)
+    name_object(&channel->object, key);
+
+   if (named != channel)
+   {
+    release_object(&channel->object);
+    channel = named;
+   }
+  }
+ }
+
+ handle = install_handle(&channel->object);
+ if (ERROR == handle)
+  release_object(&channel->object);
+ return handle;
+}
+
+long
+send_message(register const uint64_t handle,
+             register const uint64_t address)
+{
+ register struct channel * const channel =
+  (struct channel *) find_handle(handle, KERNEL_OBJECT_CHANNEL);
+ register struct queued_message * queued;
+ struct channel_message           message;
+ register uint64_t *              frames = 0;
+
+ if (0 == channel || ALL_OK != read_message(address, &message))
+  return ERROR;
+
+ if (message.number_of_pages)
+ {
+  register const long memory =
+   kalloc(message.number_of_pages * sizeof(uint64_t));
+
+  if (ERROR == memory)
+   return ERROR;
+  frames = (uint64_t *) memory;
+ }
+
+ grab_ticket_lock(&channel->lock);
+ if (AMD64_CHANNEL_CAPACITY == channel->number_of_messages)
+ {
+  block_process(&channel->senders, &channel->lock);
+  if (frames)
+   kfree((uint64_t) frames);
+  return AMD64_RESTART_SYSCALL;
+ }
+
+ /* The bytes are copied to the free slot first, so that nothing has to be
+    undone if they cannot be read. Then the pages are moved out of the
+    sender. */
+ queued = &channel->messages[(channel->head + channel->number_of_messages) %
+                             AMD64_CHANNEL_CAPACITY];
+ if (ALL_OK != copy_from_user(queued->data, (uint64_t) message.data,
+                              message.length) ||
+     (frames &&
+      ALL_OK != take_user_pages(this_cpu_ptr(&run_queue)->top->
+                                element.address_space,
+                                (uint64_t) message.pages,
+                                message.number_of_pages, frames)))
+ {
+  release_ticket_lock(&channel->lock);
+  if (frames)
+   kfree((uint64_t) frames);
+  return ERROR;
+ }
+
+ queued->length = message.length;
+ queued->number_of_pages = message.number_of_pages;
+ queued->frames = frames;
+ channel->number_of_messages++;
+
+ wake_up_waiters(&channel->receivers);
+ notify_watchers(&channel->object);
+ release_ticket_lock(&channel->lock);
+ return ALL_OK;
+}
+
+long
+receive_message(register const uint64_t handle,
+                register const uint64_t address)
+{
+ register struct channel * const channel =
+  (struct channel *) find_handle(handle, KERNEL_OBJECT_CHANNEL);
+ register struct queued_message * queued;
+ struct channel_message           message;
+
+ if (0 == channel || ALL_OK != read_message(address, &message))
+  return ERROR;
+
+ grab_ticket_lock(&channel->lock);
+ if (0 == channel->number_of_messages)
+ {
+  block_process(&channel->receivers, &channel->lock);
+  return AMD64_RESTART_SYSCALL;
+ }
+
+ /* The message stays queued if it does not fit or cannot be stored. The
+    pages are moved last as that cannot be undone. */
+ queued = &channel->messages[channel->head];
+ if (queued->length > message.length ||
+     queued->number_of_pages > message.number_of_pages)
+ {
+  release_ticket_lock(&channel->lock);
+  return ERROR;
+ }
+
+ message.length = queued->length;
+ message.number_of_pages = queued->number_of_pages;
+ if (ALL_OK != copy_to_user((uint64_t) message.data, queued->data,
+                            queued->length) ||
+     ALL_OK != copy_to_user(address, &message,
+                            sizeof(struct channel_message)) ||
+     (queued->number_of_pages &&
+      ALL_OK != give_user_pages(this_cpu_ptr(&run_queue)->top->
+                                element.address_space,
+                                (uint64_t) message.pages,
+                                queued->number_of_pages, queued->frames)))
+ {
+  release_ticket_lock(&channel->lock);
+  return ERROR;
+ }
+
+ if (queued->frames)
+  kfree((uint64_t) queued->frames);
+ queued->frames = 0;
+ channel->head = (channel->head + 1) % AMD64_CHANNEL_CAPACITY;
+ channel->number_of_messages--;
+
+ wake_up_waiters(&channel->senders);
+ notify_watchers(&channel->object);
+ release_ticket_lock(&channel->lock);
+ return ALL_OK;
+}
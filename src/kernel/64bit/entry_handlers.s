@@ -15,6 +15,9 @@
  .global amd64_syscall_dummy_target
  .global amd64_halt
  .global amd64_enter_debugger
+ .global amd64_copy_user
+ .global amd64_copy_user_access
+ .global amd64_copy_user_fault
 
  .text
 
@@ -206,6 +209,7 @@ interrupt_in_kernel\@:
  .if     \error_code
  mov     16*8(%rsp),%rsi    # Error code
  .endif
+ lea     (16+\error_code)*8(%rsp),%rdx # Where rip is saved
  call    \function_called_if_in_kernel
 
  popq    %r15
@@ -274,6 +278,21 @@ amd64_handle_double_fault:
  call  amd64_enter_debugger
  jmp   amd64_halt
 
+/**
+ *  Copies rdx bytes from rsi to rdi where one side is in user space.
+ *  Returns 0 in rax, or -1 if a user page cannot be mapped. The fault
+ *  handler resumes execution at amd64_copy_user_fault in that case.
+ */
+amd64_copy_user:
+ mov   %rdx,%rcx
+amd64_copy_user_access:
+ rep movsb
+ xor   %eax,%eax
+ ret
+amd64_copy_user_fault:
+ mov   $-1,%rax
+ ret
+
 /** 
  *  Halts the calling CPU. 
  */
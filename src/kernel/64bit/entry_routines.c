@@ -13,24 +13,43 @@
 #include "globals.h"
 #include "instruction_wrappers.h"
 
+/*! Number of timer interrupts received by each processor. The timer
+    interrupt is broadcast to all processors so each processor keeps its
+    own count. */
+static DEFINE_PER_CPU(uint64_t, time_clicks);
+
 void static
 handle_interrupt(const int interrupt)
 {
  /* Select a handler based on interrupt source. */
- static uint64_t time_clicks;
-
  switch(interrupt)
  {
   case 32:
   {
    /* PIT interrupt occurred. */
-	  time_clicks++;
-	  if(((time_clicks>>3) & 1) != 1) // 40 ms = 5 ms * 2^3
+	  register uint64_t * const clicks = this_cpu_ptr(&time_clicks);
+
+	  (*clicks)++;
+	  /* Kernel code runs with interrupts disabled so the interrupted code
+	     is outside any RCU read-side critical section. */
+	  rcu_note_quiescent_state();
+	  /* The interrupt is broadcast, one processor keeps the time. */
+	  if (0 == get_processor_index())
+		  expire_timers();
+	  if((((*clicks)>>3) & 1) != 1) // 40 ms = 5 ms * 2^3
 		  scheduler();
+	  /* Terminated processes are normally freed by the idle loop. */
+	  reclaim_processes(AMD64_RECLAIM_BACKLOG);
 	  break;
   }
 
-  case 240:
+  case RESCHEDULE_IPI_VECTOR:
+  {
+   /* Another processor pushed onto the wakeup list of this processor. */
+   drain_wakeup_list();
+   break;
+  }
+
   case 241:
   case 242:
   case 243:
@@ -87,10 +106,13 @@ amd64_handle_interrupt_user(int interrupt /*!< The interrupt vector number. */)
   /* Do an EOI procedure on the local APIC. */
 
   /* Acknowledge the interrupt. */
-  *(amd64_local_APIC_base_address + 0xb0/sizeof(unsigned int)) = 0;
+  APIC_EOI();
   active_context = getActiveContext();
  }
 
+ if (0 == active_context)
+  amd64_idle();
+
  /* Return to user space. */
  returnToUserLevel(active_context, 1);
 
@@ -110,18 +132,38 @@ amd64_handle_interrupt_super(int interrupt /*!< The interrupt vector number. */)
   /* Do an EOI procedure on the local APIC. */
 
   /* Acknowledge the interrupt. */
-  *(amd64_local_APIC_base_address + 0xb0/sizeof(unsigned int)) = 0;
+  APIC_EOI();
  }
 }
 
+/*! Terminates the process which caused an exception it can not recover
+    from and runs the next process.
+    WARNING: This function never returns. */
+static void
+terminate_faulting_process(void)
+{
+ register struct AMD64Context * active_context;
+
+ kterminate(ERROR);
+ active_context = getActiveContext();
+
+ if (0 == active_context)
+  amd64_idle();
+
+ returnToUserLevel(active_context, 1);
+
+ /* Here to make the compiler happy. This function does not return. */
+ while(1);
+}
+
 /*! This function is called if an exception occurs in user mode.
     WARNING: This function never returns.  */
 void
 amd64_handle_exception_user(int exc /*!< The exception vector number. */)
 {
- /* We do not handle exceptions. */
+ /* We do not handle exceptions. The process is terminated. */
 
- amd64_halt();
+ terminate_faulting_process();
 
  /* Here to make the compiler happy. This function does not return. */
  while(1);
@@ -143,9 +185,25 @@ void
 amd64_handle_exception_w_error_user(int exc /*!<The exception vector number.*/,
                                     unsigned int code /*!< The error code. */)
 {
- /* We do not handle exceptions. */
+ /* Get the currently active context. */
+ struct AMD64Context * active_context = getActiveContext();
 
- amd64_halt();
+ active_context -> interrupt_context = 1;
+
+ /* Save the floating point context. */
+ fxsave(active_context->fp_context);
+
+ /* Page faults on demand-zero and copy-on-write pages are resolved and
+    the faulting instruction is restarted. */
+ if (14 == exc &&
+     ALL_OK == handle_page_fault(active_context->address_space, readCr2(),
+                                 code))
+  returnToUserLevel(active_context, 1);
+
+ /* We do not handle other exceptions. Illegal accesses, including ones
+    which run off the stack, terminate the process. */
+
+ terminate_faulting_process();
 
  /* Here to make the compiler happy. This function does not return. */
  while(1);
@@ -155,9 +213,29 @@ amd64_handle_exception_w_error_user(int exc /*!<The exception vector number.*/,
     supervisor mode. */
 void
 amd64_handle_exception_w_error_super(int exc /*!<The exception vector number.*/,
-                                     unsigned int code /*!< The error code. */)
+                                     unsigned int code /*!< The error code. */,
+                                     uint64_t * const rip
+                                     /*!< Where the interrupted rip is
+                                          saved. */)
 {
- /* We do not handle exceptions. */
+ register struct AMD64Context * const active_context = getActiveContext();
+
+ /* System calls touch user pages which may not be populated yet. The
+    faulting instruction is restarted when the handler returns. */
+ if (14 == exc && 0 != active_context &&
+     ALL_OK == handle_page_fault(active_context->address_space, readCr2(),
+                                 code))
+  return;
+
+ /* A user address which cannot be mapped fails the copy instead of
+    stopping the kernel. */
+ if (14 == exc && (uint64_t) amd64_copy_user_access == *rip)
+ {
+  *rip = (uint64_t) amd64_copy_user_fault;
+  return;
+ }
+
+ /* We do not handle other exceptions. */
 
  amd64_halt();
 }
@@ -184,6 +262,35 @@ amd64_handle_nmi_super(int dummy  /*!< Not used. */)
  amd64_halt();
 }
 
+/*! Calls the implementation of a system call which may block the caller.
+    \returns The value to return in rax or AMD64_RESTART_SYSCALL if the
+             caller was blocked. */
+static long
+blocking_system_call(register const struct AMD64Context * const context)
+{
+ switch (context->rax)
+ {
+  case SYSCALL_SEND:
+   return send_message(context->rdi, context->rsi);
+  case SYSCALL_RECEIVE:
+   return receive_message(context->rdi, context->rsi);
+  case SYSCALL_SHAREDWAIT:
+   return wait_shared_word(context->rdi, context->rsi);
+  case SYSCALL_READ:
+   return read_pipe(context->rdi, context->rsi, context->rdx);
+  case SYSCALL_WRITE:
+   return write_pipe(context->rdi, context->rsi, context->rdx);
+  case SYSCALL_SEMAPHOREDOWN:
+   return semaphore_down(context->rdi);
+  case SYSCALL_READTIMER:
+   return read_timer(context->rdi);
+  case SYSCALL_POLLWAIT:
+   return poll_wait(context->rdi, context->rsi, context->rdx);
+ }
+
+ return ERROR_ILLEGAL_SYSCALL;
+}
+
 /*! This function is called when a system call is invoked.
     WARNING: This function never returns.  */
 void
@@ -211,8 +318,32 @@ amd64_enter_kernel(void)
 
   case SYSCALL_PRINTS:
   {
-   kprints((const char *) active_context->rdi);
-   active_context->rax = ALL_OK;
+   /* The string is copied in pieces which do not cross a page, so a string
+      which ends right before an unmapped page still prints. */
+   char     piece[65];
+   uint64_t address = active_context->rdi;
+   uint64_t length;
+   uint64_t i;
+
+   active_context->rax = ERROR;
+   while (1)
+   {
+    length = 4096 - (address & 4095);
+    if (length > 64)
+     length = 64;
+    if (ALL_OK != copy_from_user(piece, address, length))
+     break;
+
+    for (i = 0; i < length && piece[i]; i++);
+    piece[i] = 0;
+    kprints(piece);
+    if (i < length)
+    {
+     active_context->rax = ALL_OK;
+     break;
+    }
+    address += length;
+   }
    break;
   }
 
@@ -230,29 +361,169 @@ amd64_enter_kernel(void)
    break;
   }
 
-  case SYSCALL_ALLOCATE:
+  case SYSCALL_RETIRED_4:
+  case SYSCALL_RETIRED_5:
+  {
+   active_context->rax = ERROR;
+   break;
+  }
+
+  case SYSCALL_SBRK:
+  {
+   register struct address_space * const address_space =
+    active_context->address_space;
+
+   /* The kernel only moves the end of the heap. The blocks in it are the
+      business of the process. */
+   active_context->rax =
+    move_break(address_space,
+               (active_context->rsi & SBRK_HUGE_PAGES) ?
+               &address_space->huge_heap : &address_space->heap,
+               (int64_t) active_context->rdi);
+   break;
+  }
+
+  case SYSCALL_CREATESHAREDMEMORY:
+  {
+   active_context->rax = create_shared_memory(active_context->rdi,
+                                              active_context->rsi);
+   break;
+  }
+
+  case SYSCALL_MAPSHAREDMEMORY:
+  {
+   active_context->rax = map_shared_memory(active_context->rdi);
+   break;
+  }
+
+  case SYSCALL_UNMAP:
+  {
+   active_context->rax = unmap_shared_memory(active_context->rdi);
+   break;
+  }
+
+  case SYSCALL_CLOSE:
+  {
+   active_context->rax = close_handle(active_context->rdi);
+   break;
+  }
+
+  case SYSCALL_CREATECHANNEL:
+  {
+   active_context->rax = create_channel(active_context->rdi);
+   break;
+  }
+
+  case SYSCALL_CREATERING:
+  {
+   active_context->rax = create_ring(active_context->rdi,
+                                     active_context->rsi);
+   break;
+  }
+
+  case SYSCALL_SHAREDWAKE:
+  {
+   active_context->rax = wake_shared_word(active_context->rdi);
+   break;
+  }
+
+  case SYSCALL_CREATEPIPE:
+  {
+   active_context->rax = create_pipe(active_context->rdi);
+   break;
+  }
+
+  case SYSCALL_CREATESEMAPHORE:
+  {
+   active_context->rax = create_semaphore(active_context->rdi);
+   break;
+  }
+
+  case SYSCALL_SEMAPHOREUP:
+  {
+   active_context->rax = semaphore_up(active_context->rdi);
+   break;
+  }
+
+  case SYSCALL_CREATETIMER:
   {
-   active_context->rax = kalloc(active_context->rdi);
+   active_context->rax = create_timer(active_context->rdi,
+                                      active_context->rsi);
    break;
   }
 
-  case SYSCALL_FREE:
+  case SYSCALL_CREATEPOLLSET:
   {
-   active_context->rax = kfree(active_context->rdi);
+   active_context->rax = create_poll_set();
+   break;
+  }
+
+  case SYSCALL_POLLCONTROL:
+  {
+   active_context->rax = poll_control(active_context->rdi,
+                                      active_context->rsi,
+                                      active_context->rdx,
+                                      active_context->r10);
+   break;
+  }
+
+  case SYSCALL_SEND:
+  case SYSCALL_RECEIVE:
+  case SYSCALL_SHAREDWAIT:
+  case SYSCALL_READ:
+  case SYSCALL_WRITE:
+  case SYSCALL_SEMAPHOREDOWN:
+  case SYSCALL_READTIMER:
+  case SYSCALL_POLLWAIT:
+  {
+   register const long result = blocking_system_call(active_context);
+
+   /* The caller may block. It then executes the system call again when it
+      is woken up. */
+   if (AMD64_RESTART_SYSCALL != result)
+    active_context->rax = result;
+   active_context = getActiveContext();
    break;
   }
 
   case SYSCALL_TERMINATE:
     {
-  	  kterminate();
+  	  kterminate(active_context->rdi);
   	  active_context=getActiveContext();
   	  break;
     }
     case SYSCALL_CREATEPROCESS:
     {
   	  active_context->rax=kcreateprocess(active_context->rdi);//return values
-  	  if(active_context->rax==ALL_OK)
-  		  active_context=getActiveContext();
+  	  break;
+    }
+    case SYSCALL_WAIT:
+    {
+  	  /* The caller may block. */
+  	  kwait(active_context->rdi, (uint64_t *) active_context->rsi);
+  	  active_context=getActiveContext();
+  	  break;
+    }
+    case SYSCALL_CREATEPROCESSES:
+    {
+  	  active_context->rax=kcreateprocesses(active_context->rdi,
+  	                                       active_context->rsi,
+  	                                       (uint64_t *) active_context->rdx,
+  	                                       active_context->r10);
+  	  break;
+    }
+    case SYSCALL_FORK:
+    {
+  	  active_context->rax=kfork();
+  	  break;
+    }
+    case SYSCALL_EXEC:
+    {
+  	  /* On success the context holds the registers of the new program.
+  	   * On failure the caller is unchanged. */
+  	  if(kexec(active_context->rdi)==ERROR)
+  		  active_context->rax=ERROR;
+  	  active_context=getActiveContext();
   	  break;
     }
 
@@ -263,6 +534,10 @@ amd64_enter_kernel(void)
   }
  }
 
+ /* The process terminated and there is nothing else to run. */
+ if (0 == active_context)
+  amd64_idle();
+
  /* Return to user space. */
  returnToUserLevel(active_context, 0);
  /* NB: returnToUserLevel can return in some cases. This could be handy
@@ -25,7 +25,7 @@
 /*! Size of the memory that can be used for dynamic allocation. I refrain
  *  to overflow it.
  */
-#define ALLOCATE_SIZE    (((amd64_top_of_available_physical_memory-amd64_lowest_available_physical_memory))<<6)
+#define ALLOCATE_SIZE    (amd64_kernel_heap_top-amd64_lowest_available_physical_memory)
 
 /*! States of a process. Currently, they are not used. They will be used when threads
  * are implemented or scheduling algorithm is changed.
@@ -39,6 +39,9 @@
     It usually corresponds to the size of a L2 cache line. */
 #define AMD64_CACHE_LINE_SIZE 64
 
+/*! The maximum number of processors supported by the kernel. */
+#define AMD64_MAX_NUMBER_OF_CPUS 16
+
 /*! Structure which stores a context. */
 struct AMD64Context
 {
@@ -66,10 +69,15 @@ struct AMD64Context
  // Additional fields can be added below
  int      interrupt_context; // True iff the context is saved in a
                              // intterrupt handler
+ struct address_space * address_space; // The address space the context
+                                       // executes in
 };
 
 /*! Each processor has its own structure of this type. It is used
-    to store data which is private to each cpu. */
+    to store data which is private to each cpu. The structure fills a whole
+    cache line so that the entries of different processors never share a
+    cache line. The layout must match struct CPU_private in
+    setup_long_mode.c. */
 struct AMD64KernelGSData
 {
  /*! The currently executing context. */
@@ -85,9 +93,677 @@ struct AMD64KernelGSData
  uint64_t                       processorIndex;   // offset 24
 
  /*! The APIC id of the APIC connected to this processor. */
- uint64_t                       APICId;           // offset 28
+ uint64_t                       APICId;           // offset 32
+
+ /*! The distance in bytes from the template of a per-CPU variable to the
+     instance of the variable belonging to this processor. */
+ uint64_t                       percpuOffset;     // offset 40
+} __attribute__((aligned (AMD64_CACHE_LINE_SIZE)));
+
+/*! Defines a per-CPU variable. The definition placed in the .percpu
+    section is a template. At boot the template is copied into the per-CPU
+    area of each processor. Each per-CPU area starts on a cache line
+    boundary so that per-CPU variables of different processors never share
+    a cache line. Access the variable through this_cpu_ptr or per_cpu_ptr,
+    never directly. */
+#define DEFINE_PER_CPU(type, name) \
+ __typeof__(type) name __attribute__((section (".percpu")))
+
+/*! Declares a per-CPU variable defined in another file. */
+#define DECLARE_PER_CPU(type, name) \
+ extern __typeof__(type) name __attribute__((section (".percpu")))
+
+/*! Converts a pointer to a per-CPU variable into a pointer to the instance
+    belonging to the calling processor. */
+#define this_cpu_ptr(pointer) \
+ ((__typeof__(pointer)) (((char *) (pointer)) + get_percpu_offset()))
+
+/*! Converts a pointer to a per-CPU variable into a pointer to the instance
+    belonging to the processor with index processor_index. */
+#define per_cpu_ptr(pointer, processor_index) \
+ ((__typeof__(pointer)) (((char *) (pointer)) + \
+  amd64_CPU_private_table[processor_index].percpuOffset))
+
+/*! Reads the calling processor's instance of a per-CPU variable. */
+#define this_cpu_read(variable) (*this_cpu_ptr(&(variable)))
+
+/*! Writes the calling processor's instance of a per-CPU variable. */
+#define this_cpu_write(variable, value) \
+ (*this_cpu_ptr(&(variable)) = (value))
+
+/*! Start of the per-CPU variable template. Defined by the link script. */
+extern char
+amd64_percpu_start[];
+
+/*! End of the per-CPU variable template. Defined by the link script. */
+extern char
+amd64_percpu_end[];
+
+/*! Start of the per-CPU areas. Defined by the link script. */
+extern char
+amd64_percpu_areas[];
+
+/* Page table entry bits. */
+#define PAGE_PRESENT          0x1ULL                /*!< Entry is valid. */
+#define PAGE_WRITABLE         0x2ULL                /*!< Page can be written. */
+#define PAGE_USER             0x4ULL                /*!< User mode access. */
+#define PAGE_LARGE            0x80ULL               /*!< 2 MB or 1 GB page. */
+#define PAGE_GLOBAL           0x100ULL              /*!< Survives cr3 loads.
+                                                         Used for the shared
+                                                         kernel mappings
+                                                         only. */
+#define PAGE_COPY_ON_WRITE    0x200ULL              /*!< Available to
+                                                         software. Write
+                                                         faults copy the
+                                                         page. */
+#define PAGE_SHARED           0x400ULL              /*!< Available to
+                                                         software. The frame
+                                                         is shared memory and
+                                                         stays writable in
+                                                         copies. */
+#define PAGE_NO_EXECUTE       0x8000000000000000ULL /*!< Not executable. */
+#define PAGE_ADDRESS_MASK     0x000ffffffffff000ULL /*!< Frame address. */
+
+/*! Size of a page mapped by a page directory entry with PAGE_LARGE set. */
+#define AMD64_LARGE_PAGE_SIZE 0x200000ULL
+
+/*! Physical address of the page table built by the 32-bit kernel. It
+    holds the identity map of physical memory and the kernel. */
+#define AMD64_KERNEL_PML4     0x100000ULL
+
+/*! Number of process context identifiers. */
+#define AMD64_NUMBER_OF_PCIDS 4096
+
+/*! Meta-data of allocated block. Each dynamically allocated block is
+ * preceded by that data structure.
+ */
+
+typedef struct block * blockPtr;
+
+ struct block {
+  uint32_t full; /*!< Indicator of emptiness of cell. 0 if empty, 1 otherwise. */
+  uint64_t size; /*!< Size of the allocated memory block corresponding that strucure. */
+  blockPtr prev; /*!< Pointer to the previous memory block's meta-data.*/
+  blockPtr next; /*!< Pointer to the next memory block's meta-data.*/
 };
 
+/*! A heap of variable sized blocks. The blocks are kept in a list ordered
+    by address, each preceded by a struct block. The heap does no locking. */
+struct heap
+{
+ blockPtr base;  /*!< The first block, zero if the heap is empty. */
+ blockPtr last;  /*!< Scratch variable used while searching the list. */
+ uint64_t start; /*!< The address of the heap. */
+ uint64_t size;  /*!< The size of the heap in bytes. */
+};
+
+/*! The heap kalloc and kfree serve. It lies in the identity map between
+    amd64_lowest_available_physical_memory and amd64_kernel_heap_top. */
+extern struct heap
+kernel_heap;
+
+/*! Virtual address at which executable images are loaded. It is the start
+    of PML4 slot 1, the first slot not shared with the kernel. */
+#define USER_IMAGE_BASE       0x0000008000000000ULL
+
+/*! End of the user part of an address space. */
+#define USER_SPACE_END        0x0000800000000000ULL
+
+/*! Virtual address of the heap of a process. It is the start of PML4 slot
+    2. The heap is an arena whose break the process moves, its blocks are
+    managed in user space. */
+#define USER_HEAP_BASE        0x0000010000000000ULL
+
+/*! Size of the heap of a process. */
+#define USER_HEAP_SIZE        0x0000000040000000ULL
+
+/*! Virtual address of the heap of a process which is backed by 2 MB pages.
+    It follows the heap in PML4 slot 2. */
+#define USER_HUGE_HEAP_BASE   (USER_HEAP_BASE + USER_HEAP_SIZE)
+
+/*! Size of the heap of a process which is backed by 2 MB pages. */
+#define USER_HUGE_HEAP_SIZE   0x0000000040000000ULL
+
+/*! First address above the stack of a process. It is the end of PML4 slot
+    3. The stack grows down from here. */
+#define USER_STACK_TOP        0x0000020000000000ULL
+
+/*! Largest size the stack of a process grows to. */
+#define USER_STACK_SIZE       0x0000000000800000ULL
+
+/*! How far below the lowest page of a stack a fault may hit and still grow
+    the stack. Accesses further down are taken to be stray pointers. */
+#define AMD64_STACK_GROWTH_WINDOW 0x10000ULL
+
+/*! Virtual address of the first shared memory mapping of a process. It is
+    the start of PML4 slot 4. */
+#define USER_SHARED_MEMORY_BASE 0x0000020000000000ULL
+
+/*! Size of the address range each shared memory mapping gets. Mapping i
+    starts i windows above USER_SHARED_MEMORY_BASE. It is also the largest
+    size of a shared memory object. */
+#define USER_SHARED_MEMORY_WINDOW 0x0000000040000000ULL
+
+/*! Maximum number of shared memory objects mapped in an address space. */
+#define AMD64_MAX_NUMBER_OF_SHARED_MAPPINGS 8
+
+/*! \returns Non-zero iff a range of addresses lies in user space. */
+static inline int
+is_user_range(register const uint64_t address
+              /*!< First address of the range. */,
+              register const uint64_t length
+              /*!< Number of bytes in the range. */)
+{
+ return address >= USER_IMAGE_BASE && length <= USER_SPACE_END &&
+        address <= USER_SPACE_END - length;
+}
+
+/*! Copies bytes to or from user space. Defined in entry_handlers.s.
+    \returns ALL_OK or ERROR if a user page cannot be mapped. */
+extern long
+amd64_copy_user(void * to, const void * from, uint64_t length);
+
+/*! The instruction in amd64_copy_user which touches user pages and where
+    a fault on them resumes. */
+extern const char amd64_copy_user_access[], amd64_copy_user_fault[];
+
+/*! Copies bytes from user space. Unlike dereferencing a user pointer, a
+    bad address makes the copy fail instead of stopping the kernel.
+    \returns ALL_OK or ERROR if the range is not valid. */
+static inline long
+copy_from_user(register void * const   to
+               /*!< Where to copy to. */,
+               register const uint64_t from
+               /*!< The user address to copy from. */,
+               register const uint64_t length
+               /*!< Number of bytes to copy. */)
+{
+ if (!is_user_range(from, length))
+  return ERROR;
+ return amd64_copy_user(to, (const void *) from, length);
+}
+
+/*! Copies bytes to user space.
+    \returns ALL_OK or ERROR if the range is not valid. */
+static inline long
+copy_to_user(register const uint64_t     to
+             /*!< The user address to copy to. */,
+             register const void * const from
+             /*!< Where to copy from. */,
+             register const uint64_t     length
+             /*!< Number of bytes to copy. */)
+{
+ if (!is_user_range(to, length))
+  return ERROR;
+ return amd64_copy_user((void *) to, from, length);
+}
+
+/*! The virtual address the kernel is linked at minus its physical address.
+ */
+#define AMD64_KERNEL_VIRTUAL_OFFSET 0xffffffff80000000ULL
+
+/*! Maximum number of demand paged regions in an address space. */
+#define AMD64_MAX_NUMBER_OF_REGIONS 8
+
+/*! A range of user addresses where pages are allocated on first touch.
+    A stack region starts small and moves start down towards limit as
+    pages below it are touched. */
+struct vm_region
+{
+ uint64_t start; /*!< First address in the region, page aligned. */
+ uint64_t end;   /*!< First address after the region, page aligned. */
+ uint64_t flags; /*!< PAGE_WRITABLE and PAGE_NO_EXECUTE for the pages.
+                      PAGE_LARGE backs the region with 2 MB pages where
+                      they fit. */
+ uint64_t limit; /*!< Lowest start the region may grow down to. Equals
+                      start for regions which do not grow. */
+};
+
+/*! A range of user addresses which grows and shrinks at its end, the
+    break. The demand-zero region serving it ends at the break rounded up to
+    the page size of the region. The kernel never looks at the contents. */
+struct user_arena
+{
+ uint64_t start;  /*!< First address of the arena. */
+ uint64_t limit;  /*!< Largest value of the break. */
+ uint64_t brk;    /*!< The break, the first address after the arena. */
+ uint64_t region; /*!< Index in regions of the region serving the arena. */
+};
+
+/*! An address space. Processes have one each. */
+struct address_space
+{
+ /*! Physical address of the PML4 table. */
+ uint64_t          pml4;
+ /*! The process context identifier, zero if none. */
+ uint64_t          pcid;
+ /*! One bit for each processor which may hold TLB entries tagged with
+     pcid that are no longer valid. */
+ volatile uint64_t stale_CPUs;
+ /*! Number of entries used in regions. */
+ uint64_t          number_of_regions;
+ /*! The demand-zero regions. */
+ struct vm_region  regions[AMD64_MAX_NUMBER_OF_REGIONS];
+ /*! The heap at USER_HEAP_BASE. Its pages go away with the address
+     space. */
+ struct user_arena heap;
+ /*! The heap backed by 2 MB pages at USER_HUGE_HEAP_BASE. */
+ struct user_arena huge_heap;
+ /*! The shared memory object mapped in each window, zero if the window
+     is free. Each mapping holds a reference to its object. */
+ struct shared_memory * shared_mappings[AMD64_MAX_NUMBER_OF_SHARED_MAPPINGS];
+};
+
+/*! The address space of the kernel. It holds only the shared mappings. */
+extern struct address_space
+kernel_address_space;
+
+/*! Non-zero iff the processors support PCIDs and have them enabled. */
+extern uint32_t
+amd64_PCID_enabled;
+
+/*! Creates an address space holding the shared mappings only.
+    \returns The address space or zero if there is not enough memory. */
+extern struct address_space *
+create_address_space(void);
+
+/*! Creates a copy of an address space. Only the page tables are copied.
+    The frames are shared and writable pages are made copy-on-write in both
+    address spaces.
+    \returns The copy or zero if there is not enough memory. */
+extern struct address_space *
+fork_address_space(struct address_space * const address_space
+                   /*!< The address space to copy. */);
+
+/*! Unmaps all user pages and regions of an address space. The page tables
+    are kept so that mapping pages at the same addresses again needs no
+    new tables. */
+extern void
+empty_address_space(struct address_space * const address_space
+                    /*!< The address space to empty. */);
+
+/*! Releases an address space along with all frames mapped in it. It must
+    not be loaded on any processor. */
+extern void
+destroy_address_space(struct address_space * const address_space);
+
+/*! Finds the last level page table entry mapping an address. If a 2 MB
+    page maps the address the page directory entry is found instead, it has
+    PAGE_LARGE set.
+    \returns The entry or zero if a page table is missing and create is
+             zero or there is not enough memory. */
+extern uint64_t *
+find_page_table_entry(struct address_space * const address_space
+                      /*!< The address space to look in. */,
+                      const uint64_t               virtual_address
+                      /*!< The address to look up. */,
+                      const int                    create
+                      /*!< Non-zero to create missing page tables. */);
+
+/*! Maps a frame at a user mode address.
+    \returns ALL_OK or ERROR if there is not enough memory for the page
+             tables. */
+extern long
+map_user_page(struct address_space * const address_space
+              /*!< The address space to map in. */,
+              const uint64_t               virtual_address
+              /*!< The page aligned address to map at. */,
+              const uint64_t               frame
+              /*!< Physical address of the frame to map. */,
+              const uint64_t               flags
+              /*!< PAGE_WRITABLE and PAGE_NO_EXECUTE. */);
+
+/*! Unmaps the pages in a range of user addresses and releases their
+    frames. 2 MB pages are unmapped only if the range covers them. */
+extern void
+unmap_user_pages(struct address_space * const address_space
+                 /*!< The address space to unmap in. */,
+                 const uint64_t               start
+                 /*!< First address, page aligned. */,
+                 const uint64_t               end
+                 /*!< First address after the range, page aligned. */);
+
+/*! Moves the break of an arena. Pages above the new break are released.
+    \returns The old break or ERROR if the break would leave the arena. */
+extern long
+move_break(struct address_space * const address_space
+           /*!< The address space holding the arena. */,
+           struct user_arena * const    arena
+           /*!< The arena. */,
+           const int64_t                increment
+           /*!< Number of bytes to move the break up by, negative to move
+                it down. */);
+
+/*! Adds a region where zero filled pages are allocated on first touch.
+    \returns ALL_OK or ERROR if the region table is full. */
+extern long
+add_demand_zero_region(struct address_space * const address_space
+                       /*!< The address space to add the region to. */,
+                       const uint64_t               start
+                       /*!< First address, page aligned. */,
+                       const uint64_t               end
+                       /*!< First address after the region, page
+                            aligned. */,
+                       const uint64_t               flags
+                       /*!< PAGE_WRITABLE and PAGE_NO_EXECUTE. */);
+
+/*! Adds a stack region which holds the page below top and grows down on
+    demand until it is size bytes large.
+    \returns ALL_OK or ERROR if the region table is full. */
+extern long
+add_stack_region(struct address_space * const address_space
+                 /*!< The address space to add the region to. */,
+                 const uint64_t               top
+                 /*!< First address above the stack, page aligned. */,
+                 const uint64_t               size
+                 /*!< Largest size of the stack, page aligned. */);
+
+/*! Resolves a page fault on a user address. Allocates demand-zero pages,
+    copies copy-on-write pages and ignores faults on entries which have
+    already been fixed up.
+    \returns ALL_OK if the faulting access can be restarted or ERROR if the
+             access is illegal. */
+extern long
+handle_page_fault(struct address_space * const address_space
+                  /*!< The address space the fault occurred in. */,
+                  const uint64_t               address
+                  /*!< The faulting address, read from cr2. */,
+                  const uint64_t               error_code
+                  /*!< The error code pushed by the processor. */);
+
+/*! Loads an address space on the calling processor unless it is already
+    loaded. */
+extern void
+switch_address_space(struct address_space * const address_space);
+
+/*! Creates a shared memory object or opens the named one with the same key
+    and installs a handle to it in the calling process.
+    \returns The handle or ERROR. */
+extern long
+create_shared_memory(const uint64_t key
+                     /*!< Name of the object, zero for an anonymous
+                          object. */,
+                     const uint64_t size
+                     /*!< Size in bytes, at most
+                          USER_SHARED_MEMORY_WINDOW. */);
+
+/*! Creates a shared memory object holding a single-producer
+    single-consumer ring or opens the named one with the same key, and
+    installs a handle to it in the calling process.
+    \returns The handle or ERROR. */
+extern long
+create_ring(const uint64_t key
+            /*!< Name of the ring, zero for an anonymous ring. */,
+            const uint64_t capacity
+            /*!< Number of slots, a power of two. */);
+
+/*! Blocks the calling process until a word of shared memory is woken up
+    unless the word differs from a value.
+    \returns ALL_OK, ERROR or AMD64_RESTART_SYSCALL if the caller was
+             blocked. */
+extern long
+wait_shared_word(const uint64_t address
+                 /*!< User address of the word in a shared mapping. */,
+                 const uint64_t value
+                 /*!< The value the caller last saw in the word. */);
+
+/*! Wakes up the processes waiting for a word of shared memory. All
+    waiters on the object holding the word are woken up.
+    \returns ALL_OK or ERROR if the address is not in a shared mapping. */
+extern long
+wake_shared_word(const uint64_t address
+                 /*!< User address of the word in a shared mapping. */);
+
+/*! Maps a shared memory object in the address space of the calling
+    process. The pages are writable and stay shared across fork.
+    \returns The address of the mapping or ERROR. */
+extern long
+map_shared_memory(const uint64_t handle
+                  /*!< Handle of the object in the calling process. */);
+
+/*! Unmaps a shared memory object from the address space of the calling
+    process.
+    \returns ALL_OK or ERROR if no object is mapped at the address. */
+extern long
+unmap_shared_memory(const uint64_t address
+                    /*!< Address returned by map_shared_memory. */);
+
+/*! Gives a copy of an address space the shared memory mappings of the
+    original. The pages are copied along with the page tables. */
+extern void
+copy_shared_mappings(const struct address_space * const address_space
+                     /*!< The original. */,
+                     struct address_space * const       copy
+                     /*!< The copy. */);
+
+/*! Drops the shared memory mappings of an address space. The pages are
+    unmapped along with the rest of the address space. */
+extern void
+release_shared_mappings(struct address_space * const address_space);
+
+/*! Unmaps pages of a writable region and hands their frames, with the
+    references of the mappings, to the caller. The pages are demand-zero
+    again afterwards. Either all pages are taken or none.
+    \returns ALL_OK or ERROR if a page is not populated, is shared or is
+             part of a 2 MB page. */
+extern long
+take_user_pages(struct address_space * const address_space
+                /*!< The address space to unmap in. */,
+                const uint64_t               address
+                /*!< First address, page aligned. */,
+                const uint64_t               number_of_pages
+                /*!< Number of pages to take. */,
+                uint64_t * const             frames
+                /*!< Receives the frames. */);
+
+/*! Maps frames at pages of a writable region in place of the pages there.
+    The mappings take over the references of the caller. Frames with other
+    references are mapped copy-on-write.
+    \returns ALL_OK or ERROR if the range is not in a writable region or
+             there is not enough memory. Nothing is mapped then. */
+extern long
+give_user_pages(struct address_space * const address_space
+                /*!< The address space to map in. */,
+                const uint64_t               address
+                /*!< First address, page aligned. */,
+                const uint64_t               number_of_pages
+                /*!< Number of pages to map. */,
+                const uint64_t * const       frames
+                /*!< The frames to map. */);
+
+/*! Creates a pipe and installs handles to its read and write ends in the
+    calling process.
+    \returns ALL_OK or ERROR. */
+extern long
+create_pipe(const uint64_t handles
+            /*!< User address of an array of two longs receiving the
+                 handles. */);
+
+/*! Reads bytes from a pipe. Blocks the caller while the pipe is empty and
+    its write end is open.
+    \returns The number of bytes read, zero at the end of the stream,
+             ERROR or AMD64_RESTART_SYSCALL if the caller was blocked. */
+extern long
+read_pipe(const uint64_t handle
+          /*!< Handle of the read end in the calling process. */,
+          const uint64_t buffer
+          /*!< User address to read to. */,
+          const uint64_t length
+          /*!< Size of the buffer. */);
+
+/*! Writes bytes to a pipe. Writes as many as there is room for and blocks
+    the caller while the pipe is full.
+    \returns The number of bytes written, ERROR or AMD64_RESTART_SYSCALL
+             if the caller was blocked. */
+extern long
+write_pipe(const uint64_t handle
+           /*!< Handle of the write end in the calling process. */,
+           const uint64_t buffer
+           /*!< User address of the bytes. */,
+           const uint64_t length
+           /*!< Number of bytes to write. */);
+
+/*! Maximum number of messages queued in a channel. */
+#define AMD64_CHANNEL_CAPACITY 16
+
+/*! Creates a channel or opens the named one with the same key and installs
+    a handle to it in the calling process.
+    \returns The handle or ERROR. */
+extern long
+create_channel(const uint64_t key
+               /*!< Name of the channel, zero for an anonymous one. */);
+
+/*! Queues a message in a channel. Blocks the caller while the channel is
+    full.
+    \returns ALL_OK, ERROR or AMD64_RESTART_SYSCALL if the caller was
+             blocked. */
+extern long
+send_message(const uint64_t handle
+             /*!< Handle of the channel in the calling process. */,
+             const uint64_t message
+             /*!< User address of a struct channel_message. */);
+
+/*! Takes the oldest message from a channel. Blocks the caller while the
+    channel is empty.
+    \returns ALL_OK, ERROR or AMD64_RESTART_SYSCALL if the caller was
+             blocked. */
+extern long
+receive_message(const uint64_t handle
+                /*!< Handle of the channel in the calling process. */,
+                const uint64_t message
+                /*!< User address of a struct channel_message. */);
+
+/*! Creates a semaphore and installs a handle to it in the calling process.
+    \returns The handle or ERROR. */
+extern long
+create_semaphore(const uint64_t count /*!< The initial count. */);
+
+/*! Decrements the count of a semaphore. Blocks the caller while the count
+    is zero.
+    \returns ALL_OK, ERROR or AMD64_RESTART_SYSCALL if the caller was
+             blocked. */
+extern long
+semaphore_down(const uint64_t handle
+               /*!< Handle of the semaphore in the calling process. */);
+
+/*! Increments the count of a semaphore.
+    \returns ALL_OK or ERROR. */
+extern long
+semaphore_up(const uint64_t handle
+             /*!< Handle of the semaphore in the calling process. */);
+
+/*! Length of a timer tick in milliseconds. */
+#define AMD64_MILLISECONDS_PER_TICK 5
+
+/*! Creates a timer and installs a handle to it in the calling process.
+    \returns The handle or ERROR. */
+extern long
+create_timer(const uint64_t milliseconds
+             /*!< Time until the timer expires. */,
+             const uint64_t periodic
+             /*!< Non-zero if the timer expires every interval. */);
+
+/*! Waits for a timer to expire.
+    \returns The number of expirations since the timer was last read,
+             ERROR or AMD64_RESTART_SYSCALL if the caller was blocked. */
+extern long
+read_timer(const uint64_t handle
+           /*!< Handle of the timer in the calling process. */);
+
+/*! Advances the time of the timers and expires those that are due. Called
+    by one processor on each timer tick. */
+extern void
+expire_timers(void);
+
+/*! Creates a poll set and installs a handle to it in the calling process.
+    \returns The handle or ERROR. */
+extern long
+create_poll_set(void);
+
+/*! Adds a handle to a poll set, changes the events watched for or removes
+    it.
+    \returns ALL_OK or ERROR. */
+extern long
+poll_control(const uint64_t set
+             /*!< Handle of the poll set in the calling process. */,
+             const uint64_t handle
+             /*!< Handle of the object to watch. */,
+             const uint64_t events
+             /*!< The POLL_ events to watch for, zero to remove. */,
+             const uint64_t cookie
+             /*!< Returned with the events of the object. */);
+
+/*! Collects the events of the ready objects of a poll set. Blocks the
+    caller while none is ready.
+    \returns The number of events stored, ERROR or AMD64_RESTART_SYSCALL
+             if the caller was blocked. */
+extern long
+poll_wait(const uint64_t set
+          /*!< Handle of the poll set in the calling process. */,
+          const uint64_t events
+          /*!< User address of an array of struct poll_event. */,
+          const uint64_t number_of_events
+          /*!< Number of elements in the array. */);
+
+/*! Start of the page frames handed out by allocate_frame. The kalloc heap
+    ends here. */
+extern uint64_t
+amd64_frames_start;
+
+/*! End of the page frames handed out by allocate_frame. */
+extern uint64_t
+amd64_frames_end;
+
+/*! End of the kalloc heap. */
+extern uint64_t
+amd64_kernel_heap_top;
+
+/*! Splits the available physical memory between the kalloc heap and the
+    frame allocator. */
+extern void
+initialize_physical_memory(void);
+
+/*! Allocates a 4 KB page frame with a reference count of one. The frame is
+    not cleared. Frames outside the frame allocator, such as the pages of
+    the executable images in the kernel, can be mapped too. They are not
+    reference counted and never freed.
+    \returns The physical address of the frame or zero if there is no free
+             frame. */
+extern uint64_t
+allocate_frame(void);
+
+/*! Fills a frame with zeros. */
+extern void
+clear_frame(const uint64_t frame /*!< Physical address of the frame. */);
+
+/*! Adds a reference to a frame. */
+extern void
+reference_frame(const uint64_t frame /*!< Physical address of the frame. */);
+
+/*! \returns The number of references to a frame. */
+extern uint32_t
+frame_reference_count(const uint64_t frame
+                      /*!< Physical address of the frame. */);
+
+/*! Drops a reference to a frame. The frame is freed with the last
+    reference. */
+extern void
+release_frame(const uint64_t frame /*!< Physical address of the frame. */);
+
+/*! Allocates AMD64_LARGE_PAGE_SIZE bytes of contiguous frames aligned to
+    their size. The frames are counted as one, through the reference count
+    of the first, and must be released with release_large_frame.
+    \returns The physical address of the first frame or zero if there is no
+             free 2 MB frame. */
+extern uint64_t
+allocate_large_frame(void);
+
+/*! Drops a reference to a frame allocated by allocate_large_frame. The
+    frame is freed with the last reference. */
+extern void
+release_large_frame(const uint64_t frame
+                    /*!< Physical address of the frame. */);
+
 /* ELF image structures. The names from the ELF64 specification are used
    and the structs are derived from the ELF64 specification. */
 
@@ -172,10 +848,66 @@ struct Elf64_Phdr
 #    define PF_R        0x4        /*!< Segment can be read. */
 #    define PF_MASKPERM 0x0000FFFF /*!< Used to mask the permission bits */
 
-/*! Copies an ELF image to memory. Does some checks to avoid that corrupt
-    images gets copied to memory.
-    \return The address to the first instruction to execute. */
-extern void copy_ELF(const struct Elf64_Ehdr* const elf_image, uint64_t * entry_point, uint64_t * memory_block);
+/*! Allocates the cache of loaded executable images. */
+extern void
+initialize_program_images(void);
+
+/*! Maps an executable image at USER_IMAGE_BASE in an address space. The
+    first instance of a program loads the image. Its layout and the pages
+    copied from it are cached and shared by all instances of the program.
+    Pages wholly backed by the image are mapped straight from the image
+    embedded in the kernel, copy-on-write if the segment is writable. The
+    bss is mapped as demand-zero pages. Does some checks to avoid that
+    corrupt images gets mapped. Each successful call must be paired with a
+    call to release_program_image.
+    \returns The address to the first instruction to execute, zero if the
+             index is invalid or there is not enough memory. */
+extern uint64_t
+map_program_image(const uint64_t               image_index
+                  /*!< Index of the image in ELF_images. */,
+                  struct address_space * const address_space
+                  /*!< The address space to map the image in. */);
+
+/*! Adds an instance of an executable image, loading the image if it is
+    not cached. The image stays cached until the instance is dropped with
+    release_program_image.
+    \returns ALL_OK or ERROR if the index is invalid or there is not
+             enough memory. */
+extern long
+pin_program_image(const uint64_t image_index
+                  /*!< Index of the image in ELF_images. */);
+
+/*! Tells whether an address space has the page tables for every page of a
+    pinned image. Mapping the image after the address space has been
+    emptied then needs no memory.
+    \returns Non-zero iff no page table is missing. */
+extern int
+program_image_has_tables(const uint64_t               image_index
+                         /*!< Index of the image in ELF_images. */,
+                         struct address_space * const address_space
+                         /*!< The address space to look in. */);
+
+/*! Maps a pinned image like map_program_image. The instance is kept if
+    mapping fails.
+    \returns The address to the first instruction to execute or zero if
+             there is not enough memory. */
+extern uint64_t
+map_pinned_program_image(const uint64_t               image_index
+                         /*!< Index of the image in ELF_images. */,
+                         struct address_space * const address_space
+                         /*!< The address space to map the image in. */);
+
+/*! Adds an instance of an executable image already mapped by another
+    process. Used when an address space is copied. */
+extern void
+reference_program_image(const uint64_t image_index
+                        /*!< Index of the image in ELF_images. */);
+
+/*! Drops an instance of an executable image. The cached image is freed
+    when the last instance is gone. */
+extern void
+release_program_image(const uint64_t image_index
+                      /*!< Index of the image in ELF_images. */);
 
 /*! Grabs a spin lock with write permissions */
 inline void
@@ -184,7 +916,8 @@ grab_lock_rw(register volatile unsigned  int * const spin_lock
 {
  while (1)
  {
-  while (*spin_lock !=0);
+  while (*spin_lock !=0)
+   pause();
 
   if (0 == lock_cmpxchg32(spin_lock, 0, 0x80000000))
   return;
@@ -200,7 +933,8 @@ grab_lock_r(register volatile unsigned int * const spin_lock
  {
   register unsigned int spin_lock_value, new_spin_lock_value;
 
-  while (((*spin_lock) & 0x80000000) !=0);
+  while (((*spin_lock) & 0x80000000) !=0)
+   pause();
 
   new_spin_lock_value = *spin_lock;
 
@@ -246,6 +980,160 @@ release_lock(register volatile unsigned int * const spin_lock
  }
 }
 
+/*! A FIFO spin lock. Each arriving processor takes a ticket and waits until
+    the ticket is served, so the lock is handed out in arrival order. */
+struct ticket_lock
+{
+ /*! The ticket handed out to the next processor that arrives. */
+ volatile uint32_t next_ticket;
+ /*! The ticket of the processor holding the lock. */
+ volatile uint32_t now_serving;
+};
+
+/*! Initial value of a struct ticket_lock. */
+#define TICKET_LOCK_INITIALIZER { 0, 0 }
+
+/*! Grabs a ticket lock. */
+inline void
+grab_ticket_lock(register struct ticket_lock * const lock
+                 /*!< Points to the lock. */)
+{
+ register const uint32_t ticket = lock_xadd32(&lock->next_ticket, 1);
+
+ while (lock->now_serving != ticket)
+  pause();
+}
+
+/*! Releases a ticket lock. Only the holder writes now_serving so a plain
+    store is enough, AMD64 does not reorder stores with older stores. */
+inline void
+release_ticket_lock(register struct ticket_lock * const lock
+                    /*!< Points to the lock. */)
+{
+ __asm volatile("" : : : "memory");
+ lock->now_serving = lock->now_serving + 1;
+}
+
+/*! Disables interrupts and grabs a ticket lock.
+    \returns The flags to pass to release_ticket_lock_irqrestore. */
+inline uint64_t
+grab_ticket_lock_irqsave(register struct ticket_lock * const lock
+                         /*!< Points to the lock. */)
+{
+ register const uint64_t flags = save_flags_and_cli();
+
+ grab_ticket_lock(lock);
+ return flags;
+}
+
+/*! Releases a ticket lock and restores the interrupt flag. */
+inline void
+release_ticket_lock_irqrestore(register struct ticket_lock * const lock
+                               /*!< Points to the lock. */,
+                               register const uint64_t             flags
+                               /*!< The value returned by
+                                    grab_ticket_lock_irqsave. */)
+{
+ release_ticket_lock(lock);
+ restore_flags(flags);
+}
+
+/*! A queue node of a MCS lock. Each waiting processor spins on the locked
+    field of its own node, so waiters do not share cache lines. The node is
+    owned by the caller and must stay valid until the lock is released,
+    a local variable in the function grabbing the lock will do. */
+struct mcs_node
+{
+ /*! The node of the processor waiting behind this one. */
+ struct mcs_node * volatile next;
+ /*! Non-zero while the owner of the node has to wait. */
+ volatile uint64_t          locked;
+} __attribute__((aligned (AMD64_CACHE_LINE_SIZE)));
+
+/*! A MCS queue lock. */
+struct mcs_lock
+{
+ /*! Address of the node of the last processor in the queue, or zero if
+     the lock is free. */
+ volatile uint64_t tail;
+};
+
+/*! Initial value of a struct mcs_lock. */
+#define MCS_LOCK_INITIALIZER { 0 }
+
+/*! Grabs a MCS lock. */
+inline void
+grab_mcs_lock(register struct mcs_lock * const lock
+              /*!< Points to the lock. */,
+              register struct mcs_node * const node
+              /*!< Node owned by the caller. */)
+{
+ register struct mcs_node * predecessor;
+
+ node->next = 0;
+ node->locked = 1;
+
+ predecessor = (struct mcs_node *) lock_xchg64(&lock->tail,
+                                               (uint64_t) node);
+ if (0 == predecessor)
+  return;
+
+ predecessor->next = node;
+ while (node->locked)
+  pause();
+}
+
+/*! Releases a MCS lock. */
+inline void
+release_mcs_lock(register struct mcs_lock * const lock
+                 /*!< Points to the lock. */,
+                 register struct mcs_node * const node
+                 /*!< The node passed to grab_mcs_lock. */)
+{
+ if (0 == node->next)
+ {
+  /* No known successor. Try to free the lock. */
+  if ((uint64_t) node == lock_cmpxchg64(&lock->tail, (uint64_t) node, 0))
+   return;
+
+  /* A successor is linking itself in. Wait for it. */
+  while (0 == node->next)
+   pause();
+ }
+
+ __asm volatile("" : : : "memory");
+ node->next->locked = 0;
+}
+
+/*! Disables interrupts and grabs a MCS lock.
+    \returns The flags to pass to release_mcs_lock_irqrestore. */
+inline uint64_t
+grab_mcs_lock_irqsave(register struct mcs_lock * const lock
+                      /*!< Points to the lock. */,
+                      register struct mcs_node * const node
+                      /*!< Node owned by the caller. */)
+{
+ register const uint64_t flags = save_flags_and_cli();
+
+ grab_mcs_lock(lock, node);
+ return flags;
+}
+
+/*! Releases a MCS lock and restores the interrupt flag. */
+inline void
+release_mcs_lock_irqrestore(register struct mcs_lock * const lock
+                            /*!< Points to the lock. */,
+                            register struct mcs_node * const node
+                            /*!< The node passed to
+                                 grab_mcs_lock_irqsave. */,
+                            register const uint64_t          flags
+                            /*!< The value returned by
+                                 grab_mcs_lock_irqsave. */)
+{
+ release_mcs_lock(lock, node);
+ restore_flags(flags);
+}
+
 /*! Returns the currently active context. */
 inline struct AMD64Context *
 getActiveContext(void)
@@ -262,6 +1150,19 @@ setActiveContext(struct AMD64Context * const context)
  __asm volatile("mov %0,%%gs:0" : : "r" (context) : );
 }
 
+/*! Get the offset from per-CPU variable templates to the instances of the
+    calling processor.
+    \returns The percpuOffset field of the calling processor. */
+inline uint64_t
+get_percpu_offset(void)
+{
+ register uint64_t offset;
+
+ __asm volatile ("mov %%gs:40,%0" : "=r"(offset));
+
+ return offset;
+}
+
 /*! Get the index for the CPU.
     \returns The index into the amd64_CPU_private_table for the current
              CPU. */
@@ -300,6 +1201,9 @@ returnToUserLevel(const struct AMD64Context * const context,
   return;
  }
 
+ /* Load the address space of the context. */
+ switch_address_space(context->address_space);
+
  /* Set FPU/MMX/SSE context. */
  fxrstor(context->fp_context);
 
@@ -376,7 +1280,98 @@ returnToUserLevel(const struct AMD64Context * const context,
 
 /*! Array holding the private data for all processors. */
 extern struct AMD64KernelGSData
-amd64_CPU_private_table[16];
+amd64_CPU_private_table[AMD64_MAX_NUMBER_OF_CPUS];
+
+/*! The number of processors found in the ACPI tables. */
+extern uint64_t
+amd64_number_of_available_CPUs;
+
+/*! A big-reader lock for read-mostly data. Each processor has its own
+    reader count so readers only write to a cache line of their own. A
+    writer raises the writer flag and waits until the reader counts of all
+    processors have drained. Writers are expensive, use it only where
+    writes are rare. A reader must release the lock on the processor which
+    grabbed it. Define instances with DEFINE_BRLOCK. */
+struct brlock
+{
+ /*! Per-CPU variable holding the number of readers on each processor. */
+ volatile uint32_t * readers;
+ /*! Non-zero while a writer holds or waits for the lock. */
+ volatile uint32_t   writer;
+ /*! Serializes writers. */
+ struct ticket_lock  writer_lock;
+};
+
+/*! Defines a big-reader lock along with its per-CPU reader counts. */
+#define DEFINE_BRLOCK(name) \
+ DEFINE_PER_CPU(uint32_t, name##_brlock_readers); \
+ struct brlock name = { &name##_brlock_readers, 0, TICKET_LOCK_INITIALIZER }
+
+/*! Declares a big-reader lock defined in another file. */
+#define DECLARE_BRLOCK(name) \
+ extern struct brlock name
+
+/*! Grabs a big-reader lock with read permissions. */
+inline void
+grab_brlock_r(register struct brlock * const lock
+              /*!< Points to the lock. */)
+{
+ register volatile uint32_t * const readers = this_cpu_ptr(lock->readers);
+
+ while (1)
+ {
+  /* The locked add orders the increment before the read of the writer
+     flag. No other processor writes to this cache line. */
+  lock_xadd32(readers, 1);
+  if (0 == lock->writer)
+   return;
+
+  /* A writer is active. Back off so it can drain. */
+  lock_xadd32(readers, -1);
+  while (lock->writer)
+   pause();
+ }
+}
+
+/*! Releases a big-reader lock held with read permissions. */
+inline void
+release_brlock_r(register struct brlock * const lock
+                 /*!< Points to the lock. */)
+{
+ register volatile uint32_t * const readers = this_cpu_ptr(lock->readers);
+
+ __asm volatile("" : : : "memory");
+ *readers = *readers - 1;
+}
+
+/*! Grabs a big-reader lock with write permissions. */
+inline void
+grab_brlock_w(register struct brlock * const lock
+              /*!< Points to the lock. */)
+{
+ register uint64_t processor_index;
+
+ grab_ticket_lock(&lock->writer_lock);
+ lock_xchg32(&lock->writer, 1);
+
+ for (processor_index = 0;
+      processor_index < amd64_number_of_available_CPUs;
+      processor_index++)
+ {
+  while (*per_cpu_ptr(lock->readers, processor_index))
+   pause();
+ }
+}
+
+/*! Releases a big-reader lock held with write permissions. */
+inline void
+release_brlock_w(register struct brlock * const lock
+                 /*!< Points to the lock. */)
+{
+ __asm volatile("" : : : "memory");
+ lock->writer = 0;
+ release_ticket_lock(&lock->writer_lock);
+}
 
 extern void
 amd64_syscall_entry_point(void) __attribute__ ((noreturn));
@@ -404,7 +1399,7 @@ amd64_handle_exception_w_error_user(int exc,
                                     uint32_t code) __attribute__ ((noreturn));
 
 extern void
-amd64_handle_exception_w_error_super(int exc, uint32_t code);
+amd64_handle_exception_w_error_super(int exc, uint32_t code, uint64_t * rip);
 
 extern void
 amd64_handle_nmi_user(int dummy) __attribute__ ((noreturn));
@@ -417,6 +1412,11 @@ ELF_images[1];
 /*!< Array of pointers to ELF images. The array ends with a null
      pointer. */
 
+extern const uint64_t
+amd64_number_of_images;
+/*!< Number of ELF images in ELF_images, not counting the null pointer.
+     Set by the linker script. */
+
 /*! Assembly routine which will halt the calling processor forever. */
 extern void
 amd64_halt(void)  __attribute__ ((noreturn));
@@ -438,30 +1438,107 @@ amd64_top_of_available_physical_memory;
 extern volatile uint32_t *
 amd64_local_APIC_base_address;
 
+/*! Non-zero iff the local APICs are operated in x2APIC mode. In x2APIC mode
+    all local APIC registers are accessed through MSRs instead of through
+    the memory mapped page at amd64_local_APIC_base_address. */
+extern uint32_t
+amd64_x2APIC_mode;
+
+/* Local APIC registers. The registers are identified by their offset in the
+   xAPIC memory map. In x2APIC mode the register at offset x is found in the
+   MSR 0x800+(x>>4). */
+#define APIC_ID_REGISTER                   0x020
+#define APIC_TASK_PRIORITY_REGISTER        0x080
+#define APIC_EOI_REGISTER                  0x0b0
+#define APIC_SPURIOUS_VECTOR_REGISTER      0x0f0
+#define APIC_INTERRUPT_COMMAND_REGISTER    0x300
+#define APIC_INTERRUPT_COMMAND_REGISTER_HI 0x310
+#define APIC_LVT_TIMER_REGISTER            0x320
+#define APIC_LVT_THERMAL_REGISTER          0x330
+#define APIC_LVT_PERFORMANCE_REGISTER      0x340
+#define APIC_LVT_LINT0_REGISTER            0x350
+#define APIC_LVT_LINT1_REGISTER            0x360
+#define APIC_LVT_ERROR_REGISTER            0x370
+#define APIC_TIMER_INITIAL_COUNT_REGISTER  0x380
+#define APIC_TIMER_CURRENT_COUNT_REGISTER  0x390
+#define APIC_TIMER_DIVIDE_REGISTER         0x3e0
+
+/*! The MSR holding the local APIC base address and mode bits. */
+#define IA32_APIC_BASE_MSR                 0x1b
+
+/*! The first MSR of the x2APIC register block. */
+#define X2APIC_MSR_BASE                    0x800
+
+/*! Reads a register in the local APIC of the calling processor.
+    \returns The value of the register. */
+inline uint32_t
+read_APIC_register(register const unsigned int register_offset
+                   /*!< The offset of the register in the xAPIC memory
+                        map. */)
+{
+ if (amd64_x2APIC_mode)
+  return (uint32_t) rdmsr(X2APIC_MSR_BASE + (register_offset>>4));
+
+ return *(amd64_local_APIC_base_address + register_offset/4);
+}
+
+/*! Writes a register in the local APIC of the calling processor. */
 inline void
-send_IPI(register unsigned char const destination_processor_index,
-         register unsigned int  const vector)
+write_APIC_register(register const unsigned int register_offset
+                    /*!< The offset of the register in the xAPIC memory
+                         map. */,
+                    register const uint32_t     value
+                    /*!< The value to write. */)
 {
- /* Set destination. */
- *(amd64_local_APIC_base_address+0x310/4) =
- amd64_CPU_private_table[destination_processor_index].APICId<<(56-32);
- /* And send interrupts. */
- *(amd64_local_APIC_base_address+0x300/4) = vector & 0xff;
+ if (amd64_x2APIC_mode)
+  wrmsr(X2APIC_MSR_BASE + (register_offset>>4), value);
+ else
+  *(amd64_local_APIC_base_address + register_offset/4) = value;
 }
-//////////////////////////////////
 
-/*! Meta-data of allocated block. Each dynamically allocated block is
- * preceded by that data structure.
- */
+/*! Signals end of interrupt to the local APIC of the calling processor. In
+    x2APIC mode this is a single non-serializing MSR write. */
+inline void
+APIC_EOI(void)
+{
+ write_APIC_register(APIC_EOI_REGISTER, 0);
+}
 
-typedef struct block * blockPtr;
+/*! Writes an interrupt command to the local APIC of the calling processor.
+    The xAPIC needs two MMIO writes, destination first. The x2APIC takes
+    destination and command in one 64-bit MSR write and supports 32-bit
+    APIC ids. */
+inline void
+send_APIC_command(register const uint64_t APIC_id
+                  /*!< The APIC id of the destination processor. */,
+                  register const uint32_t command
+                  /*!< The low 32 bits of the interrupt command. */)
+{
+ if (amd64_x2APIC_mode)
+ {
+  wrmsr(X2APIC_MSR_BASE + (APIC_INTERRUPT_COMMAND_REGISTER>>4),
+        (APIC_id<<32) | command);
+ }
+ else
+ {
+  /* Set destination. */
+  *(amd64_local_APIC_base_address+APIC_INTERRUPT_COMMAND_REGISTER_HI/4) =
+   APIC_id<<(56-32);
+  /* And send the command. */
+  *(amd64_local_APIC_base_address+APIC_INTERRUPT_COMMAND_REGISTER/4) =
+   command;
+ }
+}
 
- struct block {
-  uint32_t full; /*!< Indicator of emptiness of cell. 0 if empty, 1 otherwise. */
-  uint64_t size; /*!< Size of the allocated memory block corresponding that strucure. */
-  blockPtr prev; /*!< Pointer to the previous memory block's meta-data.*/
-  blockPtr next; /*!< Pointer to the next memory block's meta-data.*/
-};
+inline void
+send_IPI(register unsigned char const destination_processor_index,
+         register unsigned int  const vector)
+{
+ send_APIC_command(
+  amd64_CPU_private_table[destination_processor_index].APICId,
+  vector & 0xff);
+}
+//////////////////////////////////
 
 /*! Allocates a memory block.
     \return an address to the memory block or an error code if
@@ -478,60 +1555,379 @@ kfree(const register uint64_t address
        /*!< The address to the memory block to free. */);
 
 
-/*! Terminates the caller process. */
-extern void kterminate();
+/*! Links a callback into the RCU callback lists. Embed it in the object
+    the callback reclaims. */
+struct rcu_head
+{
+ struct rcu_head * next;                   /*!< The next callback. */
+ void (* func)(struct rcu_head *);         /*!< The callback. */
+};
+
+/*! Reads a pointer which is published with rcu_assign_pointer. Readers
+    need no lock. Kernel code runs with interrupts disabled, so the object
+    pointed to stays valid until the reader returns to user level or
+    halts. */
+#define rcu_dereference(pointer) \
+ (*(__typeof__(pointer) volatile *) &(pointer))
+
+/*! Publishes a pointer to readers using rcu_dereference. The stores
+    initializing the object pointed to are visible before the pointer. */
+#define rcu_assign_pointer(pointer, value) \
+ do \
+ { \
+  __asm volatile("" : : : "memory"); \
+  (*(__typeof__(pointer) volatile *) &(pointer)) = (value); \
+ } while (0)
+
+/*! Calls func with head as argument once all processors have passed a
+    quiescent state, that is when no reader can still hold a reference to
+    the object that head is part of. */
+extern void
+call_rcu(struct rcu_head * const head /*!< Embedded in the object. */,
+         void (* const func)(struct rcu_head *)
+         /*!< Reclaims the object. */);
+
+/*! Reports a quiescent state for the calling processor, advances grace
+    periods and invokes the callbacks whose grace period has elapsed.
+    Called on each timer tick. */
+extern void
+rcu_note_quiescent_state(void);
+
+/*! Terminates the caller process. The exit status is handed to the
+ * parent. */
+extern void kterminate(uint64_t exit_status
+		/*< The exit status of the process. */);
+
+/*! Maximum number of terminated processes a busy processor keeps on its
+ * reclaim list. */
+#define AMD64_RECLAIM_BACKLOG 8
+
+/*! Frees one terminated process from the reclaim list of the calling
+ * processor if the list holds more than keep processes. Called by the
+ * idle loop with keep zero and on timer ticks with keep
+ * AMD64_RECLAIM_BACKLOG, so that processors which never idle do not
+ * accumulate processes.
+ * \return Non-zero if a process was freed. */
+extern int reclaim_processes(uint64_t keep
+		/*< Number of processes that may be left on the list. */);
+
+/*! Waits for a child of the caller process to terminate. If the child is
+ * still running the caller is blocked and the system call is restarted
+ * when the child terminates. The result is stored in the context of the
+ * caller. */
+extern void kwait(uint64_t pid
+		/*< The process id of the child. */,
+		uint64_t * exit_status
+		/*< User variable receiving the exit status. */);
 
 /*! Creates a process and pushes it to the process queue.
- * \return status of operation. */
+ * \return The process id of the process or ERROR. */
 
 extern unsigned long kcreateprocess(uint64_t rdi
 		/*< The array index of elf image*/);
 
+/*! Builds a process from an executable image without starting it. The
+ * process has no process id yet.
+ * \return The queue element of the process or zero if unsuccessful. */
+extern struct process_queue_element * kbuildprocess(uint64_t rdi
+		/*< The array index of elf image*/);
+
+/*! Default number of prebuilt processes kept for each executable image. */
+#define AMD64_DEFAULT_PROCESS_POOL_SIZE 4
+
+/*! Number of prebuilt processes kept for each executable image. Zero
+ * disables the pools. */
+extern uint64_t amd64_process_pool_size;
+
+/*! Allocates an empty pool for each executable image. */
+extern void initialize_process_pools(void);
+
+/*! Takes a prebuilt process from the pool of an executable image.
+ * \return The queue element of the process or zero if the pool is
+ *          empty. */
+extern struct process_queue_element * take_process_shell(const uint64_t image_index
+		/*< The array index of elf image*/);
+
+/*! Builds a process for a pool which is not full. Called by idle
+ * processors.
+ * \return Non-zero if a process was built. */
+extern int refill_process_pools(void);
+
+/*! Lets the pools be refilled again after a failed build. Called when a
+ * process has been freed. */
+extern void resume_process_pools(void);
+
+/*! Maximum number of processes created by one call to kcreateprocesses. */
+#define AMD64_MAX_PROCESSES_PER_BATCH 64
+
+/*! Creates several processes from the same executable image. The
+ * processes are created from the pool of the image when possible. Either
+ * all processes are created or none.
+ * \return The number of processes created or ERROR. */
+extern unsigned long kcreateprocesses(uint64_t rdi
+		/*< The array index of elf image*/,
+		uint64_t count
+		/*< The number of processes to create. */,
+		uint64_t * pids
+		/*< User array receiving the process ids. */,
+		uint64_t flags
+		/*< CREATEPROCESSES_SPREAD or zero. */);
+
+/*! Creates a copy of the caller process. The address space is copied
+ * copy-on-write. The copy returns zero from the system call.
+ * \return The process id of the copy or ERROR. */
+extern unsigned long kfork(void);
+
+/*! Replaces the program of the caller process. The process entry, the
+ * context and the address space are reused. A new address space is used
+ * only if the new image needs page tables the old one does not have.
+ * \return ERROR if the caller runs on unchanged, otherwise ALL_OK. */
+extern unsigned long kexec(uint64_t rdi
+		/*< The array index of elf image*/);
+
 /*! scheduler function is called when PIT interrupt (interrupt 32) interrupts
  * the operating system. The frequency of scheduler calls (25 Hz) is one eighth of PIT
  * interrupt frequency (200 Hz) .*/
 extern void scheduler();
 
 
-/*! Each process is described with one this data structure.*/
+/*! The exit status of a process. The record is shared by the process and
+ * its parent. It outlives the process until the parent has waited for it
+ * or terminated. */
+struct child_record {
+	uint64_t                          pid; /*!< Process id of the child */
+	uint64_t                  exit_status; /*!< Valid once exited is set */
+	uint64_t                       exited; /*!< Set when the child terminates */
+	uint64_t                     orphaned; /*!< Set when the parent terminates */
+	struct process_queue_element * waiter; /*!< The blocked parent, if any */
+	struct child_record *            next; /*!< Next child of the parent */
+};
+
+/*! Each process is described with one this data structure. The fields
+ * used when scheduling come first. */
 struct process_entry {
-	uint64_t                   id; /*!<Index of elf image in elf images array */
-	uint64_t      memory_location; /*!< The initial memory location of program's segments */
-	struct AMD64Context * context; /*!<A pointer to the context associated with the program*/
+	uint64_t                  pid; /*!<Process id, unique among all processes. The low bits index the process table */
 	uint64_t                state; /*!< State indicator. READY, RUNNING and BLOCKED are three options */
+	struct AMD64Context * context; /*!<A pointer to the context associated with the program*/
+	struct address_space * address_space; /*!< The address space the program's segments are mapped in */
+	uint64_t                   id; /*!<Index of elf image in elf images array */
+	struct child_record * children; /*!<Records of the children of the process */
+	struct child_record *   record; /*!<Record in the parent, zero if there is no parent */
 
-	//*state will come here
 	//*threads will come here. May be a semaphore
 };
 
-/*! Process queue linked list unit. */
+/*! Maximum number of handles a process holds. */
+#define AMD64_MAX_NUMBER_OF_HANDLES 256
+
+/*! Number of entries in the handle table a process gets with its first
+ * handle. The table doubles when it is full. */
+#define AMD64_INITIAL_NUMBER_OF_HANDLES 16
+
+/*! Kinds of kernel object. KERNEL_OBJECT_ANY matches all kinds when
+ * looking up handles. */
+#define KERNEL_OBJECT_ANY           0
+#define KERNEL_OBJECT_SHARED_MEMORY 1
+#define KERNEL_OBJECT_CHANNEL       2
+#define KERNEL_OBJECT_PIPE_READER   3
+#define KERNEL_OBJECT_PIPE_WRITER   4
+#define KERNEL_OBJECT_SEMAPHORE     5
+#define KERNEL_OBJECT_TIMER         6
+#define KERNEL_OBJECT_POLL_SET      7
+
+/*! A registration of an object in a poll set. */
+struct poll_entry;
+
+/*! The part common to all objects a process refers to through handles.
+ * It is embedded first in each object. */
+struct kernel_object {
+	volatile uint64_t references; /*!< Handles and other references to the object */
+	volatile uint64_t handles; /*!< Handles to the object. Registrations in poll sets are dropped when the last one is closed */
+	uint64_t                type; /*!< One of the KERNEL_OBJECT_ constants */
+	void (* destroy)(struct kernel_object * object); /*!< Frees the object when the last reference is dropped */
+	uint64_t                 key; /*!< Name of the object, zero if it is anonymous */
+	struct kernel_object *  next; /*!< Next named object */
+	uint64_t (* poll)(struct kernel_object * object); /*!< Returns the POLL_ events the object is ready for. Zero if the object cannot be polled */
+	struct ticket_lock watchers_lock; /*!< Protects watchers */
+	struct poll_entry *   watchers; /*!< Registrations of the object in poll sets */
+};
+
+/*! Initializes the common part of a new object. The object holds one
+ * reference. */
+extern void initialize_object(struct kernel_object * object,
+		uint64_t type /*< One of the KERNEL_OBJECT_ constants. */,
+		void (* destroy)(struct kernel_object * object),
+		uint64_t (* poll)(struct kernel_object * object)
+		/*< Zero if the object cannot be polled. */);
+
+/*! Tells the poll sets watching an object that it may have become ready.
+ * Called after each change of the state the poll function of the object
+ * reads, with the lock protecting that state held or not. */
+extern void notify_watchers(struct kernel_object * object);
+
+/*! Drops the registrations of an object in poll sets. Called when the last
+ * handle to the object is closed, so that the references held by poll sets
+ * do not keep the object alive. */
+extern void forget_watchers(struct kernel_object * object);
+
+/*! Looks up a named object and takes a reference to it.
+ * \return The object or zero if no object of the type has the key. */
+extern struct kernel_object * find_named_object(uint64_t type
+		/*< One of the KERNEL_OBJECT_ constants. */,
+		uint64_t key /*< The name. */);
+
+/*! Names an object which has no name unless another object of the same
+ * type already has the key.
+ * \return The object, or the one which has the key with a reference
+ * taken to it. */
+extern struct kernel_object * name_object(struct kernel_object * object,
+		uint64_t key /*< The name, not zero. */);
+
+/*! Adds a reference to a kernel object. */
+extern void reference_object(struct kernel_object * object);
+
+/*! Drops a reference to a kernel object. The last one destroys it. */
+extern void release_object(struct kernel_object * object);
+
+/*! Installs a handle in the calling process. The handle takes over a
+ * reference the caller holds.
+ * \return The handle or ERROR if the handle table is full. */
+extern long install_handle(struct kernel_object * object);
+
+/*! Looks up a handle of the calling process. The object stays valid while
+ * the process holds the handle.
+ * \return The object or zero if the handle is invalid or of another type. */
+extern struct kernel_object * find_handle(uint64_t handle,
+		uint64_t type /*< One of the KERNEL_OBJECT_ constants. */);
+
+/*! Closes a handle of the calling process.
+ * \return ALL_OK or ERROR if the handle is invalid. */
+extern long close_handle(uint64_t handle);
+
+/*! Process queue linked list unit. It is also the entry of the process in
+ * the process table. The process entry and the next pointer fill the first
+ * cache line. The context is embedded and starts on a cache line of its
+ * own. */
 struct process_queue_element {
 	struct process_entry        element; /*!< The process entry */
 	struct process_queue_element * next; /*!<Pointer to the next element */
+	struct rcu_head                 rcu; /*!< Defers reclamation of the element. */
+	struct kernel_object ** handles; /*!< Objects the process holds, indexed by handle. Allocated with the first handle, zero while the entry is free */
+	uint64_t      number_of_handles; /*!< Number of entries in handles */
+	struct AMD64Context   saved_context  /*!< The context, element.context points to it */
+	 __attribute__((aligned (AMD64_CACHE_LINE_SIZE)));
+} __attribute__((aligned (AMD64_CACHE_LINE_SIZE)));
+
+/*! Number of bits of a process id which index the process table. The
+ * remaining bits count how many times the entry has been reused. */
+#define AMD64_PROCESS_TABLE_BITS 8
+
+/*! Maximum number of processes, including those kept in process pools. */
+#define AMD64_MAX_NUMBER_OF_PROCESSES (1<<AMD64_PROCESS_TABLE_BITS)
+
+/*! Allocates an entry in the process table and gives it a process id. The
+ * context pointer is set to the embedded context.
+ * \return The entry or zero if the table is full. */
+extern struct process_queue_element * allocate_process(void);
+
+/*! Returns an entry to the process table. Its process id becomes
+ * invalid. */
+extern void free_process(struct process_queue_element * process
+		/*< The entry to free. */);
+
+/*! Processes blocked until an object changes state. It is protected by
+ * the lock of the object. */
+struct wait_queue {
+	struct process_queue_element * waiters; /*!< Linked through next */
+};
+
+/*! Returned by system calls which blocked the caller. The system call is
+ * executed again when the caller is woken up, so its rax must be left
+ * alone. */
+#define AMD64_RESTART_SYSCALL (-1000)
+
+/*! Blocks the calling process on a wait queue and runs the next process.
+ * The system call of the caller is executed again when it is woken up.
+ * The lock protecting the queue is released once the caller is queued. */
+extern void block_process(struct wait_queue * queue,
+		struct ticket_lock * lock /*< Held by the caller. */);
+
+/*! Wakes up all processes blocked on a wait queue. Must be called with the
+ * lock protecting the queue held. */
+extern void wake_up_waiters(struct wait_queue * queue);
+
+/*! Gives a process, which has no handles, the handles of another. Both
+ * hold the objects.
+ * \return ALL_OK or ERROR if there is not enough memory for the table. */
+extern long copy_handles(const struct process_queue_element * from,
+		struct process_queue_element * to);
+
+/*! Closes all handles of a process and frees its handle table. */
+extern void close_all_handles(struct process_queue_element * process);
+
+/*! The run queue of a processor. The top element is the process the
+    processor executes. Only the owning processor links and unlinks
+    elements. Other processors push processes onto the wakeup list and the
+    owner moves them into the queue at its next scheduling point. */
+struct run_queue {
+	/*! Pointer to the top element in queue. This process is executed by CPU */
+	struct process_queue_element *  top;
+	/*! Pointer to the last element in queue. */
+	struct process_queue_element * back;
+	/*! Number of processes in the queue or on the wakeup list. Read by
+	    other processors when placing processes. */
+	volatile uint64_t nr_running __attribute__((aligned (AMD64_CACHE_LINE_SIZE)));
+	/*! Lock-free LIFO list of processes woken up by any processor. It is
+	    written by other processors, so it is kept off the cache line of top
+	    and back. */
+	volatile uint64_t wakeup_list;
 };
 
-/*! Pointer to the top element in queue. This process is executed by CPU */
-extern struct process_queue_element *  top_process;
+/*! The run queue of each processor. */
+DECLARE_PER_CPU(struct run_queue, run_queue);
 
-/*! Pointer to the last element in queue. This process is executed by CPU */
-extern struct process_queue_element * back_process;
+/*! Interrupt vector of the IPI sent to make a processor drain its wakeup
+ * list. */
+#define RESCHEDULE_IPI_VECTOR 240
 
 /*! queue emptiness check.
  * \return 1 if queue is empty. 0 otherwise.
  */
 extern uint64_t is_empty_process_queue();
 
-/*! Pushes the process to the queue end. */
-extern void push_back_process_queue(struct process_entry
-		/*!<Process to be pushed */);
-
 /*! \return process struct of the top-most element in queue. */
 extern struct process_entry top_process_queue();
 
-/*! Removes the top-most element of the queue.
- * \return process struct of the top-most element in queue.
+/*! Removes the top-most element of the queue without reclaiming it. The
+ * caller reclaims it through call_rcu as lock-free readers may still
+ * reference it.
+ * \return The element removed.
  */
-extern struct process_entry pop_process_queue();
+extern struct process_queue_element * unlink_top_process_queue();
+
+/*! Moves the top-most element of the queue to its back. The element is
+ * relinked rather than reallocated. */
+extern void rotate_process_queue();
+
+/*! Makes a process runnable on a processor. Pushes the process onto the
+ * wakeup list of the processor and sends it a reschedule IPI if it is
+ * another processor. Never takes a lock. */
+extern void wake_up_process(struct process_queue_element * const process
+		/*!< Not linked into any queue. */,
+		const uint64_t processor_index
+		/*!< Index of the processor to run the process on. */);
+
+/*! Moves the processes on the wakeup list of the calling processor to the
+ * back of its run queue. */
+extern void drain_wakeup_list();
+
+/*! \return The index of the processor with the fewest runnable processes. */
+extern uint64_t select_processor();
+
+/*! Runs the scheduler and processes until there is nothing to run, then
+ * halts until the next interrupt. Each processor ends up here when it has
+ * no process to execute. */
+extern void amd64_idle(void) __attribute__ ((noreturn));
 
 /*! Outputs a string through the terminal emulator. */
 extern void
@@ -0,0 +1,278 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file handles.c This file holds the handle tables of processes. A
+    handle is an index in the table of a process and each entry of the
+    table holds a reference to a kernel object. Only the process itself
+    uses its table, so the tables need no locks. A table is allocated with
+    the first handle and grows when it is full. Objects may be given a
+    name, a key, through which unrelated processes open them.
+
+    Handles are counted apart from the other references. Poll sets hold
+    references to the objects they watch, and these are dropped when the
+    last handle is closed. An end of a pipe is thereby closed even if it is
+    still registered in a poll set.
+ */
+
+#include "globals.h"
+
+/*! Protects named_objects. */
+static struct ticket_lock names_lock = TICKET_LOCK_INITIALIZER;
+
+/*! List of the named objects of all types. */
+static struct kernel_object * named_objects;
+
+void
+initialize_object(register struct kernel_object * const object,
+                  register const uint64_t               type,
+                  void (* const destroy)(struct kernel_object * object),
+                  uint64_t (* const poll)(struct kernel_object * object))
+{
+ object->references = 1;
+ object->handles = 0;
+ object->type = type;
+ object->destroy = destroy;
+ object->key = 0;
+ object->next = 0;
+ object->poll = poll;
+ object->watchers_lock = (struct ticket_lock) TICKET_LOCK_INITIALIZER;
+ object->watchers = 0;
+}
+
+void
+reference_object(register struct kernel_object * const object)
+{
+ lock_xadd64(&object->references, 1);
+}
+
+void
+release_object(register struct kernel_object * const object)
+{
+ if (1 != lock_xadd64(&object->references, -1))
+  return;
+
+ if (object->key)
+ {
+  register struct kernel_object ** link;
+
+  grab_ticket_lock(&names_lock);
+  for (link = &named_objects; *link != object; link = &(*link)->next);
+  *link = object->next;
+  release_ticket_lock(&names_lock);
+ }
+
+ object->destroy(object);
+}
+
+/*! Looks up a named object and takes a reference to it. An object whose
+    last reference has been dropped is skipped, it is about to be unlinked.
+    Must be called with names_lock held. */
+static struct kernel_object *
+find_named_object_locked(register const uint64_t type,
+                         register const uint64_t key)
+{
+ register struct kernel_object * object;
+
+ for (object = named_objects; object; object = object->next)
+ {
+  register uint64_t references = object->references;
+
+  if (key != object->key || type != object->type)
+   continue;
+
+  while (references)
+  {
+   register const uint64_t seen =
+    lock_cmpxchg64(&object->references, references, references + 1);
+
+   if (seen == references)
+    return object;
+   references = seen;
+  }
+ }
+
+ return 0;
+}
+
+struct kernel_object *
+find_named_object(register const uint64_t type,
+                  register const uint64_t key)
+{
+ register struct kernel_object * object;
+
+ grab_ticket_lock(&names_lock);
+ object = find_named_object_locked(type, key);
+ release_ticket_lock(&names_lock);
+ return object;
+}
+
+struct kernel_object *
+name_object(register struct kernel_object * const object,
+            register const uint64_t               key)
+{
+ register struct kernel_object * existing;
+
+ grab_ticket_lock(&names_lock);
+ existing = find_named_object_locked(object->type, key);
+ if (0 == existing)
+ {
+  object->key = key;
+  object->next = named_objects;
+  named_objects = object;
+ }
+ release_ticket_lock(&names_lock);
+
+ return existing ? existing : object;
+}
+
+/*! \returns The process table entry of the calling process. */
+static inline struct process_queue_element *
+current_process(void)
+{
+ return this_cpu_ptr(&run_queue)->top;
+}
+
+/*! Gives a process a handle table with a given number of entries. The
+    handles in the old table are moved to the new one.
+    \returns ALL_OK or ERROR if there is not enough memory. */
+static long
+resize_handles(register struct process_queue_element * const process,
+               register const uint64_t                       number_of_handles)
+{
+ register const long memory =
+  kalloc(number_of_handles * sizeof(struct kernel_object *));
+ register struct kernel_object ** handles;
+ register uint64_t                handle;
+
+ if (ERROR == memory)
+  return ERROR;
+
+ handles = (struct kernel_object **) memory;
+ for (handle = 0; handle < number_of_handles; handle++)
+  handles[handle] =
+   handle < process->number_of_handles ? process->handles[handle] : 0;
+
+ if (process->handles)
+  kfree((uint64_t) process->handles);
+ process->handles = handles;
+ process->number_of_handles = number_of_handles;
+ return ALL_OK;
+}
+
+long
+install_handle(register struct kernel_object * const object)
+{
+ register struct process_queue_element * const process = current_process();
+ register uint64_t                             handle;
+
+ for (handle = 0; handle < process->number_of_handles; handle++)
+ {
+  if (0 == process->handles[handle])
+   break;
+ }
+
+ if (handle == process->number_of_handles)
+ {
+  if (handle >= AMD64_MAX_NUMBER_OF_HANDLES ||
+      ALL_OK != resize_handles(process,
+                               handle ? 2 * handle :
+                                        AMD64_INITIAL_NUMBER_OF_HANDLES))
+   return ERROR;
+ }
+
+ process->handles[handle] = object;
+ lock_xadd64(&object->handles, 1);
+ return handle;
+}
+
+struct kernel_object *
+find_handle(register const uint64_t handle,
+            register const uint64_t type)
+{
+ register const struct process_queue_element * const process =
+  current_process();
+ register struct kernel_object *                     object;
+
+ if (handle >= process->number_of_handles)
+  return 0;
+
+ object = process->handles[handle];
+ if (0 == object || (KERNEL_OBJECT_ANY != type && type != object->type))
+  return 0;
+ return object;
+}
+
+/*! Drops a handle to an object and the reference the handle held. */
+static void
+drop_handle(register struct kernel_object * const object)
+{
+ if (1 == lock_xadd64(&object->handles, -1))
+  forget_watchers(object);
+ release_object(object);
+}
+
+long
+close_handle(register const uint64_t handle)
+{
+ register struct process_queue_element * const process = current_process();
+ register struct kernel_object *               object;
+
+ if (handle >= process->number_of_handles || 0 == process->handles[handle])
+  return ERROR;
+
+ object = process->handles[handle];
+ process->handles[handle] = 0;
+ drop_handle(object);
+ return ALL_OK;
+}
+
+long
+copy_handles(register const struct process_queue_element * const from,
+             register struct process_queue_element * const       to)
+{
+ register uint64_t handle;
+
+ if (0 == from->number_of_handles)
+  return ALL_OK;
+ if (ALL_OK != resize_handles(to, from->number_of_handles))
+  return ERROR;
+
+ for (handle = 0; handle < from->number_of_handles; handle++)
+ {
+  to->handles[handle] = from->handles[handle];
+  if (to->handles[handle])
+  {
+   reference_object(to->handles[handle]);
+   lock_xadd64(&to->handles[handle]->handles, 1);
+  }
+ }
+ return ALL_OK;
+}
+
+void
+close_all_handles(register struct process_queue_element * const process)
+{
+ register uint64_t handle;
+
+ for (handle = 0; handle < process->number_of_handles; handle++)
+ {
+  register struct kernel_object * const object = process->handles[handle];
+
+  if (object)
+  {
+   process->handles[handle] = 0;
+   drop_handle(object);
+  }
+ }
+
+ if (process->handles)
+ {
+  kfree((uint64_t) process->handles);
+  process->handles = 0;
+  process->number_of_handles = 0;
+ }
+}
@@ -173,7 +173,7 @@ writeCr3(register const uint64_t value /*!< The value to write to the
                                             register. */)
 {
  __asm volatile("movq %0,%%cr3" : :
-                "r" (value) : );
+                "r" (value) : "memory");
 }
 
 /*! Wrapper for writing the cr4 register. */
@@ -327,6 +327,37 @@ ltr(register const uint16_t selector  /*!< A selector into the GDT
  __asm volatile("ltr %%ax" : : "a" (selector) : );
 }
 
+/*! Wrapper for the pause instruction. Used in spin-wait loops to tell the
+    processor that it is spinning. It saves power, frees resources for a
+    sibling hyper-thread and avoids a memory order violation when the loop
+    exits. */
+inline void
+pause(void)
+{
+ __asm volatile("pause" : : : "memory");
+}
+
+/*! Saves rflags and disables interrupts.
+    \returns The value of rflags before interrupts were disabled. */
+inline uint64_t
+save_flags_and_cli(void)
+{
+ register uint64_t flags;
+
+ __asm volatile("pushfq\n popq %0\n cli" : "=r" (flags) : : "memory");
+
+ return flags;
+}
+
+/*! Restores rflags saved by save_flags_and_cli. Interrupts are enabled again
+    only if they were enabled when the flags were saved. */
+inline void
+restore_flags(register const uint64_t flags
+              /*!< The value returned by save_flags_and_cli. */)
+{
+ __asm volatile("pushq %0\n popfq" : : "r" (flags) : "memory", "cc");
+}
+
 /*! Wrapper for the sti instruction. */
 inline void
 sti(void)
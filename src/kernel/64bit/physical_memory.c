@@ -0,0 +1,230 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file physical_memory.c This file holds the page frame allocator. The
+    available physical memory is split in two parts. The lower part is the
+    kalloc heap and the upper part is handed out as 4 KB page frames or as
+    2 MB frames for large pages. All of physical memory is identity mapped
+    so the kernel accesses a frame through its physical address.
+ */
+
+#include "globals.h"
+
+uint64_t
+amd64_kernel_heap_top;
+
+uint64_t
+amd64_frames_start;
+
+uint64_t
+amd64_frames_end;
+
+/*! Protects the frame allocator. */
+static struct mcs_lock frame_lock = MCS_LOCK_INITIALIZER;
+
+/*! List of free frames. The first word of a free frame holds the address
+    of the next free frame. */
+static uint64_t free_frame_list;
+
+/*! List of free 2 MB frames, linked like free_frame_list. */
+static uint64_t free_large_frame_list;
+
+/*! Frames from this address up to amd64_frames_end have never been
+    allocated. */
+static uint64_t next_unused_frame;
+
+/*! Reference count of each frame. */
+static volatile uint32_t * frame_reference_counts;
+
+void
+initialize_physical_memory(void)
+{
+ register const uint64_t heap_base =
+  (amd64_lowest_available_physical_memory + 0xfff) & ~0xfffULL;
+ register const uint64_t heap_size =
+  (amd64_top_of_available_physical_memory - heap_base) / 4;
+
+ /* The heap starts on a page boundary. */
+ amd64_lowest_available_physical_memory = heap_base;
+
+ /* Give roughly a quarter of the memory to the kernel heap. The frames
+    start on a 2 MB boundary so that large pages can be carved out. */
+ amd64_frames_start = (heap_base + heap_size + 0x1fffff) & ~0x1fffffULL;
+ amd64_frames_end = amd64_top_of_available_physical_memory & ~0xfffULL;
+ amd64_kernel_heap_top = amd64_frames_start;
+ kernel_heap.start = heap_base;
+ kernel_heap.size = ALLOCATE_SIZE;
+
+ next_unused_frame = amd64_frames_start;
+ free_frame_list = 0;
+ free_large_frame_list = 0;
+
+ {
+  register const uint64_t number_of_frames =
+   (amd64_frames_end - amd64_frames_start) >> 12;
+  register const long counts =
+   kalloc(number_of_frames * sizeof(*frame_reference_counts));
+  register uint64_t i;
+
+  if (ERROR == counts)
+  {
+   while (1)
+    kprints("Kernel panic! Too little memory for the frame allocator.\n");
+  }
+
+  frame_reference_counts = (volatile uint32_t *) counts;
+  for (i = 0; i < number_of_frames; i++)
+   frame_reference_counts[i] = 0;
+ }
+}
+
+/*! \returns Non-zero iff the frame belongs to the frame allocator. */
+static inline int
+is_allocated_frame(register const uint64_t frame)
+{
+ return frame >= amd64_frames_start && frame < amd64_frames_end;
+}
+
+/*! \returns The reference count of the frame. */
+static inline volatile uint32_t *
+reference_count(register const uint64_t frame)
+{
+ return &frame_reference_counts[(frame - amd64_frames_start) >> 12];
+}
+
+uint64_t
+allocate_frame(void)
+{
+ struct mcs_node         node;
+ register const uint64_t flags = grab_mcs_lock_irqsave(&frame_lock, &node);
+ register uint64_t       frame = free_frame_list;
+
+ if (frame)
+  free_frame_list = *((uint64_t *) frame);
+ else if (next_unused_frame < amd64_frames_end)
+ {
+  frame = next_unused_frame;
+  next_unused_frame += 4096;
+ }
+ else if (free_large_frame_list)
+ {
+  register uint64_t small_frame;
+
+  /* Out of small frames. Split a 2 MB frame. */
+  frame = free_large_frame_list;
+  free_large_frame_list = *((uint64_t *) frame);
+  for (small_frame = frame + 4096;
+       small_frame < frame + AMD64_LARGE_PAGE_SIZE;
+       small_frame += 4096)
+  {
+   *((uint64_t *) small_frame) = free_frame_list;
+   free_frame_list = small_frame;
+  }
+ }
+
+ release_mcs_lock_irqrestore(&frame_lock, &node, flags);
+
+ if (frame)
+  *reference_count(frame) = 1;
+ return frame;
+}
+
+uint64_t
+allocate_large_frame(void)
+{
+ struct mcs_node         node;
+ register const uint64_t flags = grab_mcs_lock_irqsave(&frame_lock, &node);
+ register uint64_t       frame = free_large_frame_list;
+
+ if (frame)
+  free_large_frame_list = *((uint64_t *) frame);
+ else
+ {
+  register const uint64_t aligned =
+   (next_unused_frame + AMD64_LARGE_PAGE_SIZE - 1) &
+   ~(AMD64_LARGE_PAGE_SIZE - 1);
+
+  if (aligned + AMD64_LARGE_PAGE_SIZE <= amd64_frames_end)
+  {
+   /* The frames skipped to reach the boundary become small frames. */
+   for (; next_unused_frame < aligned; next_unused_frame += 4096)
+   {
+    *((uint64_t *) next_unused_frame) = free_frame_list;
+    free_frame_list = next_unused_frame;
+   }
+
+   frame = aligned;
+   next_unused_frame = aligned + AMD64_LARGE_PAGE_SIZE;
+  }
+ }
+
+ release_mcs_lock_irqrestore(&frame_lock, &node, flags);
+
+ if (frame)
+  *reference_count(frame) = 1;
+ return frame;
+}
+
+void
+clear_frame(register const uint64_t frame)
+{
+ register uint64_t * const page = (uint64_t *) frame;
+ register int              i;
+
+ for (i = 0; i < 512; i++)
+  page[i] = 0;
+}
+
+void
+reference_frame(register const uint64_t frame)
+{
+ if (is_allocated_frame(frame))
+  lock_xadd32(reference_count(frame), 1);
+}
+
+uint32_t
+frame_reference_count(register const uint64_t frame)
+{
+ /* Frames outside the allocator are shared by everyone. */
+ if (!is_allocated_frame(frame))
+  return ~0U;
+ return *reference_count(frame);
+}
+
+void
+release_frame(register const uint64_t frame)
+{
+ struct mcs_node  node;
+ register uint64_t flags;
+
+ if (!is_allocated_frame(frame))
+  return;
+
+ /* Drop the reference. The last one frees the frame. */
+ if (1 != lock_xadd32(reference_count(frame), -1))
+  return;
+
+ flags = grab_mcs_lock_irqsave(&frame_lock, &node);
+ *((uint64_t *) frame) = free_frame_list;
+ free_frame_list = frame;
+ release_mcs_lock_irqrestore(&frame_lock, &node, flags);
+}
+
+void
+release_large_frame(register const uint64_t frame)
+{
+ struct mcs_node  node;
+ register uint64_t flags;
+
+ if (1 != lock_xadd32(reference_count(frame), -1))
+  return;
+
+ flags = grab_mcs_lock_irqsave(&frame_lock, &node);
+ *((uint64_t *) frame) = free_large_frame_list;
+ free_large_frame_list = frame;
+ release_mcs_lock_irqrestore(&frame_lock, &node, flags);
+}
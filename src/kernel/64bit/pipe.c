@@ -0,0 +1,314 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file pipe.c This file holds pipes. A pipe is a byte stream through a
+    ring buffer of one page in the kernel. Each end of a pipe is a kernel
+    object of its own, so that the pipe knows when all handles to an end
+    have been closed. Readers block while the pipe is empty and writers
+    while it is full. Reading an empty pipe whose write end is closed
+    returns zero bytes. Each end is polled for the events of its own
+    direction.
+ */
+
+#include "globals.h"
+
+/*! Size of the buffer of a pipe. */
+#define PIPE_BUFFER_SIZE 4096
+
+struct pipe_end;
+
+/*! The state shared by the two ends of a pipe. */
+struct pipe
+{
+ /*! Protects the rest of the pipe. */
+ struct ticket_lock lock;
+ /*! Frame holding the buffer. */
+ uint8_t *          buffer;
+ /*! Offset in buffer of the oldest byte. */
+ uint64_t           head;
+ /*! Number of bytes in buffer. */
+ uint64_t           length;
+ /*! The read end, zero once it is closed. */
+ struct pipe_end *  reader;
+ /*! The write end, zero once it is closed. */
+ struct pipe_end *  writer;
+ /*! Processes waiting for bytes. */
+ struct wait_queue  readers;
+ /*! Processes waiting for room. */
+ struct wait_queue  writers;
+};
+
+/*! An end of a pipe. Handles hold references to the end. */
+struct pipe_end
+{
+ struct kernel_object object;
+ struct pipe *        pipe;
+};
+
+/*! Closes an end of a pipe when the last handle to it is closed. The pipe
+    is freed with the second end. */
+static void
+destroy_pipe_end(register struct kernel_object * const object)
+{
+ register struct pipe * const pipe = ((struct pipe_end *) object)->pipe;
+ register int                 last;
+
+ grab_ticket_lock(&pipe->lock);
+ /* Waiters on the other end see the close when they run again. */
+ if (KERNEL_OBJECT_PIPE_READER == object->type)
+ {
+  pipe->reader = 0;
+  wake_up_waiters(&pipe->writers);
+  if (pipe->writer)
+   notify_watchers(&pipe->writer->object);
+ }
+ else
+ {
+  pipe->writer = 0;
+  wake_up_waiters(&pipe->readers);
+  if (pipe->reader)
+   notify_watchers(&pipe->reader->object);
+ }
+ last = !pipe->reader && !pipe->writer;
+ release_ticket_lock(&pipe->lock);
+
+ if (last)
+ {
+  release_frame((uint64_t) pipe->buffer);
+  kfree((uint64_t) pipe);
+ }
+ kfree((uint64_t) object);
+}
+
+/*! \returns The POLL_ events the read end of a pipe is ready for. The
+             state is read without the lock, a change is followed by a
+             notification. */
+static uint64_t
+poll_pipe_reader(register struct kernel_object * const object)
+{
+ register volatile struct pipe * const pipe =
+  ((struct pipe_end *) object)->pipe;
+
+ return (pipe->length || !pipe->writer) ? POLL_READABLE : 0;
+}
+
+/*! \returns The POLL_ events the write end of a pipe is ready for. */
+static uint64_t
+poll_pipe_writer(register struct kernel_object * const object)
+{
+ register volatile struct pipe * const pipe =
+  ((struct pipe_end *) object)->pipe;
+
+ return (PIPE_BUFFER_SIZE != pipe->length || !pipe->reader) ?
+        POLL_WRITABLE : 0;
+}
+
+/*! Allocates an end of a pipe.
+    \returns The end, holding one reference, or zero if there is not
+             enough memory. */
+static struct pipe_end *
+new_pipe_end(register struct pipe * const pipe,
+             register const uint64_t      type)
+{
+ register struct pipe_end * const end =
+  (struct pipe_end *) kalloc(sizeof(struct pipe_end));
+
+ if (ERROR == (long) end)
+  return 0;
+
+ initialize_object(&end->object, type, destroy_pipe_end,
+                   (KERNEL_OBJECT_PIPE_READER == type) ?
+                   poll_pipe_reader : poll_pipe_writer);
+ end->pipe = pipe;
+ return end;
+}
+
+long
+create_pipe(register const uint64_t handles)
+{
+ long                     user_handles[2];
+ register struct pipe *   pipe;
+ register struct pipe_end * reader;
+ register struct pipe_end * writer;
+ register uint64_t        buffer;
+
+ if (!is_user_range(handles, 2 * sizeof(long)))
+  return ERROR;
+
+ pipe = (struct pipe *) kalloc(sizeof(struct pipe));
+ if (ERROR == (long) pipe)
+  return ERROR;
+
+ buffer = allocate_frame();
+ if (0 == buffer)
+ {
+  kfree((uint64_t) pipe);
+  return ERROR;
+ }
+
+ pipe->lock = (struct ticket_lock) TICKET_LOCK_INITIALIZER;
+ pipe->buffer = (uint8_t *) buffer;
+ pipe->head = 0;
+ pipe->length = 0;
+ pipe->readers.waiters = 0;
+ pipe->writers.waiters = 0;
+
+ reader = new_pipe_end(pipe, KERNEL_OBJECT_PIPE_READER);
+ if (0 == reader)
+ {
+  release_frame(buffer);
+  kfree((uint64_t) pipe);
+  return ERROR;
+ }
+ pipe->reader = reader;
+
+ writer = new_pipe_end(pipe, KERNEL_OBJECT_PIPE_WRITER);
+ if (0 == writer)
+ {
+  pipe->writer = 0;
+  release_object(&reader->object);
+  return ERROR;
+ }
+ pipe->writer = writer;
+
+ user_handles[0] = install_handle(&reader->object);
+ if (ERROR == user_handles[0])
+ {
+  release_object(&reader->object);
+  release_object(&writer->object);
+  return ERROR;
+ }
+
+ user_handles[1] = install_handle(&writer->object);
+ if (ERROR == user_handles[1])
+ {
+  close_handle(user_handles[0]);
+  release_object(&writer->object);
+  return ERROR;
+ }
+
+ /* The pipe is closed again if the caller cannot learn the handles. */
+ if (ALL_OK != copy_to_user(handles, user_handles, sizeof(user_handles)))
+ {
+  close_handle(user_handles[0]);
+  close_handle(user_handles[1]);
+  return ERROR;
+ }
+
+ return ALL_OK;
+}
+
+long
+read_pipe(register const uint64_t handle,
+          register const uint64_t buffer,
+          register const uint64_t length)
+{
+ register struct pipe_end * const end = (struct pipe_end *)
+  find_handle(handle, KERNEL_OBJECT_PIPE_READER);
+ register struct pipe *           pipe;
+ register uint64_t                count;
+ register uint64_t                first;
+
+ if (0 == end || !is_user_range(buffer, length))
+  return ERROR;
+ pipe = end->pipe;
+
+ if (0 == length)
+  return 0;
+
+ grab_ticket_lock(&pipe->lock);
+ if (0 == pipe->length)
+ {
+  /* The end of the stream. */
+  if (!pipe->writer)
+  {
+   release_ticket_lock(&pipe->lock);
+   return 0;
+  }
+
+  block_process(&pipe->readers, &pipe->lock);
+  return AMD64_RESTART_SYSCALL;
+ }
+
+ /* Take as much as there is, in at most two copies as the bytes may wrap
+    around the end of the buffer. */
+ count = (length < pipe->length) ? length : pipe->length;
+ first = PIPE_BUFFER_SIZE - pipe->head;
+ if (first > count)
+  first = count;
+ /* The bytes stay in the pipe if they cannot be stored. */
+ if (ALL_OK != copy_to_user(buffer, pipe->buffer + pipe->head, first) ||
+     ALL_OK != copy_to_user(buffer + first, pipe->buffer, count - first))
+ {
+  release_ticket_lock(&pipe->lock);
+  return ERROR;
+ }
+ pipe->head = (pipe->head + count) % PIPE_BUFFER_SIZE;
+ pipe->length -= count;
+
+ wake_up_waiters(&pipe->writers);
+ if (pipe->writer)
+  notify_watchers(&pipe->writer->object);
+ release_ticket_lock(&pipe->lock);
+ return count;
+}
+
+long
+write_pipe(register const uint64_t handle,
+           register const uint64_t buffer,
+           register const uint64_t length)
+{
+ register struct pipe_end * const end = (struct pipe_end *)
+  find_handle(handle, KERNEL_OBJECT_PIPE_WRITER);
+ register struct pipe *           pipe;
+ register uint64_t                count;
+ register uint64_t                tail;
+ register uint64_t                first;
+
+ if (0 == end || !is_user_range(buffer, length))
+  return ERROR;
+ pipe = end->pipe;
+
+ if (0 == length)
+  return 0;
+
+ grab_ticket_lock(&pipe->lock);
+ /* Nobody will read the bytes. */
+ if (!pipe->reader)
+ {
+  release_ticket_lock(&pipe->lock);
+  return ERROR;
+ }
+
+ if (PIPE_BUFFER_SIZE == pipe->length)
+ {
+  block_process(&pipe->writers, &pipe->lock);
+  return AMD64_RESTART_SYSCALL;
+ }
+
+ /* Put as much as there is room for, in at most two copies. */
+ count = PIPE_BUFFER_SIZE - pipe->length;
+ if (count > length)
+  count = length;
+ tail = (pipe->head + pipe->length) % PIPE_BUFFER_SIZE;
+ first = PIPE_BUFFER_SIZE - tail;
+ if (first > count)
+  first = count;
+ /* Nothing is added if the bytes cannot be read. */
+ if (ALL_OK != copy_from_user(pipe->buffer + tail, buffer, first) ||
+     ALL_OK != copy_from_user(pipe->buffer, buffer + first, count - first))
+ {
+  release_ticket_lock(&pipe->lock);
+  return ERROR;
+ }
+ pipe->length += count;
+
+ wake_up_waiters(&pipe->readers);
+ notify_watchers(&pipe->reader->object);
+ release_ticket_lock(&pipe->lock);
+ return count;
+}
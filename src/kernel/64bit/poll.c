@@ -0,0 +1,405 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file poll.c This file holds poll sets. A poll set lets one process wait
+    for any of many objects. Each object registered in a set has an entry,
+    which is linked both in the set and in the list of watchers of the
+    object. An object notifies its watchers when its state changes and the
+    entries are queued on the ready list of their sets. Waiting on a set
+    only looks at the queued entries, so the cost does not grow with the
+    number of registered objects.
+
+    Entries stay queued while their objects are ready, so an object which
+    is still ready is reported again by the next wait. An entry whose
+    object turns out not to be ready is dropped from the queue until the
+    object notifies again.
+
+    The locks are taken in the order: the lock of the state of an object,
+    the watchers lock of the object, the lock of a set. The poll functions
+    of objects are called with the lock of the set held and read the state
+    without its lock. This is safe as a change of the state is followed by
+    a notification, which queues the entry again.
+
+    An entry holds a reference to its object, but the entries of an object
+    are dropped when the last handle to it is closed. Entries are thus
+    unlinked either by their set or by their object, and both sides take
+    the locks before looking at an entry.
+ */
+
+#include "globals.h"
+
+/*! A registration of an object in a poll set. */
+struct poll_entry
+{
+ /*! The set the object is registered in. */
+ struct poll_set *      set;
+ /*! The object. The entry holds a reference to it. */
+ struct kernel_object * object;
+ /*! The POLL_ events watched for. */
+ uint64_t               events;
+ /*! Returned with the events of the object. */
+ uint64_t               cookie;
+ /*! Non-zero while the entry is in the ready list of the set. */
+ uint64_t               queued;
+ /*! Next entry of the set. */
+ struct poll_entry *    next;
+ /*! Next entry in the ready list of the set. */
+ struct poll_entry *    next_ready;
+ /*! Next entry watching the object. */
+ struct poll_entry *    next_watcher;
+};
+
+/*! A poll set. */
+struct poll_set
+{
+ /*! Handles hold references to the set. */
+ struct kernel_object object;
+ /*! Protects the rest of the set. */
+ struct ticket_lock   lock;
+ /*! The entries of the set. */
+ struct poll_entry *  entries;
+ /*! First entry of the ready list. */
+ struct poll_entry *  ready;
+ /*! Last entry of the ready list. */
+ struct poll_entry *  last_ready;
+ /*! Number of entries in the ready list. */
+ uint64_t             number_ready;
+ /*! Processes waiting for an entry to become ready. */
+ struct wait_queue    waiters;
+};
+
+/*! Appends an entry to the ready list of its set unless it is already
+    there. Must be called with the lock of the set held. */
+static void
+queue_entry(register struct poll_entry * const entry)
+{
+ register struct poll_set * const set = entry->set;
+
+ if (entry->queued)
+  return;
+
+ entry->queued = 1;
+ entry->next_ready = 0;
+ if (set->ready)
+  set->last_ready->next_ready = entry;
+ else
+  set->ready = entry;
+ set->last_ready = entry;
+ set->number_ready++;
+}
+
+/*! Takes the first entry off the ready list of a set. Must be called with
+    the lock of the set held.
+    \returns The entry. */
+static struct poll_entry *
+dequeue_entry(register struct poll_set * const set)
+{
+ register struct poll_entry * const entry = set->ready;
+
+ set->ready = entry->next_ready;
+ set->number_ready--;
+ entry->queued = 0;
+ return entry;
+}
+
+/*! Unlinks an entry from its set, from the ready list of the set and
+    from the watchers of its object. Must be called with the watchers lock
+    of the object and the lock of the set held. */
+static void
+unlink_entry(register struct poll_entry * const entry)
+{
+ register struct poll_set * const set = entry->set;
+ register struct poll_entry **    link;
+
+ for (link = &set->entries; *link != entry; link = &(*link)->next);
+ *link = entry->next;
+ for (link = &entry->object->watchers; *link != entry;
+      link = &(*link)->next_watcher);
+ *link = entry->next_watcher;
+
+ if (entry->queued)
+ {
+  register struct poll_entry * previous = 0;
+  register struct poll_entry * ready;
+
+  for (ready = set->ready; ready != entry; ready = ready->next_ready)
+   previous = ready;
+  if (previous)
+   previous->next_ready = entry->next_ready;
+  else
+   set->ready = entry->next_ready;
+  if (set->last_ready == entry)
+   set->last_ready = previous;
+  set->number_ready--;
+ }
+}
+
+void
+notify_watchers(register struct kernel_object * const object)
+{
+ register struct poll_entry * entry;
+
+ /* Objects nobody watches need not take the lock. An entry added
+    concurrently is queued when it is added. */
+ if (0 == object->watchers)
+  return;
+
+ grab_ticket_lock(&object->watchers_lock);
+ for (entry = object->watchers; entry; entry = entry->next_watcher)
+ {
+  register struct poll_set * const set = entry->set;
+
+  grab_ticket_lock(&set->lock);
+  queue_entry(entry);
+  wake_up_waiters(&set->waiters);
+  release_ticket_lock(&set->lock);
+ }
+ release_ticket_lock(&object->watchers_lock);
+}
+
+void
+forget_watchers(register struct kernel_object * const object)
+{
+ register struct poll_entry * forgotten = 0;
+ register struct poll_entry * entry;
+
+ grab_ticket_lock(&object->watchers_lock);
+ /* A handle may have been opened again by name since the last one was
+    closed. */
+ if (0 == object->handles)
+ {
+  while (object->watchers)
+  {
+   entry = object->watchers;
+   grab_ticket_lock(&entry->set->lock);
+   unlink_entry(entry);
+   release_ticket_lock(&entry->set->lock);
+   entry->next = forgotten;
+   forgotten = entry;
+  }
+ }
+ release_ticket_lock(&object->watchers_lock);
+
+ while (forgotten)
+ {
+  entry = forgotten;
+  forgotten = entry->next;
+  kfree((uint64_t) entry);
+  release_object(object);
+ }
+}
+
+/*! Frees a poll set when the last reference to it is dropped. An entry may
+    be unlinked by its object meanwhile, so each entry is looked up again
+    with the locks held in order. The object is referenced while its
+    watchers lock is taken. */
+static void
+destroy_poll_set(register struct kernel_object * const object)
+{
+ register struct poll_set * const set = (struct poll_set *) object;
+
+ while (1)
+ {
+  register struct kernel_object * watched;
+  register struct poll_entry *    entry;
+
+  grab_ticket_lock(&set->lock);
+  entry = set->entries;
+  if (0 == entry)
+  {
+   release_ticket_lock(&set->lock);
+   break;
+  }
+  watched = entry->object;
+  reference_object(watched);
+  release_ticket_lock(&set->lock);
+
+  grab_ticket_lock(&watched->watchers_lock);
+  grab_ticket_lock(&set->lock);
+  for (entry = set->entries; entry && entry->object != watched;
+       entry = entry->next);
+  if (entry)
+   unlink_entry(entry);
+  release_ticket_lock(&set->lock);
+  release_ticket_lock(&watched->watchers_lock);
+
+  if (entry)
+  {
+   kfree((uint64_t) entry);
+   release_object(watched);
+  }
+  release_object(watched);
+ }
+
+ kfree((uint64_t) set);
+}
+
+long
+create_poll_set(void)
+{
+ register struct poll_set * const set =
+  (struct poll_set *) kalloc(sizeof(struct poll_set));
+ register long                    handle;
+
+ if (ERROR == (long) set)
+  return ERROR;
+
+ /* Poll sets cannot be polled, so sets never watch each other. */
+ initialize_object(&set->object, KERNEL_OBJECT_POLL_SET, destroy_poll_set,
+                   0);
+ set->lock = (struct ticket_lock) TICKET_LOCK_INITIALIZER;
+ set->entries = 0;
+ set->ready = 0;
+ set->last_ready = 0;
+ set->number_ready = 0;
+ set->waiters.waiters = 0;
+
+ handle = install_handle(&set->object);
+ if (ERROR == handle)
+  release_object(&set->object);
+ return handle;
+}
+
+long
+poll_control(register const uint64_t set_handle,
+             register const uint64_t handle,
+             register const uint64_t events,
+             register const uint64_t cookie)
+{
+ register struct poll_set * const      set = (struct poll_set *)
+  find_handle(set_handle, KERNEL_OBJECT_POLL_SET);
+ register struct kernel_object * const object =
+  find_handle(handle, KERNEL_OBJECT_ANY);
+ register struct poll_entry *          spare = 0;
+ register struct poll_entry *          removed = 0;
+ register struct poll_entry **         link;
+ register long                         result = ALL_OK;
+
+ if (0 == set || 0 == object || 0 == object->poll ||
+     0 != (events & ~(POLL_READABLE | POLL_WRITABLE)))
+  return ERROR;
+
+ /* The entry to add is allocated before the locks are taken. It is freed
+    if the object is already registered. */
+ if (events)
+ {
+  register const long memory = kalloc(sizeof(struct poll_entry));
+
+  if (ERROR == memory)
+   return ERROR;
+  spare = (struct poll_entry *) memory;
+ }
+
+ grab_ticket_lock(&object->watchers_lock);
+ grab_ticket_lock(&set->lock);
+
+ for (link = &set->entries; *link && (*link)->object != object;
+      link = &(*link)->next);
+
+ if (*link && events)
+ {
+  /* Change the registration. The object is checked again by the next
+     wait. */
+  register struct poll_entry * const entry = *link;
+
+  entry->events = events;
+  entry->cookie = cookie;
+  queue_entry(entry);
+  wake_up_waiters(&set->waiters);
+ }
+ else if (*link)
+ {
+  /* Remove the entry. */
+  removed = *link;
+  unlink_entry(removed);
+ }
+ else if (events)
+ {
+  register struct poll_entry * const entry = spare;
+
+  /* Add an entry. It is queued so that the next wait checks the object. */
+  spare = 0;
+  reference_object(object);
+  entry->set = set;
+  entry->object = object;
+  entry->events = events;
+  entry->cookie = cookie;
+  entry->queued = 0;
+  entry->next = set->entries;
+  set->entries = entry;
+  entry->next_watcher = object->watchers;
+  object->watchers = entry;
+  queue_entry(entry);
+  wake_up_waiters(&set->waiters);
+ }
+ else
+  result = ERROR;
+
+ release_ticket_lock(&set->lock);
+ release_ticket_lock(&object->watchers_lock);
+
+ if (spare)
+  kfree((uint64_t) spare);
+ if (removed)
+ {
+  kfree((uint64_t) removed);
+  release_object(object);
+ }
+ return result;
+}
+
+long
+poll_wait(register const uint64_t set_handle,
+          register const uint64_t events,
+          register const uint64_t number_of_events)
+{
+ register struct poll_set * const  set = (struct poll_set *)
+  find_handle(set_handle, KERNEL_OBJECT_POLL_SET);
+ struct poll_event                 event;
+ register uint64_t                 count = 0;
+ register uint64_t                 left;
+
+ if (0 == set || 0 == number_of_events ||
+     number_of_events > USER_SPACE_END / sizeof(struct poll_event) ||
+     !is_user_range(events, number_of_events * sizeof(struct poll_event)))
+  return ERROR;
+
+ grab_ticket_lock(&set->lock);
+
+ /* Each queued entry is looked at once. Ready entries go back to the end
+    of the list, so entries beyond number_of_events get their turn in the
+    next wait. */
+ for (left = set->number_ready; left > 0 && count < number_of_events; left--)
+ {
+  register struct poll_entry * const entry = dequeue_entry(set);
+  register const uint64_t            ready =
+   entry->object->poll(entry->object) & entry->events;
+
+  if (ready)
+  {
+   queue_entry(entry);
+   event.cookie = entry->cookie;
+   event.events = ready;
+   if (ALL_OK != copy_to_user(events + count * sizeof(struct poll_event),
+                              &event, sizeof(struct poll_event)))
+   {
+    release_ticket_lock(&set->lock);
+    return ERROR;
+   }
+   count++;
+  }
+ }
+
+ if (0 == count)
+ {
+  block_process(&set->waiters, &set->lock);
+  return AMD64_RESTART_SYSCALL;
+ }
+
+ release_ticket_lock(&set->lock);
+ return count;
+}
@@ -0,0 +1,143 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file process_pool.c This file holds the pools of process shells. A
+    shell is a process which has been built from an executable image and
+    given a process id but not yet adopted by a parent or handed to a
+    processor. Each image has a pool of shells. Creating a process takes a shell from the pool, which
+    moves the cost of building it off the critical path. Idle processors
+    refill the pools.
+ */
+
+#include "globals.h"
+
+uint64_t
+amd64_process_pool_size = AMD64_DEFAULT_PROCESS_POOL_SIZE;
+
+/*! The shells built from one executable image. */
+struct process_pool
+{
+ /*! Protects the pool. */
+ struct ticket_lock             lock;
+ /*! Number of shells in the pool or being built for it. */
+ uint64_t                       number_of_shells;
+ /*! List of ready shells linked through next. */
+ struct process_queue_element * shells;
+} __attribute__((aligned (AMD64_CACHE_LINE_SIZE)));
+
+/*! Set when a shell could not be built. The pools are not refilled until
+    a process has been freed, otherwise the idle processors would retry
+    the build on every pass. */
+static volatile int process_pools_stalled;
+
+/*! The pools, indexed as ELF_images. */
+static struct process_pool * process_pools;
+
+void
+initialize_process_pools(void)
+{
+ register const long memory =
+  kalloc((amd64_number_of_images + 1) * sizeof(struct process_pool));
+ register uint64_t i;
+
+ if (ERROR == memory)
+ {
+  while (1)
+   kprints("Kernel panic! Too little memory for the process pools.\n");
+ }
+
+ /* Keep each pool on cache lines of its own. */
+ process_pools = (struct process_pool *)
+  ((memory + AMD64_CACHE_LINE_SIZE - 1) & ~(AMD64_CACHE_LINE_SIZE - 1));
+ for (i = 0; i < amd64_number_of_images; i++)
+ {
+  process_pools[i].lock = (struct ticket_lock) TICKET_LOCK_INITIALIZER;
+  process_pools[i].number_of_shells = 0;
+  process_pools[i].shells = 0;
+ }
+}
+
+struct process_queue_element *
+take_process_shell(register const uint64_t image_index)
+{
+ register struct process_pool *          pool;
+ register struct process_queue_element * shell;
+
+ if (image_index >= amd64_number_of_images)
+  return 0;
+
+ pool = &process_pools[image_index];
+ grab_ticket_lock(&pool->lock);
+ shell = pool->shells;
+ if (shell)
+ {
+  pool->shells = shell->next;
+  pool->number_of_shells--;
+ }
+ release_ticket_lock(&pool->lock);
+
+ return shell;
+}
+
+int
+refill_process_pools(void)
+{
+ register uint64_t image_index;
+
+ if (process_pools_stalled)
+  return 0;
+
+ for (image_index = 0;
+      image_index < amd64_number_of_images;
+      image_index++)
+ {
+  register struct process_pool * const pool = &process_pools[image_index];
+  register struct process_queue_element * shell;
+  register int                            reserved = 0;
+
+  /* Reserve a place in the pool so that other idle processors do not
+     overfill it while the shell is built. */
+  grab_ticket_lock(&pool->lock);
+  if (pool->number_of_shells < amd64_process_pool_size)
+  {
+   pool->number_of_shells++;
+   reserved = 1;
+  }
+  release_ticket_lock(&pool->lock);
+
+  if (!reserved)
+   continue;
+
+  shell = kbuildprocess(image_index);
+
+  grab_ticket_lock(&pool->lock);
+  if (shell)
+  {
+   shell->next = pool->shells;
+   pool->shells = shell;
+  }
+  else
+   pool->number_of_shells--;
+  release_ticket_lock(&pool->lock);
+
+  /* Build one shell at a time so that the caller can check for work. A
+     failed build means memory is short, stop refilling then. */
+  if (0 == shell)
+   process_pools_stalled = 1;
+  return 0 != shell;
+ }
+
+ return 0;
+}
+
+void
+resume_process_pools(void)
+{
+ /* Only write the flag when it is set to keep the line shared. */
+ if (process_pools_stalled)
+  process_pools_stalled = 0;
+}
@@ -1,40 +1,35 @@
 #include "globals.h"
 
-struct process_queue_element *  top_process=0;
-struct process_queue_element * back_process=0;
+/* Each processor owns a run queue. Only the owner links and unlinks
+   elements, other processors hand processes over through the wakeup list
+   of the owner. Hence the queues need no locks. */
+DEFINE_PER_CPU(struct run_queue, run_queue);
 
 
 
 uint64_t is_empty_process_queue()
 {
-	return (top_process == (struct process_queue_element *) 0 );
+	return (this_cpu_ptr(&run_queue)->top == (struct process_queue_element *) 0 );
 }
 
-void push_back_process_queue(struct process_entry process)
+/*! Links an element to the back of the run queue of the calling processor. */
+static void link_back_process_queue(struct process_queue_element * const new_process)
 {
-	/* Allocate space for element. */
-	struct process_queue_element * new_process =
-   (struct process_queue_element * ) kalloc(sizeof( struct process_queue_element)) ;
-	if(new_process==(struct process_queue_element * )ERROR)
-	{
-		while(1) kprints("push_queue_process couldn't claim memory for new process!");
-	}
+	struct run_queue * const queue = this_cpu_ptr(&run_queue);
 
-	new_process->element=process;
+	new_process->next=0;
 
 	/* If queue is empty, we need to initialize both top and last element pointers. */
 	if(is_empty_process_queue())
 	{
-		back_process = new_process;
-		top_process  = new_process;
-		return;
+		queue->back = new_process;
+		rcu_assign_pointer(queue->top, new_process);
 	}
 	else
 	{
-		back_process->next=new_process;
-		back_process 	  =new_process;
+		rcu_assign_pointer(queue->back->next, new_process);
+		queue->back = new_process;
 	}
-
 }
 
 struct process_entry top_process_queue()
@@ -46,13 +41,13 @@ struct process_entry top_process_queue()
 			kprints("kernel panic: process queue corrupted!");
 		}
 	}
-	return top_process->element;
+	return this_cpu_ptr(&run_queue)->top->element;
 }
-struct process_entry pop_process_queue()
+
+struct process_queue_element * unlink_top_process_queue()
 {
-	struct process_entry temp;
-	struct process_queue_element * deleted;
-	temp.context=(struct AMD64Context*) 0;
+	struct run_queue * const queue = this_cpu_ptr(&run_queue);
+	struct process_queue_element * unlinked;
 	/* Stack shouldn't be empty */
 	if(is_empty_process_queue()){
 		while(1)
@@ -60,17 +55,104 @@ struct process_entry pop_process_queue()
 			kprints("kernel panic: process queue corrupted!");
 		}
 	}
-	deleted=top_process;
-	temp=top_process->element;
+	unlinked=queue->top;
 	/* If there is a single element, we need to set both top and last element pointers to zero. */
-	if(top_process==back_process){
-		top_process =(struct process_queue_element *)0;
-		back_process=(struct process_queue_element *)0;
+	if(queue->top==queue->back){
+		rcu_assign_pointer(queue->top, (struct process_queue_element *)0);
+		queue->back=(struct process_queue_element *)0;
 	}
 	else{
-		top_process = top_process->next;
+		rcu_assign_pointer(queue->top, queue->top->next);
+	}
+	lock_xadd64(&queue->nr_running, -1);
+	return unlinked;
+}
+
+void rotate_process_queue()
+{
+	struct run_queue * const queue = this_cpu_ptr(&run_queue);
+	struct process_queue_element * rotated;
+
+	if(queue->top==queue->back)
+		return;
+
+	rotated=queue->top;
+	rcu_assign_pointer(queue->top, rotated->next);
+	/* Readers that still see the old top follow its next pointer to the
+	   end of the queue. */
+	rotated->next=0;
+	rcu_assign_pointer(queue->back->next, rotated);
+	queue->back=rotated;
+}
+
+void wake_up_process(struct process_queue_element * const process,
+                     const uint64_t processor_index)
+{
+	struct run_queue * const queue = per_cpu_ptr(&run_queue, processor_index);
+	uint64_t head;
+
+	lock_xadd64(&queue->nr_running, 1);
+
+	/* Push onto the wakeup list. Producers only ever push and the owner
+	   takes the whole list at once, so there is no ABA problem. */
+	do
+	{
+		head = queue->wakeup_list;
+		process->next = (struct process_queue_element *) head;
+	} while(head != lock_cmpxchg64(&queue->wakeup_list, head, (uint64_t) process));
+
+	/* The owner drains the whole list, so only the push that finds it
+	   empty needs to interrupt the owner. */
+	if(0 == head && processor_index != get_processor_index())
+		send_IPI(processor_index, RESCHEDULE_IPI_VECTOR);
+}
+
+void drain_wakeup_list()
+{
+	struct run_queue * const queue = this_cpu_ptr(&run_queue);
+	struct process_queue_element * list, * reversed = 0;
+
+	if(0 == queue->wakeup_list)
+		return;
+
+	list = (struct process_queue_element *) lock_xchg64(&queue->wakeup_list, 0);
+
+	/* The list is in LIFO order. Reverse it so processes are queued in the
+	   order they were woken up. */
+	while(list)
+	{
+		struct process_queue_element * const next = list->next;
+
+		list->next = reversed;
+		reversed = list;
+		list = next;
+	}
+
+	while(reversed)
+	{
+		struct process_queue_element * const next = reversed->next;
+
+		link_back_process_queue(reversed);
+		reversed = next;
+	}
+}
+
+uint64_t select_processor()
+{
+	uint64_t processor_index, selected = get_processor_index();
+	uint64_t lowest = per_cpu_ptr(&run_queue, selected)->nr_running;
+
+	for(processor_index = 0;
+	    processor_index < amd64_number_of_available_CPUs;
+	    processor_index++)
+	{
+		const uint64_t load = per_cpu_ptr(&run_queue, processor_index)->nr_running;
+
+		if(load < lowest)
+		{
+			lowest = load;
+			selected = processor_index;
+		}
 	}
-	/* Reclaim memory. */
-	kfree((uint64_t)deleted);
-	return temp;
+	return selected;
 }
@@ -0,0 +1,74 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file process_table.c This file holds the process table. Each process
+    has an entry in a statically allocated table. The low
+    AMD64_PROCESS_TABLE_BITS bits of a process id index the table and the
+    remaining bits hold a generation count which is increased each time the
+    entry is freed. A process id is therefore never reused while a stale
+    copy of it can be around.
+ */
+
+#include "globals.h"
+
+/*! The process table. */
+static struct process_queue_element
+process_table[AMD64_MAX_NUMBER_OF_PROCESSES];
+
+/*! Number of times each entry of the process table has been freed. It is
+    kept out of the entries so that they stay compact. Only the owner of an
+    entry touches its generation. */
+static uint32_t generations[AMD64_MAX_NUMBER_OF_PROCESSES];
+
+/*! Protects free_processes and next_unused_process. */
+static struct ticket_lock process_table_lock = TICKET_LOCK_INITIALIZER;
+
+/*! List of free entries linked through next. */
+static struct process_queue_element * free_processes;
+
+/*! Entries from this index up have never been allocated. */
+static uint64_t next_unused_process;
+
+struct process_queue_element *
+allocate_process(void)
+{
+ register struct process_queue_element * process = 0;
+ register uint64_t                       index;
+
+ grab_ticket_lock(&process_table_lock);
+ if (free_processes)
+ {
+  process = free_processes;
+  free_processes = process->next;
+ }
+ else if (next_unused_process < AMD64_MAX_NUMBER_OF_PROCESSES)
+  process = &process_table[next_unused_process++];
+ release_ticket_lock(&process_table_lock);
+
+ if (0 == process)
+  return 0;
+
+ /* The generation is offset by one so that no process gets id zero. */
+ index = process - process_table;
+ process->element.pid = (((uint64_t) generations[index]) + 1) <<
+                        AMD64_PROCESS_TABLE_BITS | index;
+ process->element.context = &process->saved_context;
+ process->next = 0;
+ return process;
+}
+
+void
+free_process(register struct process_queue_element * const process)
+{
+ generations[process - process_table]++;
+ process->element.pid = 0;
+
+ grab_ticket_lock(&process_table_lock);
+ process->next = free_processes;
+ free_processes = process;
+ release_ticket_lock(&process_table_lock);
+}
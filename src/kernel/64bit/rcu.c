@@ -0,0 +1,135 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file rcu.c This file holds the implementation of quiescent state based
+    read-copy-update. Kernel code runs with interrupts disabled, so a
+    processor that takes a timer interrupt is not inside any read-side
+    critical section. Each timer tick is therefore a quiescent state. A
+    grace period has elapsed when every processor has passed a quiescent
+    state after the grace period started. Callbacks queued with call_rcu
+    run after the grace period following the call has elapsed.
+ */
+
+#include "globals.h"
+
+/*! Number of the latest grace period started. */
+static volatile uint64_t rcu_gp_started;
+
+/*! Number of the latest grace period completed. A grace period is in
+    progress if it differs from rcu_gp_started. */
+static volatile uint64_t rcu_gp_completed;
+
+/*! RCU state of each processor. */
+struct rcu_data
+{
+ /*! The latest grace period this processor has passed a quiescent state
+     in. */
+ volatile uint64_t quiescent_gp;
+ /*! Callbacks queued since the callbacks in wait_list were queued. */
+ struct rcu_head * next_list;
+ /*! The last callback in next_list. */
+ struct rcu_head * next_tail;
+ /*! Callbacks waiting for grace period wait_gp to complete. */
+ struct rcu_head * wait_list;
+ /*! The grace period wait_list is waiting for. */
+ uint64_t          wait_gp;
+};
+
+static DEFINE_PER_CPU(struct rcu_data, rcu_data);
+
+void
+call_rcu(register struct rcu_head * const head,
+         void (* const func)(struct rcu_head *))
+{
+ register struct rcu_data * const rdp = this_cpu_ptr(&rcu_data);
+ register const uint64_t flags = save_flags_and_cli();
+
+ head->next = 0;
+ head->func = func;
+
+ if (rdp->next_tail)
+  rdp->next_tail->next = head;
+ else
+  rdp->next_list = head;
+ rdp->next_tail = head;
+
+ restore_flags(flags);
+}
+
+/*! Starts grace period number gp unless it has already been started. */
+static void
+rcu_start_gp(register const uint64_t gp)
+{
+ register const uint64_t started = rcu_gp_started;
+
+ /* Only one grace period is in progress at a time. */
+ if (started < gp && started == rcu_gp_completed)
+  lock_cmpxchg64(&rcu_gp_started, started, gp);
+}
+
+/*! Completes the current grace period if all processors have passed a
+    quiescent state in it. */
+static void
+rcu_check_gp(void)
+{
+ register const uint64_t started = rcu_gp_started;
+ register uint64_t       processor_index;
+
+ if (started == rcu_gp_completed)
+  return;
+
+ for (processor_index = 0;
+      processor_index < amd64_number_of_available_CPUs;
+      processor_index++)
+ {
+  if (per_cpu_ptr(&rcu_data, processor_index)->quiescent_gp < started)
+   return;
+ }
+
+ lock_cmpxchg64(&rcu_gp_completed, started-1, started);
+}
+
+void
+rcu_note_quiescent_state(void)
+{
+ register struct rcu_data * const rdp = this_cpu_ptr(&rcu_data);
+
+ /* This processor is not in a read-side critical section now, which
+    satisfies every grace period started so far. */
+ rdp->quiescent_gp = rcu_gp_started;
+
+ rcu_check_gp();
+
+ /* Invoke the callbacks whose grace period has elapsed. */
+ if (rdp->wait_list && rcu_gp_completed >= rdp->wait_gp)
+ {
+  register struct rcu_head * head = rdp->wait_list;
+
+  rdp->wait_list = 0;
+  while (head)
+  {
+   register struct rcu_head * const next = head->next;
+
+   head->func(head);
+   head = next;
+  }
+ }
+
+ /* Let new callbacks wait for the next grace period. A grace period in
+    progress may have started before they were queued, so they must wait
+    for the one after it. */
+ if (0 == rdp->wait_list && rdp->next_list)
+ {
+  rdp->wait_list = rdp->next_list;
+  rdp->wait_gp = rcu_gp_started + 1;
+  rdp->next_list = 0;
+  rdp->next_tail = 0;
+ }
+
+ if (rdp->wait_list)
+  rcu_start_gp(rdp->wait_gp);
+}
@@ -3,17 +3,26 @@
 /*! Round robin scheduling algorithm */
 void scheduler()
 {
+	struct run_queue * const queue = this_cpu_ptr(&run_queue);
 	struct AMD64Context * active_context;
+
+	drain_wakeup_list(); /* Pick up processes woken up by other processors. */
 	if(is_empty_process_queue()) /* If queue is empty, do nothing. */
 	{
 		return;
 	}
 	else
 	{
-		if(top_process!=back_process){/* If correct, there are waiting processes. We need to switch context. */
-			push_back_process_queue(pop_process_queue()); /* Remove first, push it back */
-			back_process->element.state=READY;  /* Set bottom element's state as READY. */
-			top_process->element.state=RUNNING; /* Set first  element's state as RUNNING. */
+		if(getActiveContext()==(struct AMD64Context *) 0)
+		{
+			/* The processor was idle. Start executing the top-most process. */
+			queue->top->element.state=RUNNING;
+			setActiveContext(top_process_queue().context);
+		}
+		else if(queue->top!=queue->back){/* If correct, there are waiting processes. We need to switch context. */
+			rotate_process_queue(); /* Move first to the back */
+			queue->back->element.state=READY;  /* Set bottom element's state as READY. */
+			queue->top->element.state=RUNNING; /* Set first  element's state as RUNNING. */
 			active_context=top_process_queue().context;
 			setActiveContext(active_context); /* Context switch. */
 		}
@@ -0,0 +1,102 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file semaphore.c This file holds counting semaphores. Processes reach
+    a semaphore through handles, so it is shared with the children of the
+    process which created it. A semaphore is readable in a poll set while
+    its count is not zero.
+ */
+
+#include "globals.h"
+
+/*! A semaphore. */
+struct semaphore
+{
+ /*! Handles hold references to the semaphore. */
+ struct kernel_object object;
+ /*! Protects the rest of the semaphore. */
+ struct ticket_lock   lock;
+ /*! The count. */
+ uint64_t             count;
+ /*! Processes waiting for the count to become non-zero. */
+ struct wait_queue    waiters;
+};
+
+/*! Frees a semaphore when the last reference to it is dropped. */
+static void
+destroy_semaphore(register struct kernel_object * const object)
+{
+ kfree((uint64_t) object);
+}
+
+/*! \returns The POLL_ events a semaphore is ready for. */
+static uint64_t
+poll_semaphore(register struct kernel_object * const object)
+{
+ return ((volatile struct semaphore *) object)->count ? POLL_READABLE : 0;
+}
+
+long
+create_semaphore(register const uint64_t count)
+{
+ register struct semaphore * const semaphore =
+  (struct semaphore *) kalloc(sizeof(struct semaphore));
+ register long                     handle;
+
+ if (ERROR == (long) semaphore)
+  return ERROR;
+
+ initialize_object(&semaphore->object, KERNEL_OBJECT_SEMAPHORE,
+                   destroy_semaphore, poll_semaphore);
+ semaphore->lock = (struct ticket_lock) TICKET_LOCK_INITIALIZER;
+ semaphore->count = count;
+ semaphore->waiters.waiters = 0;
+
+ handle = install_handle(&semaphore->object);
+ if (ERROR == handle)
+  release_object(&semaphore->object);
+ return handle;
+}
+
+long
+semaphore_down(register const uint64_t handle)
+{
+ register struct semaphore * const semaphore = (struct semaphore *)
+  find_handle(handle, KERNEL_OBJECT_SEMAPHORE);
+
+ if (0 == semaphore)
+  return ERROR;
+
+ grab_ticket_lock(&semaphore->lock);
+ if (0 == semaphore->count)
+ {
+  block_process(&semaphore->waiters, &semaphore->lock);
+  return AMD64_RESTART_SYSCALL;
+ }
+
+ semaphore->count--;
+ release_ticket_lock(&semaphore->lock);
+ return ALL_OK;
+}
+
+long
+semaphore_up(register const uint64_t handle)
+{
+ register struct semaphore * const semaphore = (struct semaphore *)
+  find_handle(handle, KERNEL_OBJECT_SEMAPHORE);
+
+ if (0 == semaphore)
+  return ERROR;
+
+ grab_ticket_lock(&semaphore->lock);
+ semaphore->count++;
+ /* All waiters retry, those that lose the race block again. */
+ wake_up_waiters(&semaphore->waiters);
+ notify_watchers(&semaphore->object);
+ release_ticket_lock(&semaphore->lock);
+ return ALL_OK;
+}
@@ -0,0 +1,338 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file shared_memory.c This file holds shared memory objects. An object
+    is a set of frames which processes map through a handle, so that they
+    exchange data without copies through the kernel. An object created with
+    a non-zero key is named and creating an object with the key of an
+    existing one opens that object instead. Each mapping gets a window of
+    its own above USER_SHARED_MEMORY_BASE.
+
+    Processes sharing an object synchronize without system calls as long
+    as they need not wait. A process which must wait for a word of the
+    object to change blocks on the wait queue of the object until another
+    process wakes it. Single-producer single-consumer rings are laid out in
+    objects this way.
+ */
+
+#include "globals.h"
+
+/*! A shared memory object. */
+struct shared_memory
+{
+ /*! Handles and mappings hold references to the object. */
+ struct kernel_object object;
+ /*! Number of entries in frames. */
+ uint64_t             number_of_frames;
+ /*! The frames of the object. The object holds a reference to each. */
+ uint64_t *           frames;
+ /*! Protects waiters. */
+ struct ticket_lock   lock;
+ /*! Processes waiting for a word of the object to change. */
+ struct wait_queue    waiters;
+};
+
+/*! Frees an object when the last reference to it is dropped. */
+static void
+destroy_shared_memory(register struct kernel_object * const object)
+{
+ register struct shared_memory * const memory =
+  (struct shared_memory *) object;
+ register uint64_t                     i;
+
+ for (i = 0; i < memory->number_of_frames; i++)
+  release_frame(memory->frames[i]);
+ kfree((uint64_t) memory->frames);
+ kfree((uint64_t) memory);
+}
+
+/*! Allocates an object with cleared frames.
+    \returns The object, holding one reference, or zero if there is not
+             enough memory. */
+static struct shared_memory *
+new_shared_memory(register const uint64_t number_of_frames)
+{
+ register struct shared_memory * memory;
+ register long                   frames;
+ register uint64_t               i;
+
+ memory = (struct shared_memory *) kalloc(sizeof(struct shared_memory));
+ if (ERROR == (long) memory)
+  return 0;
+
+ frames = kalloc(number_of_frames * sizeof(uint64_t));
+ if (ERROR == frames)
+ {
+  kfree((uint64_t) memory);
+  return 0;
+ }
+
+ initialize_object(&memory->object, KERNEL_OBJECT_SHARED_MEMORY,
+                   destroy_shared_memory, 0);
+ memory->number_of_frames = 0;
+ memory->frames = (uint64_t *) frames;
+ memory->lock = (struct ticket_lock) TICKET_LOCK_INITIALIZER;
+ memory->waiters.waiters = 0;
+
+ for (i = 0; i < number_of_frames; i++)
+ {
+  register const uint64_t frame = allocate_frame();
+
+  if (0 == frame)
+  {
+   destroy_shared_memory(&memory->object);
+   return 0;
+  }
+  clear_frame(frame);
+  memory->frames[memory->number_of_frames++] = frame;
+ }
+
+ return memory;
+}
+
+/*! Creates a shared memory object or opens the named one with the same key
+    and installs a handle to it in the calling process. A new object for a
+    ring gets its header before other processes can open it.
+    \returns The handle or ERROR. */
+static long
+open_shared_memory(register const uint64_t key,
+                   register const uint64_t size,
+                   register const uint64_t ring_capacity
+                   /*!< Number of slots of the ring, zero if the object is
+                        not a ring. */)
+{
+ register const uint64_t         number_of_frames = (size + 0xfff) >> 12;
+ register struct shared_memory * memory = 0;
+ register long                   handle;
+
+ if (0 == size || size > USER_SHARED_MEMORY_WINDOW)
+  return ERROR;
+
+ if (key)
+  memory = (struct shared_memory *)
+   find_named_object(KERNEL_OBJECT_SHARED_MEMORY, key);
+
+ if (0 == memory)
+ {
+  memory = new_shared_memory(number_of_frames);
+  if (0 == memory)
+   return ERROR;
+
+  /* The frames are cleared, the ring is empty. */
+  if (ring_capacity)
+   ((struct spsc_ring *) memory->frames[0])->capacity = ring_capacity;
+
+  if (key)
+  {
+   register struct shared_memory * const named = (struct shared_memory *)
+    name_object(&memory->object, key);
+
+   /* Another process created the object while the frames were
+      allocated. */
+   if (named != memory)
+   {
+    release_object(&memory->object);
+    memory = named;
+   }
+  }
+ }
+
+ /* An existing object must be large enough. */
+ if (number_of_frames > memory->number_of_frames)
+ {
+  release_object(&memory->object);
+  return ERROR;
+ }
+
+ handle = install_handle(&memory->object);
+ if (ERROR == handle)
+  release_object(&memory->object);
+ return handle;
+}
+
+long
+create_shared_memory(register const uint64_t key,
+                     register const uint64_t size)
+{
+ return open_shared_memory(key, size, 0);
+}
+
+long
+create_ring(register const uint64_t key,
+            register const uint64_t capacity)
+{
+ /* The slots are indexed by masking. */
+ if (0 == capacity || 0 != (capacity & (capacity - 1)) ||
+     capacity > (USER_SHARED_MEMORY_WINDOW - sizeof(struct spsc_ring)) /
+                sizeof(unsigned long))
+  return ERROR;
+
+ return open_shared_memory(key,
+                           sizeof(struct spsc_ring) +
+                           capacity * sizeof(unsigned long),
+                           capacity);
+}
+
+/*! Finds the shared memory object mapped at an address of the calling
+    process.
+    \returns The object or zero if the address is not an aligned word of
+             a mapped object. */
+static struct shared_memory *
+find_mapped_word(register const uint64_t address)
+{
+ register struct address_space * const address_space =
+  this_cpu_ptr(&run_queue)->top->element.address_space;
+ register const uint64_t               window =
+  (address - USER_SHARED_MEMORY_BASE) / USER_SHARED_MEMORY_WINDOW;
+ register struct shared_memory *       memory;
+
+ if (address < USER_SHARED_MEMORY_BASE ||
+     window >= AMD64_MAX_NUMBER_OF_SHARED_MAPPINGS ||
+     0 != (address & 7))
+  return 0;
+
+ memory = address_space->shared_mappings[window];
+ if (0 == memory ||
+     address - USER_SHARED_MEMORY_BASE - window * USER_SHARED_MEMORY_WINDOW >=
+     memory->number_of_frames << 12)
+  return 0;
+ return memory;
+}
+
+long
+wait_shared_word(register const uint64_t address,
+                 register const uint64_t value)
+{
+ register struct shared_memory * const memory = find_mapped_word(address);
+
+ if (0 == memory)
+  return ERROR;
+
+ /* A process changing the word wakes the waiters after the change, so the
+    change is seen either here or by the waker. */
+ grab_ticket_lock(&memory->lock);
+ if (value != *((volatile uint64_t *) address))
+ {
+  release_ticket_lock(&memory->lock);
+  return ALL_OK;
+ }
+
+ block_process(&memory->waiters, &memory->lock);
+ return AMD64_RESTART_SYSCALL;
+}
+
+long
+wake_shared_word(register const uint64_t address)
+{
+ register struct shared_memory * const memory = find_mapped_word(address);
+
+ if (0 == memory)
+  return ERROR;
+
+ grab_ticket_lock(&memory->lock);
+ wake_up_waiters(&memory->waiters);
+ release_ticket_lock(&memory->lock);
+ return ALL_OK;
+}
+
+long
+map_shared_memory(register const uint64_t handle)
+{
+ register struct shared_memory * const memory = (struct shared_memory *)
+  find_handle(handle, KERNEL_OBJECT_SHARED_MEMORY);
+ register struct address_space * const address_space =
+  this_cpu_ptr(&run_queue)->top->element.address_space;
+ register uint64_t                     window;
+ register uint64_t                     start;
+ register uint64_t                     i;
+
+ if (0 == memory)
+  return ERROR;
+
+ for (window = 0;
+      window < AMD64_MAX_NUMBER_OF_SHARED_MAPPINGS &&
+      address_space->shared_mappings[window];
+      window++);
+ if (AMD64_MAX_NUMBER_OF_SHARED_MAPPINGS == window)
+  return ERROR;
+
+ start = USER_SHARED_MEMORY_BASE + window * USER_SHARED_MEMORY_WINDOW;
+ for (i = 0; i < memory->number_of_frames; i++)
+ {
+  register const uint64_t frame = memory->frames[i];
+
+  reference_frame(frame);
+  if (ALL_OK != map_user_page(address_space, start + (i << 12), frame,
+                              PAGE_WRITABLE | PAGE_NO_EXECUTE | PAGE_SHARED))
+  {
+   release_frame(frame);
+   unmap_user_pages(address_space, start, start + (i << 12));
+   return ERROR;
+  }
+ }
+
+ reference_object(&memory->object);
+ address_space->shared_mappings[window] = memory;
+ return start;
+}
+
+long
+unmap_shared_memory(register const uint64_t address)
+{
+ register struct address_space * const address_space =
+  this_cpu_ptr(&run_queue)->top->element.address_space;
+ register const uint64_t               window =
+  (address - USER_SHARED_MEMORY_BASE) / USER_SHARED_MEMORY_WINDOW;
+ register struct shared_memory *       memory;
+
+ if (address < USER_SHARED_MEMORY_BASE ||
+     window >= AMD64_MAX_NUMBER_OF_SHARED_MAPPINGS ||
+     address != USER_SHARED_MEMORY_BASE + window * USER_SHARED_MEMORY_WINDOW)
+  return ERROR;
+
+ memory = address_space->shared_mappings[window];
+ if (0 == memory)
+  return ERROR;
+
+ unmap_user_pages(address_space, address,
+                  address + (memory->number_of_frames << 12));
+ address_space->shared_mappings[window] = 0;
+ release_object(&memory->object);
+ return ALL_OK;
+}
+
+void
+copy_shared_mappings(register const struct address_space * const address_space,
+                     register struct address_space * const       copy)
+{
+ register int window;
+
+ for (window = 0; window < AMD64_MAX_NUMBER_OF_SHARED_MAPPINGS; window++)
+ {
+  copy->shared_mappings[window] = address_space->shared_mappings[window];
+  if (copy->shared_mappings[window])
+   reference_object(&copy->shared_mappings[window]->object);
+ }
+}
+
+void
+release_shared_mappings(register struct address_space * const address_space)
+{
+ register int window;
+
+ for (window = 0; window < AMD64_MAX_NUMBER_OF_SHARED_MAPPINGS; window++)
+ {
+  register struct shared_memory * const memory =
+   address_space->shared_mappings[window];
+
+  if (memory)
+  {
+   address_space->shared_mappings[window] = 0;
+   release_object(&memory->object);
+  }
+ }
+}
@@ -72,6 +72,7 @@ protected_mode_entry:
  # First enable 64-bit page table entries by setting the PAE bit
  movl    %cr4,%ecx
  bts     $5,%ecx   # Enable 64-bit page table entries
+ bts     $7,%ecx   # Enable global pages
  bts     $9,%ecx   # Enable 128-bit floating point instructions
  movl    %ecx,%cr4
 
@@ -48,14 +48,31 @@ amd64_io_apic_address;
 volatile uint32_t *
 amd64_local_APIC_base_address;
 
+uint32_t
+amd64_x2APIC_mode;
+
 struct AMD64KernelGSData
-amd64_CPU_private_table[16];
+amd64_CPU_private_table[AMD64_MAX_NUMBER_OF_CPUS];
+
+/*! Expands a macro before turning it into a string. */
+#define EXPAND_TO_STRING(macro) TO_STRING(macro)
+#define TO_STRING(text) #text
 
-/*!< This pointers are used during calculation of addresses in kmalloc and kfree
- * functions. */
+/* The link script lays out the per-CPU areas. It gets the cache line size
+   and the number of processors from these absolute symbols so that they
+   follow the definitions in globals.h. */
+__asm(".globl amd64_link_cache_line_size\n"
+      ".set amd64_link_cache_line_size, "
+      EXPAND_TO_STRING(AMD64_CACHE_LINE_SIZE) "\n"
+      ".globl amd64_link_max_number_of_cpus\n"
+      ".set amd64_link_max_number_of_cpus, "
+      EXPAND_TO_STRING(AMD64_MAX_NUMBER_OF_CPUS) "\n");
 
-blockPtr base=0;//used in free and alloc
-blockPtr last;
+struct heap
+kernel_heap;
+
+/*! Protects the kalloc heap. */
+static struct mcs_lock heap_lock = MCS_LOCK_INITIALIZER;
 
 uint64_t
 amd64_number_of_available_CPUs;
@@ -80,19 +97,33 @@ amd64_start_application_processor_end[1];
 void
 initialize_APIC(void)
 {
+ /* Switch the APIC into x2APIC mode if the bootstrap processor decided to
+    use it. All processors have to use the same mode. */
+ if (amd64_x2APIC_mode)
+  wrmsr(IA32_APIC_BASE_MSR, rdmsr(IA32_APIC_BASE_MSR) | 0xc00);
+
  /* Make sure the APIC is enabled. */
- *(amd64_local_APIC_base_address + 0xf0/sizeof(unsigned int)) |= 0x100;
+ write_APIC_register(APIC_SPURIOUS_VECTOR_REGISTER,
+                     read_APIC_register(APIC_SPURIOUS_VECTOR_REGISTER) |
+                     0x100);
 
  /* Set task priority. */
- *(amd64_local_APIC_base_address + 0x80/sizeof(unsigned int)) = 0;
+ write_APIC_register(APIC_TASK_PRIORITY_REGISTER, 0);
 
  /* Mask all local sources. */
- *(amd64_local_APIC_base_address + 0x320/sizeof(unsigned int)) |= 0x10000;
- *(amd64_local_APIC_base_address + 0x330/sizeof(unsigned int)) |= 0x10000;
- *(amd64_local_APIC_base_address + 0x340/sizeof(unsigned int)) |= 0x10000;
- *(amd64_local_APIC_base_address + 0x350/sizeof(unsigned int)) |= 0x10000;
- *(amd64_local_APIC_base_address + 0x360/sizeof(unsigned int)) |= 0x10000;
- *(amd64_local_APIC_base_address + 0x370/sizeof(unsigned int)) |= 0x10000;
+ write_APIC_register(APIC_LVT_TIMER_REGISTER,
+                     read_APIC_register(APIC_LVT_TIMER_REGISTER) | 0x10000);
+ write_APIC_register(APIC_LVT_THERMAL_REGISTER,
+                     read_APIC_register(APIC_LVT_THERMAL_REGISTER) | 0x10000);
+ write_APIC_register(APIC_LVT_PERFORMANCE_REGISTER,
+                     read_APIC_register(APIC_LVT_PERFORMANCE_REGISTER) |
+                     0x10000);
+ write_APIC_register(APIC_LVT_LINT0_REGISTER,
+                     read_APIC_register(APIC_LVT_LINT0_REGISTER) | 0x10000);
+ write_APIC_register(APIC_LVT_LINT1_REGISTER,
+                     read_APIC_register(APIC_LVT_LINT1_REGISTER) | 0x10000);
+ write_APIC_register(APIC_LVT_ERROR_REGISTER,
+                     read_APIC_register(APIC_LVT_ERROR_REGISTER) | 0x10000);
 }
 
 static unsigned int
@@ -150,6 +181,11 @@ init_processor(register const unsigned int processorIndex)
  lldt(0);
  ltr(40+processorIndex*16);
  lidt(256*16-1, (uint64_t) amd64_IDT);
+
+ /* Enable PCIDs. The PCID field of cr3 is zero at this point which is
+    required. */
+ if (amd64_PCID_enabled)
+  writeCr4(readCr4() | (1<<17));
 }
 
 /*! This function is called from the assembly language portion of the
@@ -198,6 +234,46 @@ amd64_multiboot_main(void)
    (((uint64_t) &TSS[tssIndex*28])>>32) & 0xffffffff;
  }
 
+ /* Create the per-CPU areas by copying the per-CPU variable template into
+    the area of each processor. */
+ {
+  register const uint64_t percpu_size = amd64_percpu_end-amd64_percpu_start;
+  register int            processor_index;
+
+  for(processor_index = 0;
+      processor_index < AMD64_MAX_NUMBER_OF_CPUS;
+      processor_index++)
+  {
+   register char*       dst = amd64_percpu_areas +
+                              processor_index*percpu_size;
+   register const char* src = amd64_percpu_start;
+
+   amd64_CPU_private_table[processor_index].percpuOffset =
+    dst - amd64_percpu_start;
+
+   for(; src<amd64_percpu_end;)
+   {
+    *dst++=*src++;
+   }
+  }
+ }
+
+ /* Split the memory between the kalloc heap and the frame allocator. */
+ initialize_physical_memory();
+
+ /* Size the tables indexed by executable image. */
+ initialize_program_images();
+ initialize_process_pools();
+
+ /* Use process context identifiers if the processor has them. */
+ {
+  uint32_t EAX, EBX, ECX, EDX;
+
+  cpuid(1, &EAX, &EBX, &ECX, &EDX);
+  if (ECX & (1<<17))
+   amd64_PCID_enabled = 1;
+ }
+
  init_processor(0);
 }
 
@@ -242,6 +318,17 @@ amd64_system_start(const unsigned long boot_stack_pointer)
  {
   register unsigned int processor_index;
 
+  /* Use the x2APIC if the processor has one. The x2APIC is operated
+     through MSRs which is cheaper than MMIO, in particular under emulation,
+     and it supports APIC ids above 255. */
+  {
+   uint32_t EAX, EBX, ECX, EDX;
+
+   cpuid(1, &EAX, &EBX, &ECX, &EDX);
+   if (ECX & (1<<21))
+    amd64_x2APIC_mode = 1;
+  }
+
   initialize_APIC();
   number_of_initialized_CPUs=1;
 
@@ -259,23 +346,21 @@ amd64_system_start(const unsigned long boot_stack_pointer)
       timeout and a second try if the first does not work. */
 
    /* Send INIT command. */
-   *(amd64_local_APIC_base_address+0x310/4) =
-    amd64_CPU_private_table[processor_index].APICId<<(56-32);
-   *(amd64_local_APIC_base_address+0x300/4) = 0x510;
+   send_APIC_command(amd64_CPU_private_table[processor_index].APICId, 0x510);
 
    /* Pause for a moment, using busy wait and CPU0's APIC timer. */
    {
     /* Set divider to 2. */
-    *(amd64_local_APIC_base_address+0x3e0/4) = 0x00;
+    write_APIC_register(APIC_TIMER_DIVIDE_REGISTER, 0x00);
 
     /* Set initial count */
-    *(amd64_local_APIC_base_address+0x380/4) = 1000000;
+    write_APIC_register(APIC_TIMER_INITIAL_COUNT_REGISTER, 1000000);
 
-    while (*(amd64_local_APIC_base_address+0x390/4) > 0);
+    while (read_APIC_register(APIC_TIMER_CURRENT_COUNT_REGISTER) > 0);
    }
 
    /* Send SIPI. */
-   *(amd64_local_APIC_base_address+0x300/4) = 0x610;
+   send_APIC_command(amd64_CPU_private_table[processor_index].APICId, 0x610);
 
    /* Spin until the application processor is woken up. */
    while((processor_index+1) != number_of_initialized_CPUs);
@@ -290,12 +375,9 @@ amd64_system_start(const unsigned long boot_stack_pointer)
   write_io_apic_register(0x10 + timer_gsi*2, 0x00000020);
  }
 
- /* Go to user space and execute the first process. */
- //kcreateprocess(0);
-
- //fxsave(getActiveContext()->fp_context);
+ /* Create the first process and start scheduling. */
  kcreateprocess(0);
- returnToUserLevel(getActiveContext(), 0);
+ amd64_idle();
 }
 
 void
@@ -308,12 +390,31 @@ amd64_AP_init(void)
  initialize_APIC();
  number_of_initialized_CPUs++;
 
- /* Add code that allows the AP to run the scheduler. */
+ amd64_idle();
+}
 
- /* Remove the following while loop once you have implemented proper scheduling
-    for the AP. */
+void
+amd64_idle(void)
+{
  while(1)
  {
+  register struct AMD64Context * context;
+
+  scheduler();
+  context = getActiveContext();
+  if (context)
+   returnToUserLevel(context, 0);
+
+  /* Use the idle time to free terminated processes and to build process
+     shells. Look for processes to run again after each step. */
+  if (reclaim_processes(0))
+   continue;
+  if (refill_process_pools())
+   continue;
+
+  /* Nothing to run. An IPI sent by wake_up_process after the scheduler
+     looked at the wakeup list is held pending until the hlt because of
+     the sti interrupt shadow. */
   sti();
   hlt();
   cli();
@@ -321,19 +422,27 @@ amd64_AP_init(void)
 }
 
 
-/*! Helper function for kalloc and kfree */
-char isValid(char* ptr) {
+/*! Helper function for heap_allocate and heap_free. Checks that a block
+    lies inside the heap. */
+static char inHeap(const struct heap * heap, blockPtr block) {
+  return (uint64_t) block >= heap->start &&
+         (uint64_t) block <= heap->start + heap->size - BLOCKSIZE;
+}
+
+/*! Helper function for heap_allocate and heap_free */
+static char isValid(struct heap * heap, char* ptr) {
   blockPtr block= (blockPtr)(ptr-BLOCKSIZE);
-  if( block->full==1 &&
-      (block->next==0 || (block->next >= base && block->next <= (blockPtr)(((char*)base)+ALLOCATE_SIZE))) &&
-      (block->prev==0 || (block->prev >= base && block->prev <= (blockPtr)(((char*)base)+ALLOCATE_SIZE))) &&
-      block->size<=ALLOCATE_SIZE )
+  if( inHeap(heap, block) &&
+      block->full==1 &&
+      (block->next==0 || inHeap(heap, block->next)) &&
+      (block->prev==0 || inHeap(heap, block->prev)) &&
+      block->size<=heap->size )
     return 1;
   return 0;
 }
 
-/*! Helper function for kalloc and kfree */
-blockPtr merge(blockPtr first, blockPtr second) {
+/*! Helper function for heap_allocate and heap_free */
+static blockPtr merge(blockPtr first, blockPtr second) {
   first->next=second->next;
   first->size=((char*)second)- ((char*)first) + second->size;
   if(second->next)
@@ -342,28 +451,32 @@ blockPtr merge(blockPtr first, blockPtr second) {
 }
 
 
-/*! Helper function for kalloc and kfree */
-blockPtr findPlace(uint64_t size) {
-  blockPtr _base=base;
-  last=0;
+/*! Helper function for heap_allocate and heap_free. Returns ERROR cast to
+    a block pointer if the block list is corrupt. */
+static blockPtr findPlace(struct heap * heap, uint64_t size) {
+  blockPtr _base=heap->base;
+  heap->last=0;
 
   while(_base && (_base->full ||  _base->size < size)) {
-    last=_base;
+    heap->last=_base;
     _base=_base->next;
+    if(_base && !inHeap(heap, _base))
+      return (blockPtr) ERROR;
   }
   return _base;
 }
 
-/*! Helper function for kalloc and kfree */
-blockPtr extendMemory(uint64_t size) {
+/*! Helper function for heap_allocate and heap_free */
+static blockPtr extendMemory(struct heap * heap, uint64_t size) {
   blockPtr new=0;
+  blockPtr last=heap->last;
   if(last!=0) {
     new=(blockPtr)((char*)last + BLOCKSIZE + last->size);
     last->next=new;
   }
   else {
-    new=(blockPtr)amd64_lowest_available_physical_memory;
-    base=new;
+    new=(blockPtr)heap->start;
+    heap->base=new;
   }
   new->prev=last;/* if last is null then it holds. if last isn't full it still holds*/
   new->size = size;
@@ -371,14 +484,17 @@ blockPtr extendMemory(uint64_t size) {
   return new;
 }
 
-/*! Helper function for kalloc and kfree */
-blockPtr splitMemory(blockPtr current ,uint64_t size) {
+/*! Helper function for heap_allocate and heap_free */
+static blockPtr splitMemory(struct heap * heap, blockPtr current ,uint64_t size) {
   blockPtr smallPart;
 
   if(current->size >= size + BLOCKSIZE + 4) {
     smallPart=(blockPtr)((char*)current + BLOCKSIZE + size);
+    if(!inHeap(heap, smallPart))
+      return current;
     smallPart->next=current->next;
-    smallPart->next->prev=smallPart;
+    if(smallPart->next)
+      smallPart->next->prev=smallPart;
     current->next=smallPart;
     smallPart->prev=current;
     smallPart->full=0;
@@ -393,39 +509,48 @@ blockPtr splitMemory(blockPtr current ,uint64_t size) {
   }
 }
 
-/*! Allocates a memory block.
+/*! Allocates a memory block from a heap. Does no locking.
     \return an address to the memory block or an error code if
             the allocation was not successful. */
-long
-kalloc(const register uint64_t length)
+static long
+heap_allocate(struct heap * const heap, const register uint64_t length)
 {
 	  register uint64_t t= (length & 0x1f);
 	  uint64_t size = t==0 ? length : length + 32 - t;
-	  blockPtr p = findPlace(size), found;
+	  blockPtr p, found;
+
+	  if(length > heap->size)
+	    return ERROR;
+
+	  p = findPlace(heap, size);
+	  if(p == (blockPtr) ERROR)
+	    return ERROR;
 	  if(p == 0) { /*checking if it fits */
-	    register int a = ALLOCATE_SIZE - (last-base)-BLOCKSIZE;
+	    register blockPtr last = heap->last;
+	    register int64_t a = heap->size - (((char *) last)-((char *) heap->base))-BLOCKSIZE;
 	    if(last!=0)
 	      a-=last->size+BLOCKSIZE;
-	    if(size > a)
+	    if(last!=0 && last->size > heap->size)
 	      return ERROR;
-	   found= extendMemory(size);
+	    if((int64_t) size > a)
+	      return ERROR;
+	   found= extendMemory(heap, size);
 	  }
 	  else {
-	    found = splitMemory(p,size);
+	    found = splitMemory(heap, p,size);
 	  }
 	  found->full=1;
 	  return (long)((char *)found + BLOCKSIZE);
-
 }
 
-/*! Frees a previously allocated a memory block.
+/*! Frees a memory block allocated from a heap. Does no locking.
     \return ALL_OK if successful or an error code if
             the free was not successful. */
-long
-kfree(const register uint64_t address)
+static long
+heap_free(struct heap * const heap, const register uint64_t address)
 {
 	  blockPtr freed,thePrev,theNext,temp;
-	  if(!isValid((char*)address)) {
+	  if(!isValid(heap, (char*)address)) {
 	    return ERROR;
 	  }
 
@@ -436,7 +561,7 @@ kfree(const register uint64_t address)
 	  if(theNext && !theNext->full){
 	    temp=merge(freed, theNext);
 	    temp->full=1;
-	    kfree(((uint64_t)temp)+BLOCKSIZE);
+	    heap_free(heap, ((uint64_t)temp)+BLOCKSIZE);
 	  }
 	  else if(theNext && theNext->full){
 	    if(thePrev && !thePrev->full){
@@ -449,79 +574,561 @@ kfree(const register uint64_t address)
 	  }
 	  else {
 	    if(!thePrev) {
-	      base=0;
+	      heap->base=0;
 	    }
 	    else {
 	      thePrev->next=0;
 	      if(!thePrev->full) {
 		thePrev->full=1;
-		kfree(((uint64_t)thePrev)+BLOCKSIZE);
+		heap_free(heap, ((uint64_t)thePrev)+BLOCKSIZE);
 	      }
 	    }
 	  }
 	  return ALL_OK;
 }
 
+/*! Allocates a memory block.
+    \return an address to the memory block or an error code if
+            the allocation was not successful. */
+long
+kalloc(const register uint64_t length)
+{
+	  struct mcs_node node;
+	  register const uint64_t flags = grab_mcs_lock_irqsave(&heap_lock, &node);
+	  register const long result = heap_allocate(&kernel_heap, length);
 
-/*! Terminates the caller process. */
-void kterminate()
+	  release_mcs_lock_irqrestore(&heap_lock, &node, flags);
+	  return result;
+}
+
+/*! Frees a previously allocated a memory block.
+    \return ALL_OK if successful or an error code if
+            the free was not successful. */
+long
+kfree(const register uint64_t address)
+{
+	  struct mcs_node node;
+	  register const uint64_t flags = grab_mcs_lock_irqsave(&heap_lock, &node);
+	  register const long result = heap_free(&kernel_heap, address);
+
+	  release_mcs_lock_irqrestore(&heap_lock, &node, flags);
+	  return result;
+}
+
+
+/*! Frees a process which is not in any queue. */
+static void destroy_process(struct process_queue_element * terminated)
+{
+	destroy_address_space(terminated->element.address_space); /* Deallocate segments in memory. */
+	release_program_image(terminated->element.id);
+	free_process(terminated); /* The context goes with the table entry. */
+	resume_process_pools(); /* The memory may be enough for a shell. */
+}
+
+/*! Terminated processes whose grace period has elapsed. They are freed
+ * when the processor has nothing better to do. */
+struct reclaim_list {
+	struct process_queue_element * head; /*!< Linked through next */
+	uint64_t                     length; /*!< Number of processes in the list */
+};
+
+/*! The reclaim list of each processor. It is only used by its processor
+ * with interrupts disabled and needs no lock. */
+static DEFINE_PER_CPU(struct reclaim_list, reclaim_list);
+
+/*! RCU callback handing a terminated process to the reclaim list. The
+ * callback runs in the timer interrupt, so the expensive teardown is
+ * left to reclaim_processes. */
+static void reclaim_process(struct rcu_head * head)
+{
+	struct process_queue_element * terminated =
+	 (struct process_queue_element *) ((char *) head -
+	  __builtin_offsetof(struct process_queue_element, rcu));
+	struct reclaim_list * const list = this_cpu_ptr(&reclaim_list);
+
+	terminated->next=list->head;
+	list->head=terminated;
+	list->length++;
+}
+
+int reclaim_processes(uint64_t keep)
+{
+	struct reclaim_list * const list = this_cpu_ptr(&reclaim_list);
+	struct process_queue_element * terminated;
+
+	if(list->length<=keep)
+		return 0;
+
+	terminated=list->head;
+	list->head=terminated->next;
+	list->length--;
+	destroy_process(terminated);
+	return 1;
+}
+
+/*! Protects the child records of all processes. */
+static struct ticket_lock process_tree_lock = TICKET_LOCK_INITIALIZER;
+
+/*! Makes the top-most process in the queue of the calling processor the
+ * active one after the previous one has left the queue. */
+static void run_next_process()
 {
-	struct process_entry terminated = pop_process_queue(); /* Pops queue.*/
-	kfree((uint64_t) terminated.context); /* Deallocate terminated context. */
-	kfree(terminated.memory_location); /* Deallocate segments in memory. */
 	if(is_empty_process_queue())
 	{
-		/* Queue is empty. There is no other process to assign CPU.*/
-		kprints("the last process is terminated! \n");
+		/* Queue is empty. There is no other process to assign this CPU.
+		   The caller goes idle. */
+		setActiveContext((struct AMD64Context *) 0);
 		return;
 	}
+	this_cpu_ptr(&run_queue)->top->element.state=RUNNING;
 	setActiveContext(top_process_queue().context); /* Set context of top-most element in process queue as active context. */
+}
+
+void kterminate(uint64_t exit_status)
+{
+	struct process_queue_element * terminated;
+	struct child_record * record, * next;
+
+	terminated = unlink_top_process_queue(); /* Pops queue.*/
+	close_all_handles(terminated);
 
+	grab_ticket_lock(&process_tree_lock);
+	/* Hand the exit status to the parent and wake it if it waits. */
+	record=terminated->element.record;
+	if(record)
+	{
+		if(record->orphaned)
+			kfree((uint64_t) record);
+		else
+		{
+			record->exit_status=exit_status;
+			record->exited=1;
+			if(record->waiter)
+			{
+				wake_up_process(record->waiter, select_processor());
+				record->waiter=0;
+			}
+		}
+	}
+	/* Nobody will wait for the children anymore. */
+	for(record=terminated->element.children; record; record=next)
+	{
+		next=record->next;
+		if(record->exited)
+			kfree((uint64_t) record);
+		else
+			record->orphaned=1;
+	}
+	release_ticket_lock(&process_tree_lock);
+
+	/* Stop using the address space of the process before it is reclaimed. */
+	switch_address_space(&kernel_address_space);
+	/* Other processors may still read the process entry. Reclaim it after
+	   a grace period. */
+	call_rcu(&terminated->rcu, reclaim_process);
+	run_next_process();
 }
 
-/*! Creates a process and pushes it to the process stack.
- * \return status of operation. */
-unsigned long kcreateprocess(uint64_t rdi)
+void kwait(uint64_t pid, uint64_t * exit_status)
 {
-	const struct Elf64_Ehdr*  elfImage = ELF_images[rdi];
-	struct process_entry new_process;
-	uint64_t entry_point = 0, memory_location = 0 ;
-	copy_ELF(elfImage, &entry_point, &memory_location); /* Parse ELF image. */
-	if(entry_point==0 || memory_location == 0)
+	struct process_queue_element * const current = this_cpu_ptr(&run_queue)->top;
+	struct AMD64Context * const context = current->element.context;
+	struct child_record ** link;
+	struct child_record * record;
+
+	if(!is_user_range((uint64_t) exit_status, sizeof(uint64_t)))
 	{
-		/* Invalid ELF File. */
-		kprints("\nit is an error. copy_ELF didn't work well! \n");
-		return ERROR;
+		context->rax=ERROR;
+		return;
+	}
+
+	/* Children which have exited are no longer in the process table, so
+	 * the child is looked up in the list of the caller. The list only holds
+	 * the children of the caller. */
+	grab_ticket_lock(&process_tree_lock);
+	for(link=&current->element.children;
+	    *link!=(struct child_record *) 0 && (*link)->pid!=pid;
+	    link=&(*link)->next);
+	record=*link;
+	if(record==(struct child_record *) 0)
+	{
+		/* Not a child of the caller. */
+		release_ticket_lock(&process_tree_lock);
+		context->rax=ERROR;
+		return;
+	}
+	if(record->exited)
+	{
+		/* The record stays if the status cannot be stored, so the
+		 * caller may wait again. */
+		if(copy_to_user((uint64_t) exit_status, &record->exit_status,
+		                sizeof(uint64_t))!=ALL_OK)
+		{
+			release_ticket_lock(&process_tree_lock);
+			context->rax=ERROR;
+			return;
+		}
+		*link=record->next;
+		release_ticket_lock(&process_tree_lock);
+		kfree((uint64_t) record);
+		context->rax=ALL_OK;
+		return;
 	}
-	/* Allocate memory for new context. */
-	struct AMD64Context * newContext = (struct AMD64Context*)kalloc(sizeof(struct AMD64Context));
-	if(newContext==(struct AMD64Context*)ERROR) /* Kmalloc has failed! */
+
+	/* Leave the run queue until the child terminates. The system call
+	 * instruction is two bytes long. Moving rip back makes the caller
+	 * execute it again when it is woken up. */
+	record->waiter=current;
+	context->rip-=2;
+	unlink_top_process_queue();
+	current->element.state=BLOCKED;
+	release_ticket_lock(&process_tree_lock);
+
+	/* The caller may run on another processor as soon as it is woken. */
+	switch_address_space(&kernel_address_space);
+	run_next_process();
+}
+
+/*! Links a record for a new process into the list of children of the
+ * caller. Processes created when no process runs have no parent.
+ * \return ALL_OK or ERROR if there is not enough memory. */
+static unsigned long adopt_process(struct process_queue_element * child)
+{
+	struct process_entry * parent;
+	struct child_record * record;
+
+	child->element.children=0;
+	child->element.record=0;
+	if(getActiveContext()==(struct AMD64Context *) 0)
+		return ALL_OK;
+
+	record=(struct child_record *) kalloc(sizeof(struct child_record));
+	if(record==(struct child_record *) ERROR)
 		return ERROR;
+	record->pid=child->element.pid;
+	record->exit_status=0;
+	record->exited=0;
+	record->orphaned=0;
+	record->waiter=0;
+
+	parent=&this_cpu_ptr(&run_queue)->top->element;
+	grab_ticket_lock(&process_tree_lock);
+	record->next=parent->children;
+	parent->children=record;
+	release_ticket_lock(&process_tree_lock);
+
+	child->element.record=record;
+	return ALL_OK;
+}
+
+/*! Undoes adopt_process for a process which was never started. */
+static void disown_process(struct process_queue_element * child)
+{
+	struct child_record ** link;
+
+	if(child->element.record==(struct child_record *) 0)
+		return;
+
+	grab_ticket_lock(&process_tree_lock);
+	for(link=&this_cpu_ptr(&run_queue)->top->element.children;
+	    *link!=child->element.record;
+	    link=&(*link)->next);
+	*link=child->element.record->next;
+	release_ticket_lock(&process_tree_lock);
+
+	kfree((uint64_t) child->element.record);
+	child->element.record=0;
+}
+
+void block_process(struct wait_queue * queue, struct ticket_lock * lock)
+{
+	struct process_queue_element * const current = this_cpu_ptr(&run_queue)->top;
+
+	/* The system call instruction is two bytes long. Moving rip back
+	 * makes the caller execute it again when it is woken up. */
+	current->element.context->rip-=2;
+	unlink_top_process_queue();
+	current->element.state=BLOCKED;
+	current->next=queue->waiters;
+	queue->waiters=current;
+	release_ticket_lock(lock);
+
+	/* The caller may run on another processor as soon as it is woken. */
+	switch_address_space(&kernel_address_space);
+	run_next_process();
+}
+
+void wake_up_waiters(struct wait_queue * queue)
+{
+	struct process_queue_element * waiter, * next;
+
+	for(waiter=queue->waiters; waiter; waiter=next)
+	{
+		next=waiter->next;
+		wake_up_process(waiter, select_processor());
+	}
+	queue->waiters=0;
+}
+
+struct process_queue_element * kbuildprocess(uint64_t rdi)
+{
+	uint64_t entry_point = 0;
+	struct address_space * address_space;
+	struct AMD64Context * newContext;
+	/* Allocate the process table entry. It holds the context. */
+	struct process_queue_element * element = allocate_process();
+	if(element==(struct process_queue_element *) 0)
+		return 0;
+	address_space = create_address_space();
+	if(address_space==(struct address_space *) 0)
+	{
+		free_process(element);
+		return 0;
+	}
+	entry_point = map_program_image(rdi, address_space); /* Map the shared ELF image. */
+	if(entry_point==0)
+	{
+		/* Invalid index or too little memory. The caller reports it. */
+		destroy_address_space(address_space);
+		free_process(element);
+		return 0;
+	}
 
 	/* Set rflags and rip registers of new context. */
+	newContext = element->element.context;
 	newContext->rflags=0x200;//try 200
 	newContext->rip = entry_point;
+	/* The stack is populated as it is used. */
+	newContext->rsp = USER_STACK_TOP;
+	newContext->interrupt_context = 0;
+	newContext->address_space = address_space;
 
 	/*  Initialize process struct fields. */
-	new_process.context=newContext;
-	new_process.memory_location=memory_location; /* We need it to be able to free it during termination. */
-	new_process.id=rdi; /* Process id is index of its ELF image */
-	new_process.state=READY; /* Initially READY */
+	element->element.address_space=address_space; /* We need it to be able to free it during termination. */
+	element->element.id=rdi; /* Index of its ELF image */
+	element->element.children=0;
+	element->element.record=0;
+	element->element.state=READY; /* Initially READY */
 
-	push_back_process_queue(new_process); /* Push new process to the back of the process queue */
+	return element;
+}
 
-	if(top_process==(struct process_queue_element * ) 0) /* Push_back operation must have failed. */
+/*! Creates a process and pushes it to the process stack.
+ * \return status of operation. */
+unsigned long kcreateprocess(uint64_t rdi)
+{
+	/* Take a prebuilt process from the pool. Build it here only if the
+	 * pool has run dry. */
+	struct process_queue_element * element = take_process_shell(rdi);
+	if(element==(struct process_queue_element *) 0)
+		element = kbuildprocess(rdi);
+	if(element==(struct process_queue_element *) 0)
 		return ERROR;
 
-	/* When recently create process is the only process executed by operating system
-	 * we need to start executing it by setting active context as new process's context.
-	 * Then we also set state info accordingly.
+	if(adopt_process(element)!=ALL_OK)
+	{
+		destroy_process(element);
+		return ERROR;
+	}
+
+	/* Hand the process to the least loaded processor. It starts executing
+	 * the process at its next scheduling point.
 	 */
-	if(top_process==back_process)
+	wake_up_process(element, select_processor());
+
+	return element->element.pid;
+}
+
+unsigned long kcreateprocesses(uint64_t rdi, uint64_t count,
+                               uint64_t * pids, uint64_t flags)
+{
+	struct process_queue_element * elements[AMD64_MAX_PROCESSES_PER_BATCH];
+	uint64_t batch_pids[AMD64_MAX_PROCESSES_PER_BATCH];
+	uint64_t i, processor_index;
+
+	if(count==0 || count>AMD64_MAX_PROCESSES_PER_BATCH ||
+	   !is_user_range((uint64_t) pids, count*sizeof(uint64_t)))
+		return ERROR;
+
+	/* Get all processes before starting any so that the batch succeeds or
+	 * fails as a whole. The image is parsed by the first instance only. */
+	for(i=0; i<count; i++)
+	{
+		elements[i] = take_process_shell(rdi);
+		if(elements[i]==(struct process_queue_element *) 0)
+			elements[i] = kbuildprocess(rdi);
+		if(elements[i]==(struct process_queue_element *) 0)
+		{
+			while(i>0)
+				destroy_process(elements[--i]);
+			return ERROR;
+		}
+		batch_pids[i]=elements[i]->element.pid;
+	}
+
+	/* Store the ids while the batch can still be dropped as a whole. */
+	if(copy_to_user((uint64_t) pids, batch_pids,
+	                count*sizeof(uint64_t))!=ALL_OK)
 	{
-		setActiveContext(newContext);
-		top_process->element.state=RUNNING;
+		for(i=0; i<count; i++)
+			destroy_process(elements[i]);
+		return ERROR;
 	}
 
+	for(i=0; i<count; i++)
+	{
+		if(adopt_process(elements[i])!=ALL_OK)
+		{
+			uint64_t failed=i;
+
+			while(i>0)
+			{
+				disown_process(elements[--i]);
+				destroy_process(elements[i]);
+			}
+			for(i=failed; i<count; i++)
+				destroy_process(elements[i]);
+			return ERROR;
+		}
+	}
+
+	/* Start at the least loaded processor. Spread the processes over the
+	 * processors from there if asked to. */
+	processor_index=select_processor();
+	for(i=0; i<count; i++)
+	{
+		wake_up_process(elements[i], processor_index);
+		if(flags & CREATEPROCESSES_SPREAD)
+			processor_index=(processor_index+1)%amd64_number_of_available_CPUs;
+	}
+
+	return count;
+}
+
+unsigned long kfork()
+{
+	struct process_entry parent = top_process_queue();
+	struct address_space * address_space;
+	struct AMD64Context * newContext;
+	struct process_queue_element * element;
+
+	/* Allocate everything that can fail before the address space is
+	 * copied. Copying makes the pages of the parent copy-on-write. */
+	element = allocate_process();
+	if(element==(struct process_queue_element *) 0)
+		return ERROR;
+	address_space = fork_address_space(parent.address_space);
+	if(address_space==(struct address_space *) 0)
+	{
+		free_process(element);
+		return ERROR;
+	}
+	reference_program_image(parent.id);
+
+	/* The copy resumes after the system call with the registers of the
+	 * parent, except that the call returns zero. */
+	newContext = element->element.context;
+	*newContext = *parent.context;
+	newContext->rax = 0;
+	newContext->interrupt_context = 0;
+	newContext->address_space = address_space;
+
+	element->element.address_space=address_space;
+	element->element.id=parent.id;
+	element->element.state=READY;
+	/* The copy gets the handles of the parent. */
+	if(copy_handles(this_cpu_ptr(&run_queue)->top, element)!=ALL_OK)
+	{
+		destroy_process(element);
+		return ERROR;
+	}
+	if(adopt_process(element)!=ALL_OK)
+	{
+		close_all_handles(element);
+		destroy_process(element);
+		return ERROR;
+	}
+
+	wake_up_process(element, select_processor());
+
+	return element->element.pid;
+}
+
+unsigned long kexec(uint64_t rdi)
+{
+	struct process_entry * const current = &this_cpu_ptr(&run_queue)->top->element;
+	struct AMD64Context * const context = current->context;
+	struct address_space * address_space = current->address_space;
+	struct address_space * old_address_space;
+	uint64_t entry_point;
+
+	/* Load the new image before the old program is touched. Mapping a
+	 * pinned image only needs memory for missing page tables. */
+	if(pin_program_image(rdi)!=ALL_OK)
+		return ERROR;
+
+	if(program_image_has_tables(rdi, address_space))
+	{
+		/* Unmap the old program. The page tables stay and the new image
+		 * fills them without allocating any. */
+		empty_address_space(address_space);
+		entry_point = map_pinned_program_image(rdi, address_space);
+	}
+	else
+	{
+		/* Map the new program next to the old one, so that the caller
+		 * is left as it was if that fails. */
+		address_space = create_address_space();
+		if(address_space==(struct address_space *) 0)
+		{
+			release_program_image(rdi);
+			return ERROR;
+		}
+		entry_point = map_pinned_program_image(rdi, address_space);
+		if(entry_point==0)
+		{
+			destroy_address_space(address_space);
+			release_program_image(rdi);
+			return ERROR;
+		}
+
+		/* The old address space must not be loaded when it is
+		 * destroyed. */
+		old_address_space=current->address_space;
+		current->address_space=address_space;
+		context->address_space=address_space;
+		switch_address_space(address_space);
+		destroy_address_space(old_address_space);
+	}
+	release_program_image(current->id);
+	current->id=rdi;
+	if(entry_point==0)
+	{
+		/* The old program is gone and the new one does not fit in the
+		 * address space. */
+		kterminate(ERROR);
+		return ALL_OK;
+	}
+
+	/* Start the new program from a clean register file. */
+	context->rax=0;
+	context->rbx=0;
+	context->rcx=0;
+	context->rdx=0;
+	context->rdi=0;
+	context->rsi=0;
+	context->rbp=0;
+	context->rsp=USER_STACK_TOP;
+	context->r8=0;
+	context->r9=0;
+	context->r10=0;
+	context->r11=0;
+	context->r12=0;
+	context->r13=0;
+	context->r14=0;
+	context->r15=0;
+	context->rip=entry_point;
+	context->rflags=0x200;
+
 	return ALL_OK;
 }
@@ -0,0 +1,177 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file timer.c This file holds timers. A timer counts its expirations
+    until a process reads it, so a process which falls behind learns how
+    many intervals it missed. Armed timers are kept in a list sorted by
+    deadline, so a tick only looks at the timers which are due. A timer is
+    readable in a poll set while it has expired since it was last read.
+ */
+
+#include "globals.h"
+
+/*! A timer. */
+struct timer
+{
+ /*! Handles hold references to the timer. */
+ struct kernel_object object;
+ /*! Interval in ticks, zero if the timer expires once. */
+ uint64_t             period;
+ /*! The tick the timer expires at. */
+ uint64_t             deadline;
+ /*! Number of expirations since the timer was last read. */
+ uint64_t             expirations;
+ /*! Non-zero while the timer is in armed_timers. */
+ uint64_t             armed;
+ /*! Processes waiting for the timer to expire. */
+ struct wait_queue    waiters;
+ /*! Next armed timer. */
+ struct timer *       next;
+};
+
+/*! Protects armed_timers, ticks and the timers. */
+static struct ticket_lock timers_lock = TICKET_LOCK_INITIALIZER;
+
+/*! The armed timers sorted by deadline. */
+static struct timer * armed_timers;
+
+/*! Number of ticks since boot. */
+static uint64_t ticks;
+
+/*! Inserts a timer in armed_timers. Must be called with timers_lock
+    held. */
+static void
+arm_timer(register struct timer * const timer)
+{
+ register struct timer ** link;
+
+ for (link = &armed_timers;
+      *link && (*link)->deadline <= timer->deadline;
+      link = &(*link)->next);
+ timer->next = *link;
+ *link = timer;
+ timer->armed = 1;
+}
+
+/*! Disarms and frees a timer when the last reference to it is dropped. */
+static void
+destroy_timer(register struct kernel_object * const object)
+{
+ register struct timer * const timer = (struct timer *) object;
+
+ grab_ticket_lock(&timers_lock);
+ if (timer->armed)
+ {
+  register struct timer ** link;
+
+  for (link = &armed_timers; *link != timer; link = &(*link)->next);
+  *link = timer->next;
+ }
+ release_ticket_lock(&timers_lock);
+
+ kfree((uint64_t) timer);
+}
+
+/*! \returns The POLL_ events a timer is ready for. */
+static uint64_t
+poll_timer(register struct kernel_object * const object)
+{
+ return ((volatile struct timer *) object)->expirations ? POLL_READABLE : 0;
+}
+
+long
+create_timer(register const uint64_t milliseconds,
+             register const uint64_t periodic)
+{
+ register struct timer * timer;
+ register uint64_t       interval;
+ register long           handle;
+
+ /* A timer expires on a tick boundary, at least one tick from now. */
+ interval = (milliseconds + AMD64_MILLISECONDS_PER_TICK - 1) /
+            AMD64_MILLISECONDS_PER_TICK;
+ if (0 == interval)
+  interval = 1;
+
+ timer = (struct timer *) kalloc(sizeof(struct timer));
+ if (ERROR == (long) timer)
+  return ERROR;
+
+ initialize_object(&timer->object, KERNEL_OBJECT_TIMER, destroy_timer,
+                   poll_timer);
+ timer->period = periodic ? interval : 0;
+ timer->expirations = 0;
+ timer->armed = 0;
+ timer->waiters.waiters = 0;
+
+ grab_ticket_lock(&timers_lock);
+ timer->deadline = ticks + interval;
+ arm_timer(timer);
+ release_ticket_lock(&timers_lock);
+
+ /* destroy_timer disarms the timer. */
+ handle = install_handle(&timer->object);
+ if (ERROR == handle)
+  release_object(&timer->object);
+ return handle;
+}
+
+long
+read_timer(register const uint64_t handle)
+{
+ register struct timer * const timer =
+  (struct timer *) find_handle(handle, KERNEL_OBJECT_TIMER);
+ register uint64_t             expirations;
+
+ if (0 == timer)
+  return ERROR;
+
+ grab_ticket_lock(&timers_lock);
+ expirations = timer->expirations;
+ if (0 == expirations)
+ {
+  /* A one-shot timer which has been read never expires again. */
+  if (!timer->armed)
+  {
+   release_ticket_lock(&timers_lock);
+   return ERROR;
+  }
+
+  block_process(&timer->waiters, &timers_lock);
+  return AMD64_RESTART_SYSCALL;
+ }
+
+ timer->expirations = 0;
+ release_ticket_lock(&timers_lock);
+ return expirations;
+}
+
+void
+expire_timers(void)
+{
+ grab_ticket_lock(&timers_lock);
+ ticks++;
+
+ while (armed_timers && armed_timers->deadline <= ticks)
+ {
+  register struct timer * const timer = armed_timers;
+
+  armed_timers = timer->next;
+  timer->armed = 0;
+  timer->expirations++;
+  wake_up_waiters(&timer->waiters);
+  notify_watchers(&timer->object);
+
+  if (timer->period)
+  {
+   timer->deadline += timer->period;
+   arm_timer(timer);
+  }
+ }
+
+ release_ticket_lock(&timers_lock);
+}
@@ -0,0 +1,774 @@
+/* Copyright (c) 1997-2012, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file virtual_memory.c This file holds the implementation of address
+    spaces. Each process has a page table of its own. The identity map of
+    physical memory (PML4 slot 0) and the kernel (PML4 slot 511) are shared
+    by all page tables. Processes are mapped in the slots in between.
+    Pages in demand-zero regions are allocated when first touched and
+    copy-on-write pages are copied when first written. The stack region
+    grows down when a page just below it is touched.
+
+    If the processor supports process context identifiers each address
+    space gets a PCID of its own. Switching address spaces then does not
+    flush the TLB unless the processor may hold stale entries tagged with
+    the PCID.
+ */
+
+#include "globals.h"
+
+uint32_t
+amd64_PCID_enabled;
+
+struct address_space
+kernel_address_space = { AMD64_KERNEL_PML4, 0, 0, 0 };
+
+/*! The address space loaded in cr3 of each processor. */
+static DEFINE_PER_CPU(struct address_space *, current_address_space) =
+ &kernel_address_space;
+
+/*! Protects pcid_bitmap. */
+static struct ticket_lock pcid_lock = TICKET_LOCK_INITIALIZER;
+
+/*! One bit for each PCID. A set bit means the PCID is in use. */
+static uint64_t pcid_bitmap[AMD64_NUMBER_OF_PCIDS/64];
+
+/*! Where the search for a free PCID starts. */
+static uint64_t next_pcid = 1;
+
+/*! Allocates a PCID.
+    \returns A PCID or zero if the PCIDs have run out or are not
+             supported. Address spaces with PCID zero are always switched
+             to with a flush. */
+static uint64_t
+allocate_pcid(void)
+{
+ register uint64_t pcid = 0;
+ register uint64_t i;
+
+ if (!amd64_PCID_enabled)
+  return 0;
+
+ grab_ticket_lock(&pcid_lock);
+ for (i = 1; i < AMD64_NUMBER_OF_PCIDS; i++)
+ {
+  register const uint64_t candidate = next_pcid;
+
+  if (++next_pcid == AMD64_NUMBER_OF_PCIDS)
+   next_pcid = 1;
+
+  if (0 == (pcid_bitmap[candidate/64] & (1ULL<<(candidate%64))))
+  {
+   pcid_bitmap[candidate/64] |= 1ULL<<(candidate%64);
+   pcid = candidate;
+   break;
+  }
+ }
+ release_ticket_lock(&pcid_lock);
+
+ return pcid;
+}
+
+/*! Frees a PCID allocated with allocate_pcid. */
+static void
+free_pcid(register const uint64_t pcid)
+{
+ if (0 == pcid)
+  return;
+
+ grab_ticket_lock(&pcid_lock);
+ pcid_bitmap[pcid/64] &= ~(1ULL<<(pcid%64));
+ release_ticket_lock(&pcid_lock);
+}
+
+/*! Makes an arena empty and adds the demand-zero region serving it. The
+    region is empty until the break is moved. */
+static void
+initialize_user_arena(register struct address_space * const address_space,
+                      register struct user_arena * const    arena,
+                      register const uint64_t               start,
+                      register const uint64_t               size,
+                      register const uint64_t               flags)
+{
+ arena->start = start;
+ arena->limit = start + size;
+ arena->brk = start;
+ arena->region = address_space->number_of_regions;
+ add_demand_zero_region(address_space, start, start, flags);
+}
+
+/*! Gives an address space empty heaps at USER_HEAP_BASE and
+    USER_HUGE_HEAP_BASE and a stack below USER_STACK_TOP. */
+static void
+initialize_user_regions(register struct address_space * const address_space)
+{
+ address_space->number_of_regions = 0;
+ initialize_user_arena(address_space, &address_space->heap,
+                       USER_HEAP_BASE, USER_HEAP_SIZE,
+                       PAGE_WRITABLE | PAGE_NO_EXECUTE);
+ initialize_user_arena(address_space, &address_space->huge_heap,
+                       USER_HUGE_HEAP_BASE, USER_HUGE_HEAP_SIZE,
+                       PAGE_WRITABLE | PAGE_NO_EXECUTE | PAGE_LARGE);
+ add_stack_region(address_space, USER_STACK_TOP, USER_STACK_SIZE);
+}
+
+struct address_space *
+create_address_space(void)
+{
+ register struct address_space * address_space;
+ register uint64_t               pml4;
+ register int                    i;
+
+ address_space = (struct address_space *) kalloc(sizeof(struct address_space));
+ if (ERROR == (long) address_space)
+  return 0;
+
+ pml4 = allocate_frame();
+ if (0 == pml4)
+ {
+  kfree((uint64_t) address_space);
+  return 0;
+ }
+ clear_frame(pml4);
+
+ /* Share the identity map and the kernel with all other address spaces.
+    Their tables are supervisor-only, user mode reaches nothing below these
+    entries. */
+ ((uint64_t *) pml4)[0] = ((uint64_t *) AMD64_KERNEL_PML4)[0];
+ ((uint64_t *) pml4)[511] = ((uint64_t *) AMD64_KERNEL_PML4)[511];
+
+ address_space->pml4 = pml4;
+ address_space->pcid = allocate_pcid();
+ /* The processors may hold entries tagged with the PCID from an address
+    space which used it before. */
+ address_space->stale_CPUs = ~0ULL;
+ for (i = 0; i < AMD64_MAX_NUMBER_OF_SHARED_MAPPINGS; i++)
+  address_space->shared_mappings[i] = 0;
+ initialize_user_regions(address_space);
+
+ return address_space;
+}
+
+/*! Releases the frames mapped by a page table and the frames of the tables
+    below it. */
+static void
+release_page_table(register const uint64_t     table,
+                   register const unsigned int level)
+{
+ register int i;
+
+ for (i = 0; i < 512; i++)
+ {
+  register const uint64_t entry = ((uint64_t *) table)[i];
+
+  if (0 == (entry & PAGE_PRESENT))
+   continue;
+
+  if (0 == level)
+   release_frame(entry & PAGE_ADDRESS_MASK);
+  else if (entry & PAGE_LARGE)
+   release_large_frame(entry & PAGE_ADDRESS_MASK);
+  else
+   release_page_table(entry & PAGE_ADDRESS_MASK, level-1);
+ }
+
+ release_frame(table);
+}
+
+void
+destroy_address_space(register struct address_space * const address_space)
+{
+ register int i;
+
+ /* Slot 0 and 511 are shared and must not be released. */
+ for (i = 1; i < 511; i++)
+ {
+  register const uint64_t entry = ((uint64_t *) address_space->pml4)[i];
+
+  if (entry & PAGE_PRESENT)
+   release_page_table(entry & PAGE_ADDRESS_MASK, 2);
+ }
+
+ release_shared_mappings(address_space);
+ release_frame(address_space->pml4);
+ free_pcid(address_space->pcid);
+ kfree((uint64_t) address_space);
+}
+
+/*! Makes a copy of the page table an entry points to. The copy shares the
+    frames mapped. Writable pages are made copy-on-write in both tables
+    unless they are shared memory. The
+    entry pointing to the copy is stored in copy_entry.
+    \returns Non-zero if successful or zero if there is not enough memory.
+             The copy is then partially filled and holds references to the
+             frames it maps. */
+static int
+copy_page_table(register const uint64_t     entry
+                /*!< The entry pointing to the table. */,
+                register const unsigned int level
+                /*!< Zero if the table maps pages. */,
+                register uint64_t * const   copy_entry
+                /*!< Where to store the entry pointing to the copy. */)
+{
+ register uint64_t * const table = (uint64_t *) (entry & PAGE_ADDRESS_MASK);
+ register const uint64_t   copy = allocate_frame();
+ register int              i;
+
+ *copy_entry = 0;
+ if (0 == copy)
+  return 0;
+ clear_frame(copy);
+ *copy_entry = copy | (entry & ~PAGE_ADDRESS_MASK);
+
+ for (i = 0; i < 512; i++)
+ {
+  register uint64_t page = table[i];
+
+  if (0 == (page & PAGE_PRESENT))
+   continue;
+
+  /* 2 MB pages are shared like small pages. */
+  if (0 == level || (page & PAGE_LARGE))
+  {
+   if ((page & PAGE_WRITABLE) && 0 == (page & PAGE_SHARED))
+   {
+    page = (page & ~PAGE_WRITABLE) | PAGE_COPY_ON_WRITE;
+    table[i] = page;
+   }
+   reference_frame(page & PAGE_ADDRESS_MASK);
+   ((uint64_t *) copy)[i] = page;
+  }
+  else if (!copy_page_table(page, level-1, &((uint64_t *) copy)[i]))
+   return 0;
+ }
+
+ return 1;
+}
+
+/*! Invalidates the TLB entries of an address space on all processors. */
+static void
+flush_address_space(register struct address_space * const address_space)
+{
+ /* The other processors flush when they switch to the address space. */
+ lock_xchg64(&address_space->stale_CPUs, ~0ULL);
+
+ if (this_cpu_read(current_address_space) == address_space)
+  writeCr3(address_space->pml4 | address_space->pcid);
+}
+
+struct address_space *
+fork_address_space(register struct address_space * const address_space)
+{
+ register struct address_space * const copy = create_address_space();
+ register int                          i;
+ register int                          failed = 0;
+
+ if (0 == copy)
+  return 0;
+
+ for (i = 0; i < address_space->number_of_regions; i++)
+  copy->regions[i] = address_space->regions[i];
+ copy->number_of_regions = address_space->number_of_regions;
+ copy->heap = address_space->heap;
+ copy->huge_heap = address_space->huge_heap;
+ copy_shared_mappings(address_space, copy);
+
+ for (i = 1; i < 511 && !failed; i++)
+ {
+  register const uint64_t entry = ((uint64_t *) address_space->pml4)[i];
+
+  if ((entry & PAGE_PRESENT) &&
+      !copy_page_table(entry, 2, &((uint64_t *) copy->pml4)[i]))
+   failed = 1;
+ }
+
+ /* Writable entries have been made read-only. */
+ flush_address_space(address_space);
+
+ if (failed)
+ {
+  destroy_address_space(copy);
+  return 0;
+ }
+ return copy;
+}
+
+/*! Releases the frames mapped by a page table and the tables below it.
+    The tables are kept. */
+static void
+empty_page_table(register uint64_t * const   table,
+                 register const unsigned int level)
+{
+ register int i;
+
+ for (i = 0; i < 512; i++)
+ {
+  register const uint64_t entry = table[i];
+
+  if (0 == (entry & PAGE_PRESENT))
+   continue;
+
+  if (0 == level)
+  {
+   release_frame(entry & PAGE_ADDRESS_MASK);
+   table[i] = 0;
+  }
+  else if (entry & PAGE_LARGE)
+  {
+   release_large_frame(entry & PAGE_ADDRESS_MASK);
+   table[i] = 0;
+  }
+  else
+   empty_page_table((uint64_t *) (entry & PAGE_ADDRESS_MASK), level-1);
+ }
+}
+
+void
+empty_address_space(register struct address_space * const address_space)
+{
+ register int i;
+
+ for (i = 1; i < 511; i++)
+ {
+  register const uint64_t entry = ((uint64_t *) address_space->pml4)[i];
+
+  if (entry & PAGE_PRESENT)
+   empty_page_table((uint64_t *) (entry & PAGE_ADDRESS_MASK), 2);
+ }
+
+ release_shared_mappings(address_space);
+ initialize_user_regions(address_space);
+ flush_address_space(address_space);
+}
+
+/*! Finds the entry mapping an address in the page tables at a level. The
+    walk stops early at an entry mapping a 2 MB page.
+    \returns The entry or zero if a page table is missing and create is
+             zero or there is not enough memory. */
+static uint64_t *
+walk_page_table(register struct address_space * const address_space,
+                register const uint64_t               virtual_address,
+                register const int                    create,
+                register const unsigned int           last_level
+                /*!< Zero for page table entries, one for page directory
+                     entries. */)
+{
+ register uint64_t *     table = (uint64_t *) address_space->pml4;
+ register unsigned int   level;
+
+ for (level = 3; level > last_level; level--)
+ {
+  register uint64_t * const entry =
+   &table[(virtual_address>>(12+9*level)) & 0x1ff];
+
+  if ((*entry & PAGE_PRESENT) && (*entry & PAGE_LARGE))
+   return entry;
+
+  if (0 == (*entry & PAGE_PRESENT))
+  {
+   register uint64_t frame;
+
+   if (!create)
+    return 0;
+
+   frame = allocate_frame();
+   if (0 == frame)
+    return 0;
+   clear_frame(frame);
+
+   /* Access is restricted in the last level only. */
+   *entry = frame | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER;
+  }
+
+  table = (uint64_t *) (*entry & PAGE_ADDRESS_MASK);
+ }
+
+ return &table[(virtual_address>>(12+9*last_level)) & 0x1ff];
+}
+
+uint64_t *
+find_page_table_entry(register struct address_space * const address_space,
+                      register const uint64_t               virtual_address,
+                      register const int                    create)
+{
+ return walk_page_table(address_space, virtual_address, create, 0);
+}
+
+/*! Maps a cleared 2 MB frame at a 2 MB aligned user address.
+    \returns ALL_OK or ERROR if a page table already covers the address or
+             there is no free 2 MB frame. */
+static long
+map_large_page(register struct address_space * const address_space,
+               register const uint64_t               virtual_address,
+               register const uint64_t               flags)
+{
+ register uint64_t * const entry =
+  walk_page_table(address_space, virtual_address, 1, 1);
+ register uint64_t         frame;
+ register uint64_t         offset;
+
+ if (0 == entry || (*entry & PAGE_PRESENT))
+  return ERROR;
+
+ frame = allocate_large_frame();
+ if (0 == frame)
+  return ERROR;
+ for (offset = 0; offset < AMD64_LARGE_PAGE_SIZE; offset += 4096)
+  clear_frame(frame + offset);
+
+ *entry = frame | flags | PAGE_LARGE | PAGE_PRESENT | PAGE_USER;
+ return ALL_OK;
+}
+
+long
+map_user_page(register struct address_space * const address_space,
+              register const uint64_t               virtual_address,
+              register const uint64_t               frame,
+              register const uint64_t               flags)
+{
+ register uint64_t * const entry =
+  find_page_table_entry(address_space, virtual_address, 1);
+
+ /* A 2 MB page already maps the address. */
+ if (0 == entry || (*entry & PAGE_LARGE))
+  return ERROR;
+
+ *entry = frame | flags | PAGE_PRESENT | PAGE_USER;
+ return ALL_OK;
+}
+
+void
+unmap_user_pages(register struct address_space * const address_space,
+                 register const uint64_t               start,
+                 register const uint64_t               end)
+{
+ register uint64_t address;
+
+ for (address = start; address < end; address += 4096)
+ {
+  register uint64_t * const entry =
+   find_page_table_entry(address_space, address, 0);
+
+  if (0 == entry || 0 == (*entry & PAGE_PRESENT))
+   continue;
+
+  if (0 == (*entry & PAGE_LARGE))
+  {
+   release_frame(*entry & PAGE_ADDRESS_MASK);
+   *entry = 0;
+  }
+  else if (0 == (address & (AMD64_LARGE_PAGE_SIZE - 1)) &&
+           address + AMD64_LARGE_PAGE_SIZE <= end)
+  {
+   release_large_frame(*entry & PAGE_ADDRESS_MASK);
+   *entry = 0;
+   address += AMD64_LARGE_PAGE_SIZE - 4096;
+  }
+ }
+
+ flush_address_space(address_space);
+}
+
+long
+move_break(register struct address_space * const address_space,
+           register struct user_arena * const    arena,
+           register const int64_t                increment)
+{
+ register struct vm_region * const region =
+  &address_space->regions[arena->region];
+ register const uint64_t           old_break = arena->brk;
+ register const uint64_t           page_size =
+  (region->flags & PAGE_LARGE) ? AMD64_LARGE_PAGE_SIZE : 4096;
+ register uint64_t                 end;
+
+ if ((increment < 0 &&
+      0 - (uint64_t) increment > old_break - arena->start) ||
+     (increment > 0 && (uint64_t) increment > arena->limit - old_break))
+  return ERROR;
+
+ arena->brk = old_break + increment;
+ end = (arena->brk + page_size - 1) & ~(page_size - 1);
+ if (end < region->end)
+  unmap_user_pages(address_space, end, region->end);
+ region->end = end;
+ return old_break;
+}
+
+/*! \returns Non-zero iff a writable region holds a range of addresses. */
+static int
+in_writable_region(register const struct address_space * const address_space,
+                   register const uint64_t                     start,
+                   register const uint64_t                     end)
+{
+ register uint64_t i;
+
+ for (i = 0; i < address_space->number_of_regions; i++)
+ {
+  register const struct vm_region * const region = &address_space->regions[i];
+
+  if (start >= region->start && end <= region->end &&
+      (region->flags & PAGE_WRITABLE))
+   return 1;
+ }
+
+ return 0;
+}
+
+long
+take_user_pages(register struct address_space * const address_space,
+                register const uint64_t               address,
+                register const uint64_t               number_of_pages,
+                register uint64_t * const             frames)
+{
+ register const uint64_t end = address + (number_of_pages << 12);
+ register uint64_t       i;
+
+ if (!in_writable_region(address_space, address, end))
+  return ERROR;
+
+ for (i = 0; i < number_of_pages; i++)
+ {
+  register const uint64_t * const entry =
+   find_page_table_entry(address_space, address + (i << 12), 0);
+
+  if (0 == entry || 0 == (*entry & PAGE_PRESENT) ||
+      (*entry & (PAGE_SHARED | PAGE_LARGE)))
+   return ERROR;
+ }
+
+ for (i = 0; i < number_of_pages; i++)
+ {
+  register uint64_t * const entry =
+   find_page_table_entry(address_space, address + (i << 12), 0);
+
+  frames[i] = *entry & PAGE_ADDRESS_MASK;
+  *entry = 0;
+ }
+
+ flush_address_space(address_space);
+ return ALL_OK;
+}
+
+long
+give_user_pages(register struct address_space * const address_space,
+                register const uint64_t               address,
+                register const uint64_t               number_of_pages,
+                register const uint64_t * const       frames)
+{
+ register const uint64_t end = address + (number_of_pages << 12);
+ register uint64_t       i;
+
+ if (!in_writable_region(address_space, address, end))
+  return ERROR;
+
+ /* Create the page tables first so that nothing can fail while the
+    frames are mapped. */
+ for (i = 0; i < number_of_pages; i++)
+ {
+  register const uint64_t * const entry =
+   find_page_table_entry(address_space, address + (i << 12), 1);
+
+  if (0 == entry || (*entry & PAGE_LARGE))
+   return ERROR;
+ }
+
+ for (i = 0; i < number_of_pages; i++)
+ {
+  register uint64_t * const entry =
+   find_page_table_entry(address_space, address + (i << 12), 0);
+  register const uint64_t   access =
+   (1 == frame_reference_count(frames[i])) ?
+   PAGE_WRITABLE : PAGE_COPY_ON_WRITE;
+
+  if (*entry & PAGE_PRESENT)
+   release_frame(*entry & PAGE_ADDRESS_MASK);
+  *entry = frames[i] | access | PAGE_NO_EXECUTE | PAGE_PRESENT | PAGE_USER;
+ }
+
+ flush_address_space(address_space);
+ return ALL_OK;
+}
+
+long
+add_demand_zero_region(register struct address_space * const address_space,
+                       register const uint64_t               start,
+                       register const uint64_t               end,
+                       register const uint64_t               flags)
+{
+ register struct vm_region * region;
+
+ if (AMD64_MAX_NUMBER_OF_REGIONS == address_space->number_of_regions)
+  return ERROR;
+
+ region = &address_space->regions[address_space->number_of_regions++];
+ region->start = start;
+ region->end = end;
+ region->flags = flags;
+ region->limit = start;
+ return ALL_OK;
+}
+
+long
+add_stack_region(register struct address_space * const address_space,
+                 register const uint64_t               top,
+                 register const uint64_t               size)
+{
+ if (ALL_OK != add_demand_zero_region(address_space, top - 4096, top,
+                                      PAGE_WRITABLE | PAGE_NO_EXECUTE))
+  return ERROR;
+
+ address_space->regions[address_space->number_of_regions - 1].limit =
+  top - size;
+ return ALL_OK;
+}
+
+long
+handle_page_fault(register struct address_space * const address_space,
+                  register const uint64_t               address,
+                  register const uint64_t               error_code)
+{
+ register const uint64_t page = address & ~0xfffULL;
+ register uint64_t *     entry;
+ register uint64_t       i;
+
+ if (page < USER_IMAGE_BASE || page >= USER_SPACE_END)
+  return ERROR;
+
+ entry = find_page_table_entry(address_space, page, 0);
+
+ if (entry && (*entry & PAGE_PRESENT))
+ {
+  register const uint64_t frame = *entry & PAGE_ADDRESS_MASK;
+  register const int      large = 0 != (*entry & PAGE_LARGE);
+  register uint64_t       new_frame;
+
+  /* The entry may have been fixed up after the TLB entry was loaded. */
+  if ((0 == (error_code & 2) || (*entry & PAGE_WRITABLE)) &&
+      (0 == (error_code & 0x10) || 0 == (*entry & PAGE_NO_EXECUTE)))
+  {
+   invlpg(page);
+   return ALL_OK;
+  }
+
+  if (0 == (error_code & 2) || 0 == (*entry & PAGE_COPY_ON_WRITE))
+   return ERROR;
+
+  if (1 == frame_reference_count(frame))
+  {
+   /* The last reference. Take the frame over. */
+   *entry = (*entry & ~PAGE_COPY_ON_WRITE) | PAGE_WRITABLE;
+  }
+  else
+  {
+   new_frame = large ? allocate_large_frame() : allocate_frame();
+   if (0 == new_frame)
+    return ERROR;
+
+   for (i = 0; i < (large ? AMD64_LARGE_PAGE_SIZE : 4096) / 8; i++)
+    ((uint64_t *) new_frame)[i] = ((uint64_t *) frame)[i];
+
+   *entry = new_frame |
+            ((*entry & ~(PAGE_ADDRESS_MASK | PAGE_COPY_ON_WRITE)) |
+             PAGE_WRITABLE);
+   if (large)
+    release_large_frame(frame);
+   else
+    release_frame(frame);
+
+   /* Processors the process ran on before may still map the old frame.
+      They flush when they switch to the address space. */
+   lock_xchg64(&address_space->stale_CPUs, ~0ULL);
+  }
+  invlpg(page);
+  return ALL_OK;
+ }
+
+ /* Not mapped. Look for a demand-zero region holding the page. */
+ for (i = 0; i < address_space->number_of_regions; i++)
+ {
+  register struct vm_region * const region = &address_space->regions[i];
+
+  /* Grow a stack region down to the page if the page is close enough to
+     the stack. */
+  if (page < region->start && page >= region->limit &&
+      page + AMD64_STACK_GROWTH_WINDOW >= region->start)
+   region->start = page;
+
+  if (page >= region->start && page < region->end)
+  {
+   register const uint64_t large_page =
+    page & ~(AMD64_LARGE_PAGE_SIZE - 1);
+   register uint64_t       frame;
+
+   /* Use a 2 MB page if the region asks for it and one fits. Otherwise,
+      or if there is no free 2 MB frame, fall back to a small page. */
+   if ((region->flags & PAGE_LARGE) &&
+       large_page >= region->start &&
+       large_page + AMD64_LARGE_PAGE_SIZE <= region->end &&
+       ALL_OK == map_large_page(address_space, large_page, region->flags))
+    return ALL_OK;
+
+   frame = allocate_frame();
+   if (0 == frame)
+    return ERROR;
+   clear_frame(frame);
+
+   if (ALL_OK != map_user_page(address_space, page, frame,
+                               region->flags & ~PAGE_LARGE))
+   {
+    release_frame(frame);
+    return ERROR;
+   }
+   return ALL_OK;
+  }
+ }
+
+ return ERROR;
+}
+
+void
+switch_address_space(register struct address_space * const address_space)
+{
+ register struct address_space ** const current =
+  this_cpu_ptr(&current_address_space);
+ register uint64_t                      cr3;
+
+ if (*current == address_space)
+  return;
+ *current = address_space;
+
+ cr3 = address_space->pml4 | address_space->pcid;
+
+ if (address_space->pcid)
+ {
+  register const uint64_t processor_bit = 1ULL << get_processor_index();
+
+  if (address_space->stale_CPUs & processor_bit)
+  {
+   /* Flush the entries tagged with the PCID while loading cr3. */
+   register uint64_t stale = address_space->stale_CPUs;
+
+   while (1)
+   {
+    register const uint64_t old_stale =
+     lock_cmpxchg64(&address_space->stale_CPUs, stale,
+                    stale & ~processor_bit);
+
+    if (old_stale == stale)
+     break;
+    stale = old_stale;
+   }
+  }
+  else
+  {
+   /* The TLB entries tagged with the PCID are valid. Keep them. */
+   cr3 |= 1ULL<<63;
+  }
+ }
+
+ writeCr3(cr3);
+}
@@ -1,24 +1,55 @@
 /*! \file
  * 	\brief The first user program - it creates a processe and then waits
  *             for it to finish. The entire process is repeated over and over.
+ *             When built with RUN_TESTS set it first runs the test programs
+ *             once.
  *
  */
 
 #include <scwrapper.h>
 
+#if RUN_TESTS
+/*! Runs a test program and waits for it. The test program prints each
+    check that fails, and its exit status is the number of failures. */
+static void
+run_test(const int executable)
+{
+ long pid;
+ long status;
+
+ pid = createprocess(executable);
+ if (pid < 0 || ALL_OK != wait(pid, &status))
+  prints("Process 0: Could not run a test program.\n");
+ else if (0 != status)
+  prints("Process 0: A test program failed.\n");
+}
+#endif
+
 int
 main(int argc, char* argv[])
 {
+#if RUN_TESTS
+ run_test(3);
+ run_test(4);
+ run_test(5);
+#endif
+
  while(1)
  {
+  long pid;
+  long status;
+
   prints("Process 0: Trying to start process 1.\n");
   /* Try to create and run process 1. */
-  if (0 != createprocess(1))
+  pid = createprocess(1);
+  if (pid < 0)
   {
    prints("createprocess failed.\n");
   }
   else
   {
+   /* Sleep until process 1 has terminated. */
+   wait(pid, &status);
    prints("Process 0: Process 1 terminated.\n");
   }
   //debugger();
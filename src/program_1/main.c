@@ -8,11 +8,18 @@
 int
 main(int argc, char* argv[])
 {
+ long pid;
+ long status;
+
  prints("Process 1: Trying to start process 2.\n");
   /* Try to create and run process 2. */
- if (0 != createprocess(2))
+ pid = createprocess(2);
+ if (pid < 0)
  {
   prints("createprocess failed.\n");
+  return 1;
  }
+ wait(pid, &status);
  prints("Process 1: Process 2 terminated.\n");
+ return 0;
 }
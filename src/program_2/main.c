@@ -9,4 +9,5 @@ int
 main(int argc, char* argv[])
 {
  prints("Ta da!\n");
+ return 0;
 }
@@ -0,0 +1,242 @@
+/*! \file
+ * 	\brief A test of the process system calls. It prints a line for each
+ *             check that fails.
+ *
+ */
+
+#define TEST_NAME "Process 3"
+#include <testing.h>
+
+/*! Value written to the memory of a test before fork. */
+#define BEFORE_FORK 1
+
+/*! Value written by the copy after fork. */
+#define IN_COPY     2
+
+/*! Value written by the parent after fork. */
+#define IN_PARENT   3
+
+/*! Number of processes test_createprocess creates, more than the default
+    size of a process pool. */
+#define NUMBER_OF_CREATED 10
+
+/*! An address in user space where nothing is mapped. */
+#define UNMAPPED_ADDRESS 0x0000600000000000UL
+
+/*! Exit status of the children in test_wait. */
+#define EXIT_STATUS 7
+
+/*! Number of processes test_process_ids starts one after the other. */
+#define NUMBER_OF_REUSES 8
+
+/*! Number of processes test_reclaim starts one after the other, more
+    than the process table holds. */
+#define NUMBER_OF_RECLAIMED 300
+
+/*! Number of processes in the batch test_createprocesses creates. */
+#define BATCH_SIZE 4
+
+/*! A variable in the bss. */
+static volatile long bss_value;
+
+/*! Fork gives the copy the memory of the parent at the time of the call.
+    Afterwards each process writes pages of its own in the bss, on the
+    stack and in allocated blocks. */
+static void
+test_fork(void)
+{
+ volatile long          stack_value = BEFORE_FORK;
+ volatile long * const  block = (volatile long *) alloc(sizeof(long));
+ long                   pid;
+ long                   other_pid;
+
+ check(ERROR != (long) block, "allocate a block to fork");
+ if (ERROR == (long) block)
+  return;
+ bss_value = BEFORE_FORK;
+ *block = BEFORE_FORK;
+
+ pid = start_child();
+ if (0 == pid)
+ {
+  check(BEFORE_FORK == bss_value && BEFORE_FORK == stack_value &&
+        BEFORE_FORK == *block, "the copy starts with the memory of the parent");
+  bss_value = IN_COPY;
+  stack_value = IN_COPY;
+  *block = IN_COPY;
+  delay();
+  check(IN_COPY == bss_value && IN_COPY == stack_value && IN_COPY == *block,
+        "the copy keeps its own writes");
+  terminate(failures);
+ }
+
+ check(pid > 0, "fork returns the process id of the copy");
+ bss_value = IN_PARENT;
+ stack_value = IN_PARENT;
+ *block = IN_PARENT;
+ delay();
+ check(IN_PARENT == bss_value && IN_PARENT == stack_value &&
+       IN_PARENT == *block, "the parent keeps its own writes");
+ check(ALL_OK == free((void *) block), "free a block after fork");
+
+ /* Every copy gets a process id of its own. */
+ other_pid = fork();
+ if (0 == other_pid)
+  terminate(0);
+ check(other_pid > 0 && other_pid != pid,
+       "copies get distinct process ids");
+ join_child(pid);
+ join_child(other_pid);
+}
+
+/*! Exec of an executable that does not exist fails and returns to the
+    caller. A copy made by fork can run another program. */
+static void
+test_exec(void)
+{
+ long pid;
+
+ check(ERROR == exec(-1), "exec of a negative executable fails");
+ check(ERROR == exec(1000), "exec of a missing executable fails");
+
+ /* Program 2 exits with status zero. */
+ pid = start_child();
+ if (0 == pid)
+ {
+  exec(2);
+  check(0, "exec of program 2 returns");
+  terminate(failures);
+ }
+ join_child(pid);
+}
+
+/*! Creating more processes than a pool holds takes the prebuilt ones and
+    then builds the rest on demand. */
+static void
+test_createprocess(void)
+{
+ long pids[NUMBER_OF_CREATED];
+ int  i;
+
+ for (i = 0; i < NUMBER_OF_CREATED; i++)
+ {
+  pids[i] = createprocess(2);
+  check(pids[i] > 0, "createprocess of program 2");
+ }
+ for (i = 0; i < NUMBER_OF_CREATED; i++)
+  if (pids[i] > 0)
+   join_child(pids[i]);
+ check(ERROR == createprocess(1000),
+       "createprocess of a missing executable fails");
+}
+
+/*! A batch gets distinct process ids. A buffer for the ids that cannot be
+    written fails the whole batch. */
+static void
+test_createprocesses(void)
+{
+ long pids[BATCH_SIZE];
+ int  i, j;
+
+ check(BATCH_SIZE == createprocesses(2, BATCH_SIZE, pids,
+                                     CREATEPROCESSES_SPREAD),
+       "createprocesses starts the whole batch");
+ for (i = 0; i < BATCH_SIZE; i++)
+  for (j = i + 1; j < BATCH_SIZE; j++)
+   check(pids[i] != pids[j], "a batch gets distinct process ids");
+ for (i = 0; i < BATCH_SIZE; i++)
+  join_child(pids[i]);
+
+ check(ERROR == createprocesses(2, 0, pids, 0),
+       "createprocesses of an empty batch fails");
+ check(ERROR == createprocesses(2, BATCH_SIZE, (long *) UNMAPPED_ADDRESS, 0),
+       "createprocesses with an unmapped buffer fails");
+ check(ERROR == createprocesses(2, BATCH_SIZE, (long *) -64, 0),
+       "createprocesses with a kernel buffer fails");
+}
+
+/*! Wait returns the exit status of a child once. It fails for processes
+    that are not children of the caller and for a status address that
+    cannot be written. */
+static void
+test_wait(void)
+{
+ long pid;
+ long status;
+
+ pid = fork();
+ if (0 == pid)
+  terminate(EXIT_STATUS);
+ check(ALL_OK == wait(pid, &status) && EXIT_STATUS == status,
+       "wait returns the exit status of a child");
+ check(ERROR == wait(pid, &status), "a child is waited for only once");
+ check(ERROR == wait(0, &status), "wait for a process that is not a child");
+
+ /* The child stays waitable after a failed wait. */
+ pid = fork();
+ if (0 == pid)
+  terminate(EXIT_STATUS);
+ check(ERROR == wait(pid, (long *) UNMAPPED_ADDRESS),
+       "wait with an unmapped status address fails");
+ check(ALL_OK == wait(pid, &status) && EXIT_STATUS == status,
+       "wait again after a failed wait");
+}
+
+/*! A process entry that is freed and reused gets a new process id, so an
+    old id never names a later process. */
+static void
+test_process_ids(void)
+{
+ long pids[NUMBER_OF_REUSES];
+ int  i, j;
+
+ for (i = 0; i < NUMBER_OF_REUSES; i++)
+ {
+  pids[i] = fork();
+  if (0 == pids[i])
+   terminate(0);
+  join_child(pids[i]);
+  delay();
+ }
+ for (i = 0; i < NUMBER_OF_REUSES; i++)
+  for (j = i + 1; j < NUMBER_OF_REUSES; j++)
+   check(pids[i] != pids[j], "reused process entries get new process ids");
+}
+
+/*! Terminated processes are freed, so more processes than the process
+    table holds can be started one after the other. */
+static void
+test_reclaim(void)
+{
+ long pid;
+ int  i;
+
+ for (i = 0; i < NUMBER_OF_RECLAIMED; i++)
+ {
+  pid = fork();
+  if (0 == pid)
+   terminate(0);
+  check(pid > 0, "fork after many processes have terminated");
+  if (pid <= 0)
+   return;
+  join_child(pid);
+ }
+}
+
+int
+main(int argc, char* argv[])
+{
+ prints("Process 3: Testing the process system calls.\n");
+
+ test_fork();
+ test_exec();
+ test_createprocess();
+ test_createprocesses();
+ test_wait();
+ test_process_ids();
+ test_reclaim();
+
+ if (0 == failures)
+  prints("Process 3: All checks passed.\n");
+ return failures;
+}
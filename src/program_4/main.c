@@ -0,0 +1,211 @@
+/*! \file
+ * 	\brief A test of the memory system calls. It prints a line for each
+ *             check that fails.
+ *
+ */
+
+#define TEST_NAME "Process 4"
+#include <testing.h>
+
+/*! Number of blocks test_heap allocates. */
+#define NUMBER_OF_BLOCKS 8
+
+/*! Number of longs in each block of test_heap. */
+#define BLOCK_LONGS      1000
+
+/*! More bytes than the heap of a process holds. */
+#define TOO_LARGE        0x80000000UL
+
+/*! Size of the block test_huge_heap allocates. It spans at least two
+    2 MB pages. */
+#define HUGE_BLOCK_BYTES  0x400000UL
+
+/*! Number of longs in the block of test_huge_heap. */
+#define HUGE_BLOCK_LONGS  ((long) (HUGE_BLOCK_BYTES / sizeof(long)))
+
+/*! Number of longs in a 4 KB page. */
+#define PAGE_LONGS        512
+
+/*! Bytes of stack used by each call of use_stack. */
+#define STACK_FRAME_BYTES 4096
+
+/*! Depth of the calls test_stack makes. It uses about 1 MB of stack. */
+#define STACK_DEPTH       256
+
+/*! An address in user space where nothing is mapped. */
+#define UNMAPPED_ADDRESS  0x0000600000000000UL
+
+/*! Blocks do not overlap, start out zero and are released on free. Their
+    space is handed out again. */
+static void
+test_heap(void)
+{
+ long * blocks[NUMBER_OF_BLOCKS];
+ long   stack_value;
+ long * again;
+ int    i, j;
+
+ for (i = 0; i < NUMBER_OF_BLOCKS; i++)
+ {
+  blocks[i] = (long *) alloc(BLOCK_LONGS * sizeof(long));
+  check(ERROR != (long) blocks[i], "allocate a block");
+  if (ERROR == (long) blocks[i])
+   return;
+ }
+
+ for (i = 0; i < NUMBER_OF_BLOCKS; i++)
+  for (j = 0; j < BLOCK_LONGS; j++)
+  {
+   check(0 == blocks[i][j], "a new heap starts out zero");
+   blocks[i][j] = i;
+  }
+ for (i = 0; i < NUMBER_OF_BLOCKS; i++)
+  for (j = 0; j < BLOCK_LONGS; j++)
+   check(i == blocks[i][j], "blocks do not overlap");
+
+ check(ALL_OK == free(blocks[1]), "free a block");
+ again = (long *) alloc(BLOCK_LONGS * sizeof(long));
+ check(again == blocks[1], "the space of a freed block is handed out again");
+ if (ERROR != (long) again)
+  check(ALL_OK == free(again), "free a reallocated block");
+ for (i = 0; i < NUMBER_OF_BLOCKS; i++)
+  if (1 != i)
+   check(ALL_OK == free(blocks[i]), "free a block");
+
+ check(ERROR == (long) alloc(TOO_LARGE),
+       "allocate a block larger than the heap fails");
+ check(ERROR == free(&stack_value), "free of a stack address fails");
+}
+
+/*! The copy made by fork gets the blocks of the parent and then a heap of
+    its own. */
+static void
+test_heap_fork(void)
+{
+ long * const block = (long *) alloc(sizeof(long));
+ long         pid;
+
+ check(ERROR != (long) block, "allocate a block to fork");
+ if (ERROR == (long) block)
+  return;
+ *block = 1;
+
+ pid = start_child();
+ if (0 == pid)
+ {
+  check(1 == *block, "the copy gets the blocks of the parent");
+  *block = 2;
+  check(ALL_OK == free(block), "the copy frees a block of the parent");
+  terminate(failures);
+ }
+ join_child(pid);
+ check(1 == *block, "a block of the parent survives its free in the copy");
+ check(ALL_OK == free(block), "free a block after fork");
+}
+
+/*! Uses about depth times STACK_FRAME_BYTES of stack. Each frame touches
+    every page of its buffer, from the top down.
+    \returns The sum of the values written, which depends on every frame. */
+static long
+use_stack(const long depth)
+{
+ volatile char buffer[STACK_FRAME_BYTES];
+ long          i;
+
+ for (i = STACK_FRAME_BYTES - 1; i >= 0; i -= 1024)
+  buffer[i] = 1;
+ if (0 == depth)
+  return buffer[0];
+ return buffer[0] + use_stack(depth - 1);
+}
+
+/*! Runs a child and checks that it was terminated for an exception. */
+static void
+expect_fault(const long pid, const char * const what)
+{
+ long status;
+
+ check(pid > 0 && ALL_OK == wait(pid, &status) && ERROR == status, what);
+}
+
+/*! The stack grows on demand. A process that runs off its stack or
+    touches unmapped memory is terminated, and the tests go on. */
+static void
+test_stack(void)
+{
+ long pid;
+
+ check(STACK_DEPTH + 1 == use_stack(STACK_DEPTH), "grow the stack");
+
+ pid = fork();
+ if (0 == pid)
+ {
+  use_stack(-1);
+  terminate(0);
+ }
+ expect_fault(pid, "a process that runs off its stack is terminated");
+
+ pid = fork();
+ if (0 == pid)
+ {
+  *(volatile long *) UNMAPPED_ADDRESS = 0;
+  terminate(0);
+ }
+ expect_fault(pid, "a process that touches unmapped memory is terminated");
+}
+
+/*! Blocks of the huge heap start out zero and are freed with free. The
+    copy made by fork writes copies of the 2 MB pages. */
+static void
+test_huge_heap(void)
+{
+ long * const block = (long *) alloc_huge(HUGE_BLOCK_BYTES);
+ long * const small = (long *) alloc(sizeof(long));
+ long         pid;
+ long         i;
+
+ check(ERROR != (long) block, "allocate a huge block");
+ check(ERROR != (long) small, "allocate a block next to a huge block");
+ if (ERROR == (long) block || ERROR == (long) small)
+  return;
+
+ for (i = 0; i < HUGE_BLOCK_LONGS; i += PAGE_LONGS)
+ {
+  check(0 == block[i], "a huge block starts out zero");
+  block[i] = i;
+ }
+ *small = 1;
+
+ pid = start_child();
+ if (0 == pid)
+ {
+  for (i = 0; i < HUGE_BLOCK_LONGS; i += PAGE_LONGS)
+  {
+   check(i == block[i], "the copy gets the huge block of the parent");
+   block[i] = -1;
+  }
+  terminate(failures);
+ }
+ join_child(pid);
+
+ for (i = 0; i < HUGE_BLOCK_LONGS; i += PAGE_LONGS)
+  check(i == block[i], "a huge block survives the writes of the copy");
+ check(1 == *small, "the heaps do not overlap");
+ check(ALL_OK == free(block), "free a huge block");
+ check(ALL_OK == free(small), "free a block after a huge block");
+}
+
+int
+main(int argc, char* argv[])
+{
+ prints("Process 4: Testing the memory system calls.\n");
+
+ test_heap();
+ test_heap_fork();
+ test_stack();
+ test_huge_heap();
+
+ if (0 == failures)
+  prints("Process 4: All checks passed.\n");
+ return failures;
+}
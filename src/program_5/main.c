@@ -0,0 +1,580 @@
+/*! \file
+ * 	\brief A test of the system calls that pass data between processes.
+ *             In each test a forked producer feeds the parent. It prints a
+ *             line for each check that fails.
+ *
+ */
+
+#define TEST_NAME "Process 5"
+#include <testing.h>
+
+/*! Size of a page. */
+#define PAGE_SIZE          4096
+
+/*! Number of words written through shared memory. */
+#define NUMBER_OF_WORDS    100
+
+/*! Number of small messages sent. It exceeds the capacity of a channel,
+    so the producer blocks. */
+#define NUMBER_OF_MESSAGES 40
+
+/*! Number of values pushed through the ring. */
+#define NUMBER_OF_VALUES   1000
+
+/*! Number of slots of the ring. */
+#define RING_CAPACITY      8
+
+/*! Number of bytes written to the pipe. It exceeds the buffer of a pipe,
+    so the producer blocks. */
+#define PIPE_BYTES         10000
+
+/*! Number of times the producer ups the semaphore. */
+#define NUMBER_OF_UPS      5
+
+/*! Number of events the consumer takes from a poll set at once. */
+#define NUMBER_OF_EVENTS   4
+
+/*! Number of waits on a poll set after which the test gives up. */
+#define MAXIMUM_WAITS      100
+
+/*! Cookies of the handles registered in the poll set. */
+#define COOKIE_PIPE        1
+#define COOKIE_SEMAPHORE   2
+#define COOKIE_TIMER       3
+
+/*! Number of handles test_handles holds at once, more than fit in the
+    handle table a process starts with. */
+#define NUMBER_OF_HANDLES  40
+
+/*! An address in user space where nothing is mapped. */
+#define UNMAPPED_ADDRESS   0x0000600000000000UL
+
+/*! Key of the shared memory object test_shared_memory_key opens. */
+#define SHARED_MEMORY_KEY  0x46656e6978UL
+
+/*! The page the producer moves through the channel. */
+static unsigned char send_page[PAGE_SIZE]
+ __attribute__((aligned (PAGE_SIZE)));
+
+/*! The page replaced by the page received. */
+static unsigned char receive_page[PAGE_SIZE]
+ __attribute__((aligned (PAGE_SIZE)));
+
+/*! The producer fills words of shared memory and then sets and wakes the
+    first word. The consumer waits for the first word. Shared pages stay
+    shared after fork instead of being copied on write. */
+static void
+test_shared_memory(void)
+{
+ const long               handle = createsharedmemory(0, PAGE_SIZE);
+ volatile unsigned long * words;
+ unsigned long            sum = 0;
+ long                     pid;
+ long                     i;
+
+ check(handle >= 0, "create shared memory");
+ if (handle < 0)
+  return;
+ words = (volatile unsigned long *) mapsharedmemory(handle);
+ check(ERROR != (long) words, "map shared memory");
+ if (ERROR == (long) words)
+ {
+  close(handle);
+  return;
+ }
+ check(0 == words[0], "shared memory starts out zero");
+
+ pid = start_child();
+ if (0 == pid)
+ {
+  /* Let the consumer wait first. */
+  delay();
+  for (i = 1; i <= NUMBER_OF_WORDS; i++)
+   words[i] = i;
+  __asm volatile("mfence" : : : "memory");
+  words[0] = 1;
+  check(ALL_OK == sharedwake(&words[0]), "wake the shared word");
+  terminate(failures);
+ }
+
+ while (0 == words[0])
+  sharedwait(&words[0], 0);
+ for (i = 1; i <= NUMBER_OF_WORDS; i++)
+  sum += words[i];
+ check(NUMBER_OF_WORDS * (NUMBER_OF_WORDS + 1) / 2 == sum,
+       "read the words written through shared memory");
+ join_child(pid);
+
+ check(ALL_OK == unmap((void *) words), "unmap shared memory");
+ check(ERROR == unmap((void *) words), "unmap shared memory twice fails");
+ check(ALL_OK == close(handle), "close shared memory");
+ check(ERROR == close(handle), "close a handle twice fails");
+}
+
+/*! Processes that create shared memory with the same key share the
+    object, even though it was created after fork. */
+static void
+test_shared_memory_key(void)
+{
+ volatile unsigned long * words;
+ long                     handle;
+ long                     pid;
+
+ pid = start_child();
+ if (0 == pid)
+ {
+  handle = createsharedmemory(SHARED_MEMORY_KEY, PAGE_SIZE);
+  check(handle >= 0, "open shared memory by key");
+  if (handle >= 0)
+  {
+   words = (volatile unsigned long *) mapsharedmemory(handle);
+   check(ERROR != (long) words, "map shared memory opened by key");
+   if (ERROR != (long) words)
+   {
+    while (0 == words[0])
+     delay();
+    words[1] = words[0] + 1;
+    unmap((void *) words);
+   }
+   close(handle);
+  }
+  terminate(failures);
+ }
+
+ handle = createsharedmemory(SHARED_MEMORY_KEY, PAGE_SIZE);
+ check(handle >= 0, "create shared memory with a key");
+ if (handle < 0)
+  return;
+ words = (volatile unsigned long *) mapsharedmemory(handle);
+ check(ERROR != (long) words, "map shared memory created with a key");
+ if (ERROR != (long) words)
+ {
+  words[0] = 1;
+  while (0 == words[1])
+   delay();
+  check(2 == words[1], "processes share memory by key");
+  unmap((void *) words);
+ }
+ join_child(pid);
+ close(handle);
+}
+
+/*! The producer moves a page through a channel and then sends more
+    messages than the channel holds. */
+static void
+test_channel(void)
+{
+ const long             channel = createchannel(0);
+ struct channel_message message;
+ unsigned long          value;
+ char                   data[8];
+ long                   pid;
+ long                   i;
+ int                    same;
+
+ check(channel >= 0, "create a channel");
+ if (channel < 0)
+  return;
+
+ pid = start_child();
+ if (0 == pid)
+ {
+  for (i = 0; i < PAGE_SIZE; i++)
+   send_page[i] = (unsigned char) i;
+  message.data = "page";
+  message.length = 5;
+  message.pages = send_page;
+  message.number_of_pages = 1;
+  check(ALL_OK == send(channel, &message), "send a message with a page");
+  check(0 == send_page[1], "a page which was sent reads as zeros");
+
+  for (value = 0; value < NUMBER_OF_MESSAGES; value++)
+  {
+   message.data = &value;
+   message.length = sizeof(value);
+   message.pages = 0;
+   message.number_of_pages = 0;
+   check(ALL_OK == send(channel, &message), "send a message");
+  }
+  close(channel);
+  terminate(failures);
+ }
+
+ message.data = data;
+ message.length = sizeof(data);
+ message.pages = receive_page;
+ message.number_of_pages = 1;
+ check(ALL_OK == receive(channel, &message) && 5 == message.length &&
+       1 == message.number_of_pages, "receive a message with a page");
+ check('p' == data[0] && 'a' == data[1] && 'g' == data[2] &&
+       'e' == data[3] && 0 == data[4], "the bytes of the message");
+ for (same = 1, i = 0; i < PAGE_SIZE; i++)
+  same = same && (unsigned char) i == receive_page[i];
+ check(same, "the page moved with the message");
+
+ /* Let the producer fill the channel and block. */
+ delay();
+ for (i = 0; i < NUMBER_OF_MESSAGES; i++)
+ {
+  message.data = &value;
+  message.length = sizeof(value);
+  message.pages = 0;
+  message.number_of_pages = 0;
+  check(ALL_OK == receive(channel, &message) && i == value,
+        "receive the messages in order");
+ }
+ join_child(pid);
+
+ check(ERROR == send(channel, (struct channel_message *) UNMAPPED_ADDRESS),
+       "send with an unmapped descriptor fails");
+ message.data = (void *) UNMAPPED_ADDRESS;
+ message.length = sizeof(value);
+ check(ERROR == send(channel, &message),
+       "send of unmapped bytes fails");
+
+ check(ALL_OK == close(channel), "close the channel");
+ check(ERROR == receive(channel, &message),
+       "receive through a closed handle fails");
+}
+
+/*! The producer pushes more values than the ring holds, the consumer
+    starts late and then waits for each value. */
+static void
+test_ring(void)
+{
+ const long         handle = createring(0, RING_CAPACITY);
+ struct spsc_ring * ring;
+ unsigned long      value;
+ unsigned long      expected = 1;
+ long               pid;
+
+ check(handle >= 0, "create a ring");
+ if (handle < 0)
+  return;
+ ring = (struct spsc_ring *) mapsharedmemory(handle);
+ check(ERROR != (long) ring, "map the ring");
+ if (ERROR == (long) ring)
+ {
+  close(handle);
+  return;
+ }
+
+ pid = start_child();
+ if (0 == pid)
+ {
+  for (value = 1; value <= NUMBER_OF_VALUES; value++)
+   ring_push(ring, value);
+  /* Zero ends the stream. */
+  ring_push(ring, 0);
+  terminate(failures);
+ }
+
+ delay();
+ while (0 != (value = ring_pop(ring)))
+ {
+  if (value != expected)
+   break;
+  expected++;
+ }
+ check(0 == value && NUMBER_OF_VALUES + 1 == expected,
+       "pop the values of the ring in order");
+ join_child(pid);
+
+ check(ERROR == createring(0, RING_CAPACITY + 1),
+       "create a ring whose capacity is not a power of two fails");
+ check(ALL_OK == unmap(ring), "unmap the ring");
+ check(ALL_OK == close(handle), "close the ring");
+}
+
+/*! The producer writes more bytes than the pipe holds and closes the pipe,
+    the consumer reads up to the end of the stream. */
+static void
+test_pipe(void)
+{
+ long          handles[2];
+ unsigned char buffer[512];
+ long          received = 0;
+ long          count;
+ long          pid;
+ long          i;
+ int           same = 1;
+
+ check(ALL_OK == createpipe(handles), "create a pipe");
+
+ pid = start_child();
+ if (0 == pid)
+ {
+  long sent = 0;
+
+  close(handles[0]);
+  while (sent < PIPE_BYTES)
+  {
+   long written;
+
+   count = PIPE_BYTES - sent;
+   if (count > (long) sizeof(buffer))
+    count = sizeof(buffer);
+   for (i = 0; i < count; i++)
+    buffer[i] = (unsigned char) (sent + i);
+   written = write(handles[1], buffer, count);
+   check(written > 0, "write to a pipe");
+   if (written <= 0)
+    break;
+   sent += written;
+  }
+  close(handles[1]);
+  terminate(failures);
+ }
+
+ /* The producer holds the only write end, its exit ends the stream. */
+ close(handles[1]);
+ delay();
+ check(ERROR == read(handles[0], (void *) UNMAPPED_ADDRESS, sizeof(buffer)),
+       "read into an unmapped buffer fails");
+ while ((count = read(handles[0], buffer, sizeof(buffer))) > 0)
+ {
+  for (i = 0; i < count; i++)
+   same = same && (unsigned char) (received + i) == buffer[i];
+  received += count;
+ }
+ check(0 == count && PIPE_BYTES == received,
+       "read the stream of a pipe up to its end");
+ check(same, "the bytes read from a pipe");
+ check(ALL_OK == close(handles[0]), "close the read end of a pipe");
+ join_child(pid);
+
+ check(ERROR == createpipe((long *) UNMAPPED_ADDRESS),
+       "create a pipe with an unmapped handle array fails");
+
+ /* Nobody reads the bytes. */
+ check(ALL_OK == createpipe(handles), "create a pipe");
+ check(ERROR == write(handles[1], (void *) UNMAPPED_ADDRESS, 1),
+       "write from an unmapped buffer fails");
+ close(handles[0]);
+ check(ERROR == write(handles[1], buffer, 1),
+       "write to a pipe whose read end is closed fails");
+ close(handles[1]);
+}
+
+/*! The consumer takes down a semaphore before the producer has upped it. */
+static void
+test_semaphore(void)
+{
+ const long semaphore = createsemaphore(0);
+ long       pid;
+ long       i;
+
+ check(semaphore >= 0, "create a semaphore");
+ if (semaphore < 0)
+  return;
+
+ pid = start_child();
+ if (0 == pid)
+ {
+  delay();
+  for (i = 0; i < NUMBER_OF_UPS; i++)
+   check(ALL_OK == semaphoreup(semaphore), "up a semaphore");
+  terminate(failures);
+ }
+
+ for (i = 0; i < NUMBER_OF_UPS; i++)
+  check(ALL_OK == semaphoredown(semaphore), "down a semaphore");
+ join_child(pid);
+
+ check(ALL_OK == close(semaphore), "close a semaphore");
+ check(ERROR == semaphoreup(semaphore), "up through a closed handle fails");
+}
+
+/*! The handle table grows as handles are opened and a copy made by fork
+    gets all of them. */
+static void
+test_handles(void)
+{
+ long semaphores[NUMBER_OF_HANDLES];
+ long pid;
+ int  i, j;
+
+ for (i = 0; i < NUMBER_OF_HANDLES; i++)
+ {
+  semaphores[i] = createsemaphore(1);
+  check(semaphores[i] >= 0, "create many semaphores");
+  if (semaphores[i] < 0)
+  {
+   while (i-- > 0)
+    close(semaphores[i]);
+   return;
+  }
+ }
+ for (i = 0; i < NUMBER_OF_HANDLES; i++)
+  for (j = i + 1; j < NUMBER_OF_HANDLES; j++)
+   check(semaphores[i] != semaphores[j], "handles are distinct");
+
+ /* The counts are one, so each down returns at once. */
+ pid = start_child();
+ if (0 == pid)
+ {
+  for (i = 0; i < NUMBER_OF_HANDLES; i++)
+   check(ALL_OK == semaphoredown(semaphores[i]),
+         "the copy uses every handle of the parent");
+  terminate(failures);
+ }
+ join_child(pid);
+
+ for (i = 0; i < NUMBER_OF_HANDLES; i++)
+  check(ALL_OK == close(semaphores[i]), "close many semaphores");
+ check(ERROR == close(semaphores[NUMBER_OF_HANDLES - 1]),
+       "close of a closed handle fails");
+}
+
+/*! Reads one-shot and periodic timers. */
+static void
+test_timers(void)
+{
+ long timer = createtimer(10, 0);
+
+ check(timer >= 0, "create a one-shot timer");
+ if (timer >= 0)
+ {
+  check(1 == readtimer(timer), "a one-shot timer expires");
+  check(ERROR == readtimer(timer), "a one-shot timer expires only once");
+  check(ALL_OK == close(timer), "close a one-shot timer");
+ }
+
+ timer = createtimer(5, 1);
+ check(timer >= 0, "create a periodic timer");
+ if (timer >= 0)
+ {
+  check(readtimer(timer) >= 1, "a periodic timer expires");
+  /* The expirations are counted while nobody reads the timer. */
+  delay();
+  check(readtimer(timer) >= 2, "a periodic timer counts missed expirations");
+  check(ALL_OK == close(timer), "close a periodic timer");
+  check(ERROR == readtimer(timer), "read through a closed handle fails");
+ }
+}
+
+/*! The consumer waits in a poll set for a pipe, a semaphore and a timer
+    while the producer writes, ups and closes the pipe. */
+static void
+test_poll_set(void)
+{
+ const long        set = createpollset();
+ const long        semaphore = createsemaphore(0);
+ const long        timer = createtimer(10, 0);
+ struct poll_event events[NUMBER_OF_EVENTS];
+ long              handles[2];
+ char              buffer[16];
+ long              pid;
+ long              count;
+ long              length;
+ long              waits;
+ long              i;
+ int               seen_data = 0;
+ int               seen_end = 0;
+ int               seen_semaphore = 0;
+ int               seen_timer = 0;
+
+ check(set >= 0 && semaphore >= 0 && timer >= 0 &&
+       ALL_OK == createpipe(handles), "create the handles to poll");
+ check(ALL_OK == pollcontrol(set, handles[0], POLL_READABLE, COOKIE_PIPE) &&
+       ALL_OK == pollcontrol(set, semaphore, POLL_READABLE,
+                             COOKIE_SEMAPHORE) &&
+       ALL_OK == pollcontrol(set, timer, POLL_READABLE, COOKIE_TIMER),
+       "register handles in a poll set");
+ check(ERROR == pollcontrol(set, set, POLL_READABLE, 0),
+       "a poll set cannot be registered in a poll set");
+ check(ERROR == pollwait(set, (struct poll_event *) UNMAPPED_ADDRESS,
+                         NUMBER_OF_EVENTS),
+       "wait in a poll set with an unmapped event array fails");
+
+ pid = start_child();
+ if (0 == pid)
+ {
+  close(handles[0]);
+  delay();
+  check(1 == write(handles[1], "x", 1), "write to a polled pipe");
+  check(ALL_OK == semaphoreup(semaphore), "up a polled semaphore");
+  close(handles[1]);
+  terminate(failures);
+ }
+
+ /* The producer holds the only write end, its exit ends the stream. */
+ close(handles[1]);
+ for (waits = 0; waits < MAXIMUM_WAITS &&
+      !(seen_data && seen_end && seen_semaphore && seen_timer); waits++)
+ {
+  count = pollwait(set, events, NUMBER_OF_EVENTS);
+  check(count > 0 && count <= NUMBER_OF_EVENTS, "wait in a poll set");
+  if (count <= 0)
+   break;
+
+  for (i = 0; i < count; i++)
+  {
+   check(POLL_READABLE == events[i].events, "the events of a handle");
+   switch (events[i].cookie)
+   {
+    case COOKIE_PIPE:
+     length = read(handles[0], buffer, sizeof(buffer));
+     check(length >= 0, "read a polled pipe");
+     if (length > 0)
+      seen_data = 1;
+     else
+     {
+      /* The end of the stream stays readable. */
+      seen_end = 1;
+      pollcontrol(set, handles[0], 0, 0);
+     }
+     break;
+    case COOKIE_SEMAPHORE:
+     seen_semaphore = ALL_OK == semaphoredown(semaphore);
+     break;
+    case COOKIE_TIMER:
+     seen_timer = readtimer(timer) >= 1;
+     break;
+    default:
+     check(0, "the cookie of a handle");
+   }
+  }
+ }
+ check(seen_data, "a poll set reports a pipe with data");
+ check(seen_end, "a poll set reports the end of a pipe");
+ check(seen_semaphore, "a poll set reports an upped semaphore");
+ check(seen_timer, "a poll set reports an expired timer");
+ join_child(pid);
+ close(handles[0]);
+
+ /* A registration does not keep the write end of a pipe open. */
+ check(ALL_OK == createpipe(handles), "create a pipe");
+ check(ALL_OK == pollcontrol(set, handles[1], POLL_WRITABLE, COOKIE_PIPE),
+       "register the write end of a pipe");
+ close(handles[1]);
+ check(0 == read(handles[0], buffer, sizeof(buffer)),
+       "closing a registered write end ends the stream");
+ close(handles[0]);
+
+ check(ALL_OK == close(timer), "close a polled timer");
+ check(ALL_OK == close(semaphore), "close a polled semaphore");
+ check(ALL_OK == close(set), "close a poll set");
+ check(ERROR == pollwait(set, events, NUMBER_OF_EVENTS),
+       "wait through a closed handle fails");
+}
+
+int
+main(int argc, char* argv[])
+{
+ prints("Process 5: Testing the system calls between processes.\n");
+
+ test_shared_memory();
+ test_shared_memory_key();
+ test_channel();
+ test_ring();
+ test_pipe();
+ test_semaphore();
+ test_handles();
+ test_timers();
+ test_poll_set();
+
+ if (0 == failures)
+  prints("Process 5: All checks passed.\n");
+ return failures;
+}
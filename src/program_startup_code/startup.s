@@ -7,8 +7,8 @@
  .text
  .global _start
 _start:
- # Set up the stack pointer
- lea    stack(%rip),%rsp
+ # The kernel starts us with the stack pointer at the top of a stack which
+ # grows as it is used
  # Set up the environment for the main function
  lea    name(%rip),%rax
  mov    %rax,argv(%rip)
@@ -17,7 +17,10 @@ _start:
  # Call the main function
  mov    $1,%rdi
  call   main
- # Perform a terminate system call
+ # Perform a terminate system call with the return value of main as the
+ # exit status. Main returns an int, so the upper half of rax is undefined
+ # and the value is sign extended
+ movslq %eax,%rdi
  mov    $6,%rax
  syscall
  # We will never come back from the system call if it is implemented properly
@@ -32,5 +35,3 @@ name:
  .align 8
 argv:
  .skip  16
- .skip  8*1024
-stack: